@@ -34,22 +34,57 @@ int debug_level;
 void print_usage(char *name)
 {
 	fprintf(stderr, "v4l2_decode version " VERSION " date " DATE "\n\n");
-	fprintf(stderr, "usage: %s [OPTS] <URL>\n", name);
+	fprintf(stderr, "usage: %s [OPTS] <URL>...\n", name);
 	fprintf(stderr, "Where OPTS is a combination of:\n"
-	        "  -m <device>     video device (default /dev/video32)\n"
+	        "  -m <device>     video device (default /dev/video32); when\n"
+	        "                  repeated, or \"auto\" for all the decoders,\n"
+	        "                  streams go to the least loaded one\n"
+	        "  -a <allocator>  buffer allocation: ion (default), mmap\n"
+	        "                  or dmabuf\n"
+	        "  -A <w>x<h>      adaptive playback: allocate capture buffers\n"
+	        "                  for renditions up to <w>x<h>\n"
+	        "  -b              benchmark mode: decode as fast as possible\n"
+	        "                  without display and print statistics\n"
 	        "  -c              set \"continue data transfer\" flag\n"
 	        "  -d              output frames in decode order\n"
 	        "  -f              start fullscreen\n"
 	        "  -i              skip frames\n"
 	        "  -p              start paused\n"
+	        "  -P <p>[,<p>...] priorities of the streams, by url; when\n"
+	        "                  the decoders are full, streams of lower\n"
+	        "                  priority are decoded I-frames only first\n"
 	        "  -s              secure mode\n"
 	        "  -v              increase debug verbosity\n"
 	        "  -q              remove all debug output\n"
 		"\n");
 }
 
+static int
+parse_priorities(struct instance *i, char *list)
+{
+	char *end;
+
+	i->priorities = calloc(i->url_count, sizeof (*i->priorities));
+	if (!i->priorities)
+		return -1;
+
+	/* streams left out get priority 0 */
+	for (int n = 0; n < i->url_count && *list; n++) {
+		i->priorities[n] = strtol(list, &end, 10);
+		if (end == list || (*end && *end != ',')) {
+			err("bad priority list %s", list);
+			return -1;
+		}
+
+		list = *end ? end + 1 : end;
+	}
+
+	return 0;
+}
+
 int parse_args(struct instance *i, int argc, char **argv)
 {
+	char *priorities = NULL;
 	int c;
 
 	memset(i, 0, sizeof (*i));
@@ -58,12 +93,43 @@ int parse_args(struct instance *i, int argc, char **argv)
 
 	debug_level = 2;
 
-	while ((c = getopt(argc, argv, "cdfhim:o:pqsv")) != -1) {
+	while ((c = getopt(argc, argv, "a:A:bcdfhim:o:pP:qsv")) != -1) {
 		switch (c) {
+		case 'a':
+			if (!strcmp(optarg, "ion")) {
+				i->video.alloc = VIDEO_ALLOC_ION;
+			} else if (!strcmp(optarg, "mmap")) {
+				i->video.alloc = VIDEO_ALLOC_MMAP;
+			} else if (!strcmp(optarg, "dmabuf")) {
+				i->video.alloc = VIDEO_ALLOC_DMABUF;
+			} else {
+				err("unknown allocator %s", optarg);
+				return -1;
+			}
+			break;
+		case 'A':
+			if (sscanf(optarg, "%dx%d", &i->max_width,
+				   &i->max_height) != 2 ||
+			    i->max_width <= 0 || i->max_height <= 0) {
+				err("bad adaptive playback size %s", optarg);
+				return -1;
+			}
+			/* lets the decoder switch to a smaller size without
+			 * a reconfiguration */
+			i->continue_data_transfer = 1;
+			break;
+		case 'b':
+			i->bench = 1;
+			break;
 		case 'c':
 			i->continue_data_transfer = 1;
 			break;
 		case 'm':
+			if (i->device_name_count == MAX_DEVICES) {
+				err("too many devices");
+				return -1;
+			}
+			i->device_names[i->device_name_count++] = optarg;
 			i->video.name = optarg;
 			break;
 		case 'd':
@@ -75,6 +141,9 @@ int parse_args(struct instance *i, int argc, char **argv)
 		case 'p':
 			i->paused = 1;
 			break;
+		case 'P':
+			priorities = optarg;
+			break;
 		case 'q':
 			debug_level = 0;
 			break;
@@ -99,7 +168,18 @@ int parse_args(struct instance *i, int argc, char **argv)
 		return -1;
 	}
 
-	i->url = argv[optind];
+	/* one stream is decoded for each url */
+	i->urls = &argv[optind];
+	i->url_count = argc - optind;
+	i->url = i->urls[0];
+
+	if (priorities && parse_priorities(i, priorities))
+		return -1;
+
+	if (i->secure && i->video.alloc != VIDEO_ALLOC_ION) {
+		err("secure mode requires ion buffers");
+		return -1;
+	}
 
 	return 0;
 }
@@ -0,0 +1,222 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Microbenchmark of the start code scanning and escaping helpers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Usage: bitstream_bench [file]
+ *
+ * Runs the byte-at-a-time loops the application used before against the
+ * vectorized helpers of bitstream.c, over the content of file, or over
+ * random data if no file is given. Raw WMV3/VC-1 frames can be extracted
+ * with e.g. "ffmpeg -i in.wmv -c:v copy -f rawvideo out.rcv".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "bitstream.h"
+
+#define DEFAULT_SIZE	(16 * 1024 * 1024)
+#define MIN_RUN_TIME_US	(1000 * 1000)
+
+int debug_level = 1;
+
+/* keeps the benchmarked calls from being optimized out */
+static volatile int sink;
+
+static int
+ref_escape(uint8_t *dst, int dst_size, const uint8_t *src, int src_size)
+{
+	uint8_t *dstp = dst;
+	const uint8_t *srcp = src;
+	const uint8_t *end = src + src_size;
+	int count = 0;
+
+	(void)dst_size;
+
+	while (srcp < end) {
+		if (count == 2 && *srcp <= 0x03) {
+			*dstp++ = 0x03;
+			count = 0;
+		}
+
+		if (*srcp == 0)
+			count++;
+		else
+			count = 0;
+
+		*dstp++ = *srcp++;
+	}
+
+	return dstp - dst;
+}
+
+static int
+ref_find_sc(const uint8_t *data, int size)
+{
+	for (int i = 0; i + 2 < size; i++) {
+		if (data[i + 0] == 0x00 &&
+		    data[i + 1] == 0x00 &&
+		    data[i + 2] == 0x01)
+			return i;
+	}
+
+	return -1;
+}
+
+static uint64_t
+get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int
+load_file(const char *path, uint8_t **data)
+{
+	FILE *f;
+	long size;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		err("cannot open %s: %m", path);
+		return -1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	*data = malloc(size);
+	if (!*data || fread(*data, 1, size, f) != (size_t)size) {
+		err("cannot read %s", path);
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+
+	return size;
+}
+
+static void
+gen_data(uint8_t *data, int size)
+{
+	/* mostly random bytes, with zero runs frequent enough to need
+	 * escaping now and then */
+	for (int n = 0; n < size; n++)
+		data[n] = (rand() % 64) ? rand() : 0;
+}
+
+/* Scan the whole buffer for start codes, as the parser does */
+static int
+scan_all(int (*find)(const uint8_t *, int), const uint8_t *data, int size)
+{
+	int count = 0;
+	int pos = 0;
+	int n;
+
+	while ((n = find(data + pos, size - pos)) >= 0) {
+		pos += n + 3;
+		count++;
+	}
+
+	return count;
+}
+
+#define BENCH(name, size, expr)						\
+	({								\
+		uint64_t start = get_time_us(), elapsed;		\
+		int runs = 0;						\
+		do {							\
+			sink = (expr);					\
+			runs++;						\
+			elapsed = get_time_us() - start;		\
+		} while (elapsed < MIN_RUN_TIME_US);			\
+		double mbps = (double)(size) * runs / elapsed;		\
+		printf("%-16s %9.1f MB/s\n", name, mbps);		\
+		mbps;							\
+	})
+
+int main(int argc, char **argv)
+{
+	uint8_t *data, *dst_ref, *dst;
+	int size, dst_size;
+	int ref_len, len, ref_count, count;
+	double ref_mbps, mbps;
+
+	if (argc > 1) {
+		size = load_file(argv[1], &data);
+		if (size < 0)
+			return 1;
+	} else {
+		size = DEFAULT_SIZE;
+		data = malloc(size);
+		if (!data)
+			return 1;
+		gen_data(data, size);
+	}
+
+	dst_size = size * 3 / 2 + 1;
+	dst_ref = malloc(dst_size);
+	dst = malloc(dst_size);
+	if (!dst_ref || !dst)
+		return 1;
+
+	ref_len = ref_escape(dst_ref, dst_size, data, size);
+	len = bitstream_escape(dst, dst_size, data, size);
+	if (len != ref_len || memcmp(dst, dst_ref, len)) {
+		err("escaped output differs from the reference");
+		return 1;
+	}
+
+	ref_count = scan_all(ref_find_sc, data, size);
+	count = scan_all(bitstream_find_sc, data, size);
+	if (count != ref_count) {
+		err("found %d start codes, reference found %d",
+		    count, ref_count);
+		return 1;
+	}
+
+	printf("%d bytes, %d escapes, %d start codes\n",
+	       size, len - size, count);
+
+	ref_mbps = BENCH("escape (ref)", size,
+			 ref_escape(dst_ref, dst_size, data, size));
+	mbps = BENCH("escape", size,
+		     bitstream_escape(dst, dst_size, data, size));
+	printf("%-16s %9.2fx\n", "speedup", mbps / ref_mbps);
+
+	ref_mbps = BENCH("find_sc (ref)", size,
+			 scan_all(ref_find_sc, data, size));
+	mbps = BENCH("find_sc", size,
+		     scan_all(bitstream_find_sc, data, size));
+	printf("%-16s %9.2fx\n", "speedup", mbps / ref_mbps);
+
+	free(data);
+	free(dst_ref);
+	free(dst);
+
+	return 0;
+}
@@ -0,0 +1,987 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Elementary stream helpers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "bitstream.h"
+
+#define DBG_TAG "    bs"
+
+static const uint8_t start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+/*
+ * Both start codes (00 00 01) and the sequences which need emulation
+ * prevention (00 00 00..03) are two zero bytes followed by a byte in a
+ * small range. find_seq() returns the first position >= start where
+ * such a sequence begins, or -1.
+ */
+static int
+find_seq_scalar(const uint8_t *data, int start, int size,
+		uint8_t lo, uint8_t hi)
+{
+	for (int i = start; i + 2 < size; i++) {
+		/* a byte larger than hi cannot be part of a sequence, skip
+		 * past it */
+		if (data[i + 2] > hi) {
+			i += 2;
+			continue;
+		}
+
+		if (data[i] == 0x00 && data[i + 1] == 0x00 &&
+		    data[i + 2] >= lo)
+			return i;
+	}
+
+	return -1;
+}
+
+#if defined(__SSE2__)
+static int
+find_seq(const uint8_t *data, int start, int size, uint8_t lo, uint8_t hi)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i vlo = _mm_set1_epi8(lo);
+	const __m128i vrange = _mm_set1_epi8(hi - lo);
+	int i;
+
+	/* test 16 candidate positions at once against all three bytes */
+	for (i = start; i + 18 <= size; i += 16) {
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+		__m128i b2 = _mm_loadu_si128((const __m128i *)(data + i + 2));
+		__m128i m, r;
+		int mask;
+
+		/* lo <= b2 <= hi, as an unsigned saturated subtraction */
+		r = _mm_subs_epu8(_mm_sub_epi8(b2, vlo), vrange);
+
+		m = _mm_and_si128(_mm_cmpeq_epi8(b0, zero),
+				  _mm_cmpeq_epi8(b1, zero));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(r, zero));
+
+		mask = _mm_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return find_seq_scalar(data, i, size, lo, hi);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static int
+find_seq(const uint8_t *data, int start, int size, uint8_t lo, uint8_t hi)
+{
+	const uint8x16_t vlo = vdupq_n_u8(lo);
+	const uint8x16_t vrange = vdupq_n_u8(hi - lo);
+	int i;
+
+	for (i = start; i + 18 <= size; i += 16) {
+		uint8x16_t b0 = vld1q_u8(data + i);
+		uint8x16_t b1 = vld1q_u8(data + i + 1);
+		uint8x16_t b2 = vld1q_u8(data + i + 2);
+		uint8x16_t m;
+
+		m = vandq_u8(vceqzq_u8(b0), vceqzq_u8(b1));
+		m = vandq_u8(m, vcleq_u8(vsubq_u8(b2, vlo), vrange));
+
+		/* no movemask on NEON, locate the match with the scalar
+		 * loop once we know the block contains one */
+		if (vmaxvq_u8(m))
+			return find_seq_scalar(data, i, i + 18, lo, hi);
+	}
+
+	return find_seq_scalar(data, i, size, lo, hi);
+}
+#else
+static int
+find_seq(const uint8_t *data, int start, int size, uint8_t lo, uint8_t hi)
+{
+	return find_seq_scalar(data, start, size, lo, hi);
+}
+#endif
+
+int
+bitstream_find_sc(const uint8_t *data, int size)
+{
+	return find_seq(data, 0, size, 0x01, 0x01);
+}
+
+int
+bitstream_escape(uint8_t *dst, int dst_size, const uint8_t *src, int src_size)
+{
+	int written = 0;
+	int start = 0;
+	int n, len;
+
+	while (start < src_size) {
+		n = find_seq(src, start, src_size, 0x00, 0x03);
+
+		/* copy up to the third byte of the sequence, then insert the
+		 * emulation prevention byte before it */
+		len = (n < 0 ? src_size : n + 2) - start;
+		if (len + (n >= 0) > dst_size - written)
+			return -1;
+
+		memcpy(dst + written, src + start, len);
+		written += len;
+		start += len;
+
+		if (n < 0)
+			break;
+
+		dst[written++] = 0x03;
+	}
+
+	return written;
+}
+
+static int
+is_parameter_set(struct annexb *a, uint8_t nal_header)
+{
+	int type;
+
+	if (a->hevc) {
+		/* VPS, SPS, PPS */
+		type = (nal_header >> 1) & 0x3f;
+		return type >= 32 && type <= 34;
+	}
+
+	/* SPS, PPS */
+	type = nal_header & 0x1f;
+	return type == 7 || type == 8;
+}
+
+static int
+read_length(const uint8_t *p, int length_size)
+{
+	uint32_t len = 0;
+
+	for (int n = 0; n < length_size; n++)
+		len = len << 8 | p[n];
+
+	return len > INT32_MAX ? -1 : (int)len;
+}
+
+/* Append one NAL unit from the codec data to the parameter sets */
+static int
+add_parameter_set(struct annexb *a, const uint8_t *nal, int size)
+{
+	uint8_t *ps;
+
+	ps = realloc(a->ps, a->ps_size + sizeof (start_code) + size);
+	if (!ps)
+		return -1;
+
+	memcpy(ps + a->ps_size, start_code, sizeof (start_code));
+	memcpy(ps + a->ps_size + sizeof (start_code), nal, size);
+
+	a->ps = ps;
+	a->ps_size += sizeof (start_code) + size;
+
+	return 0;
+}
+
+static int
+parse_avcc(struct annexb *a, const uint8_t *data, int size)
+{
+	const uint8_t *end = data + size;
+	const uint8_t *p;
+	int count, len;
+
+	if (size < 7)
+		return -1;
+
+	a->length_size = (data[4] & 0x03) + 1;
+
+	/* SPS, then PPS */
+	p = data + 5;
+	for (int k = 0; k < 2; k++) {
+		if (p >= end)
+			return -1;
+
+		count = k == 0 ? *p & 0x1f : *p;
+		p++;
+
+		while (count--) {
+			if (end - p < 2)
+				return -1;
+			len = p[0] << 8 | p[1];
+			p += 2;
+			if (end - p < len)
+				return -1;
+			if (add_parameter_set(a, p, len) < 0)
+				return -1;
+			p += len;
+		}
+	}
+
+	return 0;
+}
+
+static int
+parse_hvcc(struct annexb *a, const uint8_t *data, int size)
+{
+	const uint8_t *end = data + size;
+	const uint8_t *p;
+	int arrays, count, len;
+
+	if (size < 23)
+		return -1;
+
+	a->length_size = (data[21] & 0x03) + 1;
+	arrays = data[22];
+
+	p = data + 23;
+	while (arrays--) {
+		/* array_completeness, reserved, NAL type, then count */
+		if (end - p < 3)
+			return -1;
+		count = p[1] << 8 | p[2];
+		p += 3;
+
+		while (count--) {
+			if (end - p < 2)
+				return -1;
+			len = p[0] << 8 | p[1];
+			p += 2;
+			if (end - p < len)
+				return -1;
+			if (add_parameter_set(a, p, len) < 0)
+				return -1;
+			p += len;
+		}
+	}
+
+	return 0;
+}
+
+int
+annexb_init(struct annexb *a, int hevc,
+	    const uint8_t *extradata, int extradata_size)
+{
+	int ret;
+
+	memset(a, 0, sizeof (*a));
+	a->hevc = hevc;
+	a->need_ps = 1;
+
+	if (extradata_size == 0)
+		return 0;
+
+	if (bitstream_find_sc(extradata, MIN(extradata_size, 4)) >= 0) {
+		/* codec data is already Annex-B, use it as is */
+		a->ps = malloc(extradata_size);
+		if (!a->ps)
+			return -1;
+
+		memcpy(a->ps, extradata, extradata_size);
+		a->ps_size = extradata_size;
+		return 0;
+	}
+
+	if (hevc)
+		ret = parse_hvcc(a, extradata, extradata_size);
+	else
+		ret = parse_avcc(a, extradata, extradata_size);
+
+	if (ret < 0) {
+		err("cannot parse %s codec data", hevc ? "hvcC" : "avcC");
+		annexb_free(a);
+		return -1;
+	}
+
+	dbg("%s codec data, %d bytes NAL length, %d bytes parameter sets",
+	    hevc ? "hvcC" : "avcC", a->length_size, a->ps_size);
+
+	return 0;
+}
+
+/* Check whether the packet carries its own parameter sets. Also walks
+ * the whole packet so that corrupt length prefixes or missing start
+ * codes are caught before anything is written. */
+static int
+packet_has_ps(struct annexb *a, const uint8_t *src, int size)
+{
+	int has_ps = 0;
+	int pos, len, n;
+
+	if (a->length_size) {
+		for (pos = 0; pos < size; pos += len) {
+			if (size - pos < a->length_size)
+				return -1;
+			len = read_length(src + pos, a->length_size);
+			pos += a->length_size;
+			if (len < 0 || len > size - pos)
+				return -1;
+			if (len > 0 && is_parameter_set(a, src[pos]))
+				has_ps = 1;
+		}
+
+		return has_ps;
+	}
+
+	pos = bitstream_find_sc(src, size);
+	if (pos < 0)
+		return -1;
+
+	while (pos >= 0) {
+		pos += 3;
+		if (pos < size && is_parameter_set(a, src[pos]))
+			has_ps = 1;
+
+		n = bitstream_find_sc(src + pos, size - pos);
+		pos = n < 0 ? n : pos + n;
+	}
+
+	return has_ps;
+}
+
+int
+annexb_write(struct annexb *a, uint8_t *dst, int dst_size,
+	     const uint8_t *src, int src_size, int key)
+{
+	int has_ps, written, pos, len, n;
+
+	has_ps = packet_has_ps(a, src, src_size);
+	if (has_ps < 0) {
+		err("corrupt %s packet", a->hevc ? "HEVC" : "H.264");
+		return -1;
+	}
+
+	written = 0;
+
+	if ((a->need_ps || key) && !has_ps && a->ps_size) {
+		if (a->ps_size > dst_size)
+			return -1;
+
+		memcpy(dst, a->ps, a->ps_size);
+		written = a->ps_size;
+	}
+
+	a->need_ps = 0;
+
+	if (!a->length_size) {
+		/* already Annex-B, skip any garbage before the first start
+		 * code */
+		n = bitstream_find_sc(src, src_size);
+		while (n > 0 && src[n - 1] == 0x00)
+			n--;
+
+		if (n > 0)
+			dbg("skipping %d bytes before first start code", n);
+
+		if (src_size - n > dst_size - written)
+			return -1;
+
+		memcpy(dst + written, src + n, src_size - n);
+
+		return written + src_size - n;
+	}
+
+	for (pos = 0; pos < src_size; pos += len) {
+		len = read_length(src + pos, a->length_size);
+		pos += a->length_size;
+
+		if ((int)sizeof (start_code) + len > dst_size - written)
+			return -1;
+
+		memcpy(dst + written, start_code, sizeof (start_code));
+		written += sizeof (start_code);
+		memcpy(dst + written, src + pos, len);
+		written += len;
+	}
+
+	return written;
+}
+
+int
+annexb_rewrite_prefix(struct annexb *a, int key)
+{
+	return a->need_ps || key ? a->ps_size : 0;
+}
+
+int
+annexb_rewrite(struct annexb *a, uint8_t *dst, int prefix, int size)
+{
+	uint8_t *p = dst + prefix;
+	int pos, len;
+
+	if (a->length_size && a->length_size != sizeof (start_code))
+		return -1;
+
+	/* start codes and length prefixes have the same size */
+	for (pos = 0; a->length_size && pos < size; pos += len) {
+		if (size - pos < a->length_size)
+			return -1;
+		len = read_length(p + pos, a->length_size);
+		memcpy(p + pos, start_code, sizeof (start_code));
+		pos += a->length_size;
+		if (len < 0 || len > size - pos)
+			return -1;
+	}
+
+	memcpy(dst, a->ps, prefix);
+	a->need_ps = 0;
+
+	return prefix + size;
+}
+
+void
+annexb_free(struct annexb *a)
+{
+	free(a->ps);
+	a->ps = NULL;
+	a->ps_size = 0;
+}
+
+/*
+ * Frame classification, from the first bytes of the frame headers only.
+ * A frame is a reference unless its header shows that no later frame
+ * depends on it: neither its pixels nor any state carried over, such as
+ * the VP8 segmentation or the VP9 probability contexts.
+ */
+
+/* MSB first reader, reading zeros past the end */
+struct bits {
+	const uint8_t *data;
+	int size;
+	int pos;
+};
+
+static unsigned int
+read_bits(struct bits *b, int n)
+{
+	unsigned int v = 0;
+
+	while (n--) {
+		int byte = b->pos >> 3;
+
+		v <<= 1;
+		if (byte < b->size)
+			v |= (b->data[byte] >> (7 - (b->pos & 7))) & 1;
+		b->pos++;
+	}
+
+	return v;
+}
+
+static unsigned int
+read_ue(struct bits *b)
+{
+	int zeros = 0;
+
+	while (!read_bits(b, 1)) {
+		if (++zeros > 31)
+			return UINT32_MAX;
+	}
+
+	return (1u << zeros) - 1 + read_bits(b, zeros);
+}
+
+static int
+bits_overrun(struct bits *b)
+{
+	return b->pos > b->size * 8;
+}
+
+/* Remove the emulation prevention bytes from the start of a NAL unit */
+static int
+unescape(uint8_t *dst, int dst_size, const uint8_t *src, int src_size)
+{
+	int zeros = 0;
+	int n = 0;
+
+	for (int i = 0; i < src_size && n < dst_size; i++) {
+		if (zeros >= 2 && src[i] == 0x03) {
+			zeros = 0;
+			continue;
+		}
+
+		zeros = src[i] ? 0 : zeros + 1;
+		dst[n++] = src[i];
+	}
+
+	return n;
+}
+
+/* Offset of the first NAL unit header after pos in an Annex-B stream */
+static int
+next_nal(const uint8_t *data, int size, int pos)
+{
+	int n = bitstream_find_sc(data + pos, size - pos);
+
+	return n < 0 ? -1 : pos + n + 3;
+}
+
+static int
+classify_h264(const uint8_t *data, int size, struct frame_info *info)
+{
+	static const enum frame_type slice_types[] = {
+		FRAME_P, FRAME_B, FRAME_I, FRAME_P, FRAME_I,	/* SP, SI */
+	};
+	uint8_t header[16];
+	struct bits b;
+	unsigned int slice_type;
+	int pos, type, has_ps = 0;
+
+	for (pos = next_nal(data, size, 0); pos >= 0 && pos < size;
+	     pos = next_nal(data, size, pos)) {
+		type = data[pos] & 0x1f;
+		if (type == 7 || type == 8)
+			has_ps = 1;
+		if (type != 1 && type != 5)
+			continue;
+
+		b = (struct bits){ header, 0, 0 };
+		b.size = unescape(header, sizeof (header),
+				  data + pos + 1, size - pos - 1);
+
+		read_ue(&b);	/* first_mb_in_slice */
+		slice_type = read_ue(&b);
+		if (bits_overrun(&b) || slice_type > 9)
+			return -1;
+
+		info->type = slice_types[slice_type % 5];
+		/* nal_ref_idc, in-band parameter sets are needed too */
+		info->ref = (data[pos] & 0x60) || has_ps;
+		return 0;
+	}
+
+	return -1;
+}
+
+static int
+classify_hevc(struct classify_state *state, const uint8_t *data, int size,
+	      struct frame_info *info)
+{
+	int pos, type, temporal_id, highest, has_ps = 0;
+
+	for (pos = next_nal(data, size, 0); pos >= 0 && pos + 1 < size;
+	     pos = next_nal(data, size, pos)) {
+		type = (data[pos] >> 1) & 0x3f;
+		if (type >= 32 && type <= 34)
+			has_ps = 1;
+
+		/* sps_max_sub_layers_minus1, after sps_video_parameter_set_id */
+		if (type == 33 && pos + 2 < size)
+			state->hevc_sps_sub_layers =
+				((data[pos + 2] >> 1) & 0x07) + 1;
+
+		if (type > 31)
+			continue;
+
+		temporal_id = (data[pos + 1] & 0x07) - 1;
+		if (temporal_id > state->hevc_max_temporal_id)
+			state->hevc_max_temporal_id = temporal_id;
+		highest = state->hevc_sps_sub_layers ?
+			state->hevc_sps_sub_layers - 1 :
+			state->hevc_max_temporal_id;
+
+		/* P and B slices cannot be told apart without the
+		 * parameter sets */
+		info->type = type >= 16 && type <= 23 ? FRAME_I : FRAME_P;
+
+		/* TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and the reserved
+		 * sub-layer non-reference types can still be referenced by
+		 * higher sub-layers, only those of the highest one are
+		 * unused */
+		info->ref = type > 14 || (type & 1) || has_ps ||
+			    temporal_id < highest;
+		return 0;
+	}
+
+	return -1;
+}
+
+static int
+classify_mpeg2(const uint8_t *data, int size, struct frame_info *info)
+{
+	struct bits b;
+	int pos, type;
+
+	for (pos = next_nal(data, size, 0); pos >= 0 && pos < size;
+	     pos = next_nal(data, size, pos)) {
+		/* picture start code */
+		if (data[pos] != 0x00)
+			continue;
+
+		b = (struct bits){ data + pos + 1, size - pos - 1, 0 };
+		read_bits(&b, 10);	/* temporal_reference */
+		type = read_bits(&b, 3);	/* picture_coding_type */
+		if (bits_overrun(&b) || type < 1 || type > 4)
+			return -1;
+
+		/* D pictures are intra coded too */
+		info->type = type == 2 ? FRAME_P : type == 3 ? FRAME_B :
+			FRAME_I;
+		info->ref = type != 3;
+		return 0;
+	}
+
+	return -1;
+}
+
+/* VP8 boolean decoder, RFC 6386 section 7 */
+struct bool_decoder {
+	const uint8_t *data;
+	const uint8_t *end;
+	unsigned int value;
+	unsigned int range;
+	int bit_count;
+};
+
+static void
+bool_init(struct bool_decoder *d, const uint8_t *data, int size)
+{
+	d->data = data;
+	d->end = data + size;
+	d->value = 0;
+	d->range = 255;
+	d->bit_count = 0;
+
+	for (int n = 0; n < 2; n++) {
+		d->value <<= 8;
+		if (d->data < d->end)
+			d->value |= *d->data++;
+	}
+}
+
+static int
+bool_read(struct bool_decoder *d, int prob)
+{
+	unsigned int split = 1 + (((d->range - 1) * prob) >> 8);
+	unsigned int bigsplit = split << 8;
+	int bit;
+
+	if (d->value >= bigsplit) {
+		bit = 1;
+		d->range -= split;
+		d->value -= bigsplit;
+	} else {
+		bit = 0;
+		d->range = split;
+	}
+
+	while (d->range < 128) {
+		d->value <<= 1;
+		d->range <<= 1;
+		if (++d->bit_count == 8) {
+			d->bit_count = 0;
+			if (d->data < d->end)
+				d->value |= *d->data++;
+		}
+	}
+
+	return bit;
+}
+
+static unsigned int
+bool_read_literal(struct bool_decoder *d, int n)
+{
+	unsigned int v = 0;
+
+	while (n--)
+		v = v << 1 | bool_read(d, 128);
+
+	return v;
+}
+
+/* Walk the frame header of an inter frame up to its refresh flags,
+ * RFC 6386 section 9 */
+static int
+classify_vp8(const uint8_t *data, int size, struct frame_info *info)
+{
+	struct bool_decoder d;
+	int first_part_size;
+	int golden, altref, copies, entropy, last;
+
+	if (size < 3)
+		return -1;
+
+	/* key frames refresh every reference */
+	if (!(data[0] & 1)) {
+		info->type = FRAME_I;
+		info->ref = 1;
+		return 0;
+	}
+
+	info->type = FRAME_P;
+	info->ref = 1;
+
+	first_part_size = (data[0] | data[1] << 8 | data[2] << 16) >> 5;
+	bool_init(&d, data + 3, MIN(first_part_size, size - 3));
+
+	/* segmentation_enabled, then update_mb_segmentation_map and
+	 * update_segment_feature_data, which persist */
+	if (bool_read_literal(&d, 1) && bool_read_literal(&d, 2))
+		return 0;
+
+	bool_read_literal(&d, 1 + 6 + 3);	/* filter type and level */
+
+	/* loop_filter_adj_enable, then mode_ref_lf_delta_update */
+	if (bool_read_literal(&d, 1) && bool_read_literal(&d, 1))
+		return 0;
+
+	bool_read_literal(&d, 2);	/* log2_nbr_of_dct_partitions */
+
+	bool_read_literal(&d, 7);	/* y_ac_qi */
+	for (int n = 0; n < 5; n++) {
+		if (bool_read_literal(&d, 1))
+			bool_read_literal(&d, 4 + 1);
+	}
+
+	golden = bool_read_literal(&d, 1);
+	altref = bool_read_literal(&d, 1);
+	copies = 0;
+	if (!golden)
+		copies |= bool_read_literal(&d, 2);
+	if (!altref)
+		copies |= bool_read_literal(&d, 2);
+	bool_read_literal(&d, 2);	/* sign biases */
+	entropy = bool_read_literal(&d, 1);
+	last = bool_read_literal(&d, 1);
+
+	info->ref = golden || altref || copies || entropy || last;
+
+	return 0;
+}
+
+static void
+vp9_skip_color_config(struct bits *b, int profile)
+{
+	if (profile >= 2)
+		read_bits(b, 1);	/* ten_or_twelve_bit */
+
+	/* anything but sRGB */
+	if (read_bits(b, 3) != 7) {
+		read_bits(b, 1);	/* color_range */
+		if (profile == 1 || profile == 3)
+			read_bits(b, 3);	/* subsampling */
+	} else if (profile == 1 || profile == 3) {
+		read_bits(b, 1);
+	}
+}
+
+/* Walk the uncompressed header up to refresh_frame_context */
+/* Returns 1 if the loop filter deltas are updated */
+static int
+vp9_skip_loop_filter_params(struct bits *b)
+{
+	int update = 0;
+
+	read_bits(b, 6);	/* filter_level */
+	read_bits(b, 3);	/* sharpness_level */
+
+	/* loop_filter_delta_enabled, loop_filter_delta_update */
+	if (read_bits(b, 1) && read_bits(b, 1)) {
+		update = 1;
+
+		/* 4 ref deltas and 2 mode deltas, su(6) */
+		for (int n = 0; n < 4 + 2; n++) {
+			if (read_bits(b, 1))
+				read_bits(b, 7);
+		}
+	}
+
+	return update;
+}
+
+static void
+vp9_skip_quantization_params(struct bits *b)
+{
+	read_bits(b, 8);	/* base_q_idx */
+
+	/* delta_q_y_dc, delta_q_uv_dc, delta_q_uv_ac, su(4) */
+	for (int n = 0; n < 3; n++) {
+		if (read_bits(b, 1))
+			read_bits(b, 5);
+	}
+}
+
+/* Returns 1 if the segmentation map or data is updated, which is all
+ * that is left to read */
+static int
+vp9_segmentation_updated(struct bits *b)
+{
+	/* segmentation_enabled */
+	if (!read_bits(b, 1))
+		return 0;
+
+	/* segmentation_update_map */
+	if (read_bits(b, 1))
+		return 1;
+
+	/* segmentation_update_data */
+	return read_bits(b, 1);
+}
+
+static int
+classify_vp9_frame(const uint8_t *data, int size, struct frame_info *info)
+{
+	struct bits b = { data, size, 0 };
+	int profile, show_frame, error_resilient, intra_only;
+	int reset_context, refresh, refresh_context, persistent;
+
+	if (read_bits(&b, 2) != 2)	/* frame_marker */
+		return -1;
+
+	profile = read_bits(&b, 1);
+	profile |= read_bits(&b, 1) << 1;
+	if (profile == 3)
+		read_bits(&b, 1);
+
+	/* show_existing_frame, which costs nothing to decode */
+	if (read_bits(&b, 1))
+		return -1;
+
+	/* key frames refresh every reference */
+	if (!read_bits(&b, 1)) {
+		info->type = FRAME_I;
+		info->ref = 1;
+		return 0;
+	}
+
+	show_frame = read_bits(&b, 1);
+	error_resilient = read_bits(&b, 1);
+	intra_only = show_frame ? 0 : read_bits(&b, 1);
+	reset_context = error_resilient ? 0 : read_bits(&b, 2);
+
+	if (intra_only) {
+		read_bits(&b, 24);	/* frame_sync_code */
+		if (profile > 0)
+			vp9_skip_color_config(&b, profile);
+		refresh = read_bits(&b, 8);
+		read_bits(&b, 32);	/* frame_size */
+		if (read_bits(&b, 1))	/* render_and_frame_size_different */
+			read_bits(&b, 32);
+
+		info->type = FRAME_I;
+	} else {
+		int found_ref = 0;
+
+		refresh = read_bits(&b, 8);
+		read_bits(&b, 3 * 4);	/* ref_frame_idx, sign bias */
+
+		for (int n = 0; n < 3 && !found_ref; n++)
+			found_ref = read_bits(&b, 1);
+		if (!found_ref)
+			read_bits(&b, 32);	/* frame_size */
+		if (read_bits(&b, 1))	/* render_and_frame_size_different */
+			read_bits(&b, 32);
+
+		read_bits(&b, 1);	/* allow_high_precision_mv */
+		if (!read_bits(&b, 1))	/* is_filter_switchable */
+			read_bits(&b, 2);
+
+		info->type = FRAME_P;
+	}
+
+	refresh_context = 0;
+	if (!error_resilient) {
+		refresh_context = read_bits(&b, 1);
+		read_bits(&b, 1);	/* frame_parallel_decoding_mode */
+	}
+
+	read_bits(&b, 2);	/* frame_context_idx */
+
+	/* loop filter and segmentation updates persist to later frames */
+	persistent = vp9_skip_loop_filter_params(&b);
+	vp9_skip_quantization_params(&b);
+	persistent |= vp9_segmentation_updated(&b);
+
+	if (bits_overrun(&b))
+		return -1;
+
+	/* reset_frame_context 2 and 3 reset the saved contexts, error
+	 * resilient and intra only frames reset them all */
+	info->ref = refresh || refresh_context || reset_context >= 2 ||
+		    error_resilient || intra_only || persistent;
+
+	return 0;
+}
+
+/* A superframe is a reference if any of its frames is, and is shown as
+ * its last frame */
+static int
+classify_vp9(const uint8_t *data, int size, struct frame_info *info)
+{
+	uint8_t marker;
+	int frames, mag, index_size;
+	const uint8_t *index;
+
+	if (size < 1)
+		return -1;
+
+	marker = data[size - 1];
+	frames = (marker & 0x07) + 1;
+	mag = ((marker >> 3) & 0x03) + 1;
+	index_size = 2 + mag * frames;
+
+	if ((marker & 0xe0) != 0xc0 || size < index_size ||
+	    data[size - index_size] != marker)
+		return classify_vp9_frame(data, size, info);
+
+	index = data + size - index_size + 1;
+	info->ref = 0;
+
+	for (int n = 0, pos = 0; n < frames; n++) {
+		struct frame_info frame;
+		uint32_t frame_size = 0;
+
+		for (int m = 0; m < mag; m++)
+			frame_size |= (uint32_t)*index++ << (m * 8);
+
+		if (frame_size > (uint32_t)(size - index_size - pos) ||
+		    classify_vp9_frame(data + pos, frame_size, &frame) < 0)
+			return -1;
+
+		info->type = frame.type;
+		info->ref |= frame.ref;
+		pos += frame_size;
+	}
+
+	return 0;
+}
+
+int
+bitstream_classify(struct classify_state *state, uint32_t fourcc,
+		   const uint8_t *data, int size, struct frame_info *info)
+{
+	switch (fourcc) {
+	case V4L2_PIX_FMT_H264:
+		return classify_h264(data, size, info);
+	case V4L2_PIX_FMT_HEVC:
+		return classify_hevc(state, data, size, info);
+	case V4L2_PIX_FMT_MPEG2:
+		return classify_mpeg2(data, size, info);
+	case V4L2_PIX_FMT_VP8:
+		return classify_vp8(data, size, info);
+	case V4L2_PIX_FMT_VP9:
+		return classify_vp9(data, size, info);
+	default:
+		return -1;
+	}
+}
@@ -0,0 +1,93 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Elementary stream helpers header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef INCLUDE_BITSTREAM_H
+#define INCLUDE_BITSTREAM_H
+
+#include <stdint.h>
+
+/* Return the offset of the first 00 00 01 start code in data, or -1 */
+int bitstream_find_sc(const uint8_t *data, int size);
+
+/* Copy src to dst, inserting an emulation prevention byte (0x03) after
+ * any two zero bytes followed by a byte <= 0x03. Returns the number of
+ * bytes written, or -1 if dst is too small. */
+int bitstream_escape(uint8_t *dst, int dst_size,
+		     const uint8_t *src, int src_size);
+
+/* Converter from length-prefixed (AVCC/hvcC) H.264/HEVC to Annex-B */
+struct annexb {
+	int hevc;
+
+	/* size of the NAL length prefix, 0 if the input is already
+	 * Annex-B */
+	int length_size;
+
+	/* parameter sets from the codec data, in Annex-B form */
+	uint8_t *ps;
+	int ps_size;
+	int need_ps;
+};
+
+int annexb_init(struct annexb *a, int hevc,
+		const uint8_t *extradata, int extradata_size);
+
+/* Write one packet to dst in Annex-B form, prepending the parameter sets
+ * to the first packet and to key frames which do not carry their own.
+ * Returns the number of bytes written, or -1 if the packet is corrupt or
+ * does not fit. */
+int annexb_write(struct annexb *a, uint8_t *dst, int dst_size,
+		 const uint8_t *src, int src_size, int key);
+
+/* Room to leave in front of a packet for annexb_rewrite() */
+int annexb_rewrite_prefix(struct annexb *a, int key);
+
+/* Turn to Annex-B in place a packet of size bytes stored at dst + prefix,
+ * prefix being what annexb_rewrite_prefix() returned, writing the
+ * parameter sets in front of it if prefix is not 0. Only 4 bytes NAL
+ * length prefixes can be rewritten in place. Returns the size of the
+ * packet now at dst, or -1 if it is corrupt. */
+int annexb_rewrite(struct annexb *a, uint8_t *dst, int prefix, int size);
+
+void annexb_free(struct annexb *a);
+
+enum frame_type {
+	FRAME_I,
+	FRAME_P,
+	FRAME_B,
+};
+
+struct frame_info {
+	enum frame_type type;
+	int ref;	/* later frames may depend on it */
+};
+
+/* What is learnt from the frames of a stream, zeroed at its start */
+struct classify_state {
+	int hevc_sps_sub_layers;	/* sps_max_sub_layers, 0 if unknown */
+	int hevc_max_temporal_id;	/* highest TemporalId seen */
+};
+
+/* Classify a compressed frame of the V4L2 format fourcc: an Annex-B
+ * H.264 or HEVC access unit, an MPEG-2 picture, or a VP8 or VP9 frame.
+ * Frames are passed in decoding order. Returns -1 for other formats or
+ * if the headers cannot be parsed. */
+int bitstream_classify(struct classify_state *state, uint32_t fourcc,
+		       const uint8_t *data, int size, struct frame_info *info);
+
+#endif /* INCLUDE_BITSTREAM_H */
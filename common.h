@@ -26,14 +26,19 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <termios.h>
+#include <linux/videodev2.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 
+#include "bitstream.h"
+#include "device.h"
 #include "display.h"
 #include "list.h"
+#include "ring.h"
 
 extern int debug_level;
 
@@ -55,12 +60,15 @@ extern int debug_level;
 	print(3, DBG_TAG ": " msg "\n", ##__VA_ARGS__)
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define memzero(x)	memset(&(x), 0, sizeof (x));
 
 /* Maximum number of output buffers */
 #define MAX_OUT_BUF		16
 
+_Static_assert(MAX_OUT_BUF <= RING_SIZE, "free buffer ring too small");
+
 /* Maximum number of capture buffers (32 is the limit imposed by MFC */
 #define MAX_CAP_BUF		32
 
@@ -73,17 +81,59 @@ extern int debug_level;
 /* Maximum number of planes used in the application */
 #define MAX_PLANES		CAP_PLANES
 
+/* Buffer allocation backends */
+enum video_alloc {
+	VIDEO_ALLOC_ION,	/* USERPTR with ION buffers (MSM) */
+	VIDEO_ALLOC_MMAP,	/* driver buffers, exported with EXPBUF */
+	VIDEO_ALLOC_DMABUF,	/* buffers from a dma-buf heap */
+};
+
+/* timestamps of a frame pending in the decoder */
+struct ts_entry {
+	uint64_t pts;
+	uint64_t dts;
+	uint64_t duration;
+	uint64_t base;
+	uint64_t queued;
+};
+
+/* capture buffer allocated by the application, kept in a pool across
+ * reconfigurations of the CAPTURE queue */
+struct cap_buf {
+	int id;		/* identifies the buffer, never reused */
+	int index;	/* V4L2 buffer index, -1 if unused */
+	int fd;
+	void *addr;
+	size_t size;	/* allocation size, a size class */
+};
+
+struct stateless;
+
 /* video decoder related parameters */
 struct video {
 	char *name;
 	int fd;
 
+	enum video_alloc alloc;
+	enum v4l2_memory memory;
+
+	/* MSM driver, with its own events, controls and buffer flags;
+	 * otherwise a standard stateful decoder is assumed */
+	int msm;
+
+	/* stateless decoder backend, NULL for stateful decoders */
+	struct stateless *stateless;
+
 	/* Output queue related */
 	int out_buf_cnt;
 	int out_buf_size;
 	int out_buf_off[MAX_OUT_BUF];
 	char *out_buf_addr[MAX_OUT_BUF];
-	int out_buf_flag[MAX_OUT_BUF];
+	/* queued to the driver, set by the parser thread before queueing,
+	 * cleared by the main thread once dequeued */
+	atomic_int out_buf_flag[MAX_OUT_BUF];
+	int out_buf_fd[MAX_OUT_BUF];
+	struct ring out_free;	/* free buffers, main -> parser thread */
 	int out_ion_fd;
 	int out_ion_size;
 	void *out_ion_addr;
@@ -93,18 +143,29 @@ struct video {
 	int cap_h;
 	int cap_buf_cnt;
 	uint32_t cap_buf_format;
+	int cap_mem_planes;	/* V4L2 planes, including extradata */
 	int cap_planes_count;
 	int cap_plane_off[CAP_PLANES];
 	int cap_plane_stride[CAP_PLANES];
 	int cap_buf_flag[MAX_CAP_BUF];
+	int cap_buf_held[MAX_CAP_BUF];	/* reference frame, stateless */
 	int cap_buf_size;
 	int cap_buf_fd[MAX_CAP_BUF];
 	void *cap_buf_addr[MAX_CAP_BUF];
+	int cap_buf_id[MAX_CAP_BUF];
+	int cap_buf_next_id;
+
+	/* ION and dma-buf heap buffers, see video_setup_capture() */
+	struct cap_buf cap_pool[MAX_CAP_BUF];
+	int cap_pool_count;
 
-	/* timestamp list for all pending frames */
-	struct list_head pending_ts_list;
+	/* timestamp heap for all pending frames, ordered by DTS */
+	struct ts_entry *pending_ts;
+	int pending_ts_count;
+	int pending_ts_size;
 	uint64_t cap_last_pts;
 	uint64_t pts_dts_delta;
+	atomic_int dts_timestamps;	/* OUTPUT buffers carry the DTS */
 
 	/* Extradata stuff */
 	int extradata_index;
@@ -116,11 +177,58 @@ struct video {
 
 	/* Metrics */
 	unsigned long total_captured;
+	uint64_t total_bytes;
+	uint64_t first_queued;
+	uint64_t last_captured;
+	unsigned long cap_wakeups;
+	unsigned long cap_dequeues;
+	unsigned long out_wakeups;
+	unsigned long out_dequeues;
+
+	/* Benchmark latency samples, in microseconds */
+	uint64_t *latency;
+	int latency_count;
+	int latency_size;
+};
+
+/* CAPTURE queue reconfiguration, see restart_capture() */
+struct reconfig {
+	pthread_t thread;
+	int running;		/* set by the main thread */
+	atomic_int done;	/* set by the helper thread */
+	int again;		/* requested again while running */
+	int ret;
+	int width;
+	int height;
+	struct fb *fbs[MAX_CAP_BUF];	/* imported by the helper thread */
+
+	/* in microseconds */
+	uint64_t start;
+	uint64_t setup_time;
+	uint64_t import_time;
+	uint64_t total_time;
+	uint64_t max_time;
+	unsigned int count;
+};
+
+struct loop;
+struct loop_source;
+struct player;
+struct reader;
+struct sched;
+
+/* Ways of catching up with a late stream, in the order they are tried */
+enum catch_up {
+	CATCH_UP_NONE,
+	CATCH_UP_DROP_NONREF,	/* packets no frame depends on are not sent */
+	CATCH_UP_IFRAMES,	/* I-frames only, on the MSM decoder */
 };
 
 struct instance {
 	int width;
 	int height;
+	int max_width;		/* adaptive playback, 0 if disabled */
+	int max_height;
 	int fullscreen;
 	uint32_t fourcc;
 	int fps_n, fps_d;
@@ -128,39 +236,85 @@ struct instance {
 	int interlaced;
 	int decode_order;
 	int skip_frames;
+	atomic_int catch_up;	/* enum catch_up, see update_catch_up() */
+	uint64_t catch_up_since;
+	unsigned long dropped_packets;
+	struct classify_state classify;	/* parser thread */
+	atomic_int hidden;	/* the compositor does not show the window */
 	int insert_sc;
 	int need_header;
 	int secure;
 	int continue_data_transfer;
+	int bench;
 	char *url;
+	char **urls;		/* all the streams given on the command line */
+	int url_count;
+	char *device_names[MAX_DEVICES];
+	int device_name_count;
+	int *priorities;	/* by url, NULL if not given */
+
+	/* decoder node the stream was admitted on, and the load it adds;
+	 * streams of higher priority are admitted first */
+	struct device *device;
+	uint64_t load;
+	int priority;
 
 	/* video decoder related parameters */
 	struct video	video;
 
 	pthread_mutex_t lock;
-	pthread_cond_t cond;
+
+	/* Parser thread and its wakeup */
+	pthread_t parser_thread;
+	int parser_evfd;
+	atomic_int parser_waiting;
+
+	/* Main thread wakeup */
+	int main_evfd;
+
+	struct player *player;
+
+	/* Main thread event loop, shared by all the streams */
+	struct loop *loop;
+	struct loop_source *video_src;
+	struct loop_source *wakeup_src;
 
 	/* Control */
-	int sigfd;
-	int paused;
-	int prerolled;
-	int finish;  /* Flag set when decoding has been completed and all
-			threads finish */
+	atomic_int paused;
+	atomic_int prerolled;
+	atomic_int finish;  /* Flag set when decoding has been completed and
+			       all threads finish */
 
 	int reconfigure_pending;
-	int group;
+	struct reconfig reconfig;
 
 	struct display *display;
 	struct window *window;
-	struct list_head fb_list;
+	struct sched *sched;	/* paces the frames shown in window */
+	/* window buffers of the capture buffers, by buffer index, and those
+	 * of previous reconfigurations still in use by the compositor */
+	struct fb *cap_fb[MAX_CAP_BUF];
+	struct list_head retired_fbs;
+
+	struct reader *reader;
+	AVFormatContext *avctx;
+	AVStream *stream;
+	struct annexb annexb;
+};
+
+/* State shared by the streams decoded by the process */
+struct player {
+	struct loop *loop;
+	struct display *display;
+	struct window *mosaic;	/* shows all the streams, if more than one */
+	struct device_list devices;	/* empty if a single node is used */
 
+	int sigfd;
 	int stdin_valid;
 	struct termios stdin_termios;
 
-	AVFormatContext *avctx;
-	AVStream *stream;
-	AVBSFContext *bsf;
-	int bsf_data_pending;
+	struct instance *instances;
+	int count;
 };
 
 #endif /* INCLUDE_COMMON_H */
@@ -0,0 +1,341 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Decoder device enumeration and stream assignment
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * SoCs with several decoder cores, or machines with several decoder
+ * boards, expose one M2M node per decoder. Streams are spread over them
+ * by their expected load: the macroblock rate of the stream against the
+ * capacity of the node, estimated from the largest frame it decodes at a
+ * nominal frame rate since V4L2 has no way to query it.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "common.h"
+#include "device.h"
+#include "stateless.h"
+
+#define DBG_TAG "   dev"
+
+/* frame rate at which a node is assumed to decode its largest frames */
+#define NOMINAL_FPS		60
+
+/* frame rate assumed when the stream does not tell */
+#define DEFAULT_FPS		30
+
+/* share of the frames decoded when downgraded to I-frames only, for a
+ * typical GOP */
+#define IFRAME_LOAD_DIVISOR	8
+
+static uint64_t
+macroblocks(int width, int height)
+{
+	return (uint64_t)((width + 15) / 16) * ((height + 15) / 16);
+}
+
+uint64_t
+device_stream_load(int width, int height, int fps_n, int fps_d)
+{
+	if (fps_n <= 0 || fps_d <= 0) {
+		fps_n = DEFAULT_FPS;
+		fps_d = 1;
+	}
+
+	return macroblocks(width, height) * fps_n / fps_d;
+}
+
+uint64_t
+device_iframe_load(uint64_t load)
+{
+	return (load + IFRAME_LOAD_DIVISOR - 1) / IFRAME_LOAD_DIVISOR;
+}
+
+/* Largest frame the node decodes in any of its formats */
+static uint64_t
+probe_capacity(int fd, struct device *dev)
+{
+	struct v4l2_frmsizeenum fsize;
+	uint64_t max_mbs = 0;
+
+	for (int n = 0; n < dev->format_count; n++) {
+		memzero(fsize);
+		fsize.pixel_format = dev->formats[n];
+
+		while (!ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fsize)) {
+			if (fsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+				max_mbs = MAX(max_mbs,
+					      macroblocks(fsize.discrete.width,
+							  fsize.discrete.height));
+			} else {
+				max_mbs = MAX(max_mbs,
+					      macroblocks(fsize.stepwise.max_width,
+							  fsize.stepwise.max_height));
+				break;
+			}
+			fsize.index++;
+		}
+	}
+
+	/* no frame sizes reported, assume a 1080p decoder */
+	if (!max_mbs)
+		max_mbs = macroblocks(1920, 1088);
+
+	return max_mbs * NOMINAL_FPS;
+}
+
+/* Fill dev if the node is a decoder: memory-to-memory, with compressed
+ * formats on its OUTPUT queue */
+static int
+probe_device(const char *path, struct device *dev)
+{
+	struct v4l2_capability cap;
+	struct v4l2_fmtdesc fdesc;
+	uint32_t caps;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		dbg("cannot open %s: %m", path);
+		return 0;
+	}
+
+	memzero(cap);
+	if (ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0) {
+		close(fd);
+		return 0;
+	}
+
+	caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ?
+		cap.device_caps : cap.capabilities;
+
+	if (!(caps & V4L2_CAP_VIDEO_M2M_MPLANE) &&
+	    (caps & (V4L2_CAP_VIDEO_CAPTURE_MPLANE |
+		     V4L2_CAP_VIDEO_OUTPUT_MPLANE)) !=
+	    (V4L2_CAP_VIDEO_CAPTURE_MPLANE | V4L2_CAP_VIDEO_OUTPUT_MPLANE)) {
+		close(fd);
+		return 0;
+	}
+
+	memset(dev, 0, sizeof (*dev));
+	snprintf(dev->path, sizeof (dev->path), "%s", path);
+	snprintf(dev->card, sizeof (dev->card), "%s", (char *)cap.card);
+
+	/* V4L2 has no standard control to skip the non-key frames */
+	dev->iframe_only = !strcmp((char *)cap.driver, "msm_vidc_driver");
+
+	memzero(fdesc);
+	fdesc.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+	while (dev->format_count < MAX_DEVICE_FORMATS &&
+	       !ioctl(fd, VIDIOC_ENUM_FMT, &fdesc)) {
+		if (fdesc.flags & V4L2_FMT_FLAG_COMPRESSED)
+			dev->formats[dev->format_count++] = fdesc.pixelformat;
+		fdesc.index++;
+	}
+
+	if (!dev->format_count) {
+		/* an encoder or a converter */
+		close(fd);
+		return 0;
+	}
+
+	dev->capacity = probe_capacity(fd, dev);
+
+	close(fd);
+
+	info("Decoder %s (%s): %d formats, capacity %" PRIu64 " MB/s",
+	     dev->path, dev->card, dev->format_count, dev->capacity);
+
+	return 1;
+}
+
+static int
+compare_video_nodes(const void *a, const void *b)
+{
+	const char *x = *(char * const *)a;
+	const char *y = *(char * const *)b;
+
+	return atoi(x + strlen("video")) - atoi(y + strlen("video"));
+}
+
+/* All the /dev/videoN nodes, in numerical order */
+static int
+find_video_nodes(char ***names)
+{
+	struct dirent *ent;
+	char **list = NULL;
+	int count = 0;
+	DIR *dir;
+
+	dir = opendir("/dev");
+	if (!dir) {
+		err("cannot open /dev: %m");
+		return -1;
+	}
+
+	while ((ent = readdir(dir))) {
+		char **l;
+
+		if (strncmp(ent->d_name, "video", 5))
+			continue;
+
+		l = realloc(list, (count + 1) * sizeof (*list));
+		if (!l)
+			break;
+		list = l;
+
+		list[count] = strdup(ent->d_name);
+		if (list[count])
+			count++;
+	}
+
+	closedir(dir);
+
+	qsort(list, count, sizeof (*list), compare_video_nodes);
+
+	*names = list;
+
+	return count;
+}
+
+int
+device_probe(struct device_list *list, char **names, int count)
+{
+	char **nodes = NULL;
+	char path[32];
+	int node_count;
+
+	list->count = 0;
+
+	if (count == 1 && !strcmp(names[0], "auto")) {
+		node_count = find_video_nodes(&nodes);
+		if (node_count < 0)
+			return -1;
+
+		for (int n = 0; n < node_count; n++) {
+			snprintf(path, sizeof (path), "/dev/%s", nodes[n]);
+			if (list->count < MAX_DEVICES &&
+			    probe_device(path, &list->devices[list->count]))
+				list->count++;
+			free(nodes[n]);
+		}
+
+		free(nodes);
+	} else {
+		for (int n = 0; n < count && list->count < MAX_DEVICES; n++) {
+			if (probe_device(names[n], &list->devices[list->count]))
+				list->count++;
+			else
+				err("%s is not a decoder", names[n]);
+		}
+	}
+
+	if (!list->count)
+		err("no decoder found");
+
+	return list->count;
+}
+
+static int
+device_has_format(struct device *dev, uint32_t fourcc)
+{
+	uint32_t stateless = stateless_format(fourcc);
+
+	for (int n = 0; n < dev->format_count; n++) {
+		if (dev->formats[n] == fourcc ||
+		    (stateless && dev->formats[n] == stateless))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Streams are admitted until the estimated capacity of the decoders is
+ * used up, then downgraded to their I-frames, then rejected. A decoder is
+ * always given its first stream, whatever the estimate says.
+ */
+struct device *
+device_admit(struct device_list *list, uint32_t fourcc, uint64_t load,
+	     uint64_t iframe_load, int *downgraded)
+{
+	struct device *best = NULL;
+	double best_usage = 0;
+
+	for (int n = 0; n < list->count; n++) {
+		struct device *dev = &list->devices[n];
+		double usage;
+
+		if (!device_has_format(dev, fourcc))
+			continue;
+
+		usage = (double)(dev->load + load) / dev->capacity;
+		if (!best || usage < best_usage) {
+			best = dev;
+			best_usage = usage;
+		}
+	}
+
+	if (!best) {
+		err("no decoder for the format %.4s", (char *)&fourcc);
+		return NULL;
+	}
+
+	*downgraded = 0;
+
+	if (best->streams && best->load + load > best->capacity) {
+		load = iframe_load;
+		if (!load || !best->iframe_only ||
+		    best->load + load > best->capacity) {
+			dbg("%s is full, %" PRIu64 " of %" PRIu64 " MB/s used",
+			    best->path, best->load, best->capacity);
+			return NULL;
+		}
+
+		*downgraded = 1;
+	}
+
+	best->load += load;
+	best->streams++;
+
+	dbg("admitted %" PRIu64 " MB/s on %s, %" PRIu64 " of %" PRIu64
+	    " MB/s used", load, best->path, best->load, best->capacity);
+
+	return best;
+}
+
+void
+device_update(struct device *dev, uint64_t old_load, uint64_t load)
+{
+	dev->load -= MIN(old_load, dev->load);
+	dev->load += load;
+}
+
+void
+device_release(struct device *dev, uint64_t load)
+{
+	dev->load -= MIN(load, dev->load);
+	dev->streams--;
+}
@@ -0,0 +1,72 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Decoder device enumeration header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef INCLUDE_DEVICE_H
+#define INCLUDE_DEVICE_H
+
+#include <stdint.h>
+
+/* Maximum number of decoder nodes used by the process */
+#define MAX_DEVICES		16
+
+#define MAX_DEVICE_FORMATS	32
+
+struct device {
+	char path[32];
+	char card[32];
+	uint32_t formats[MAX_DEVICE_FORMATS];	/* compressed OUTPUT formats */
+	int format_count;
+	int iframe_only;	/* streams can be downgraded to their I-frames */
+
+	/* in macroblocks per second */
+	uint64_t capacity;
+	uint64_t load;
+	int streams;
+};
+
+struct device_list {
+	struct device devices[MAX_DEVICES];
+	int count;
+};
+
+/* Probe the decoder nodes named, or all the /dev/video nodes if the only
+ * name is "auto". Nodes which are not memory-to-memory decoders are
+ * skipped. Returns the number of decoders found, or -1. */
+int device_probe(struct device_list *list, char **names, int count);
+
+/* Macroblocks per second needed to decode width x height at fps_n/fps_d */
+uint64_t device_stream_load(int width, int height, int fps_n, int fps_d);
+
+/* Macroblocks per second left when decoding the I-frames only */
+uint64_t device_iframe_load(uint64_t load);
+
+/* Admit a stream of format fourcc, needing load, on the decoder which
+ * would be the least loaded relative to its capacity. If the stream does
+ * not fit, it is admitted decoding its I-frames only, needing iframe_load,
+ * if not 0 and the decoder can; *downgraded is then set. Returns NULL if
+ * the stream is rejected. */
+struct device *device_admit(struct device_list *list, uint32_t fourcc,
+			    uint64_t load, uint64_t iframe_load,
+			    int *downgraded);
+
+/* The load of a stream changed from old_load to load */
+void device_update(struct device *dev, uint64_t old_load, uint64_t load);
+
+void device_release(struct device *dev, uint64_t load);
+
+#endif /* INCLUDE_DEVICE_H */
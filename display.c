@@ -3,6 +3,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
 
 #include <wayland-client.h>
 
@@ -18,10 +22,21 @@
 
 #define DBG_TAG "  disp"
 
+/* Size of a mosaic until the compositor picks one */
+#define MOSAIC_WIDTH	1280
+#define MOSAIC_HEIGHT	720
+
+/* a window is hidden after that many frames discarded in a row, or
+ * without frame callback for that long */
+#define HIDDEN_DISCARDS		3
+#define HIDDEN_US		1000000
+
 struct display {
 	struct wl_display *display;
 	struct wl_registry *registry;
 	struct wl_compositor *compositor;
+	struct wl_subcompositor *subcompositor;
+	struct wl_shm *shm;
 	struct wl_seat *seat;
 	struct wl_keyboard *keyboard;
 	struct wl_shell *wl_shell;
@@ -29,8 +44,10 @@ struct display {
 	struct wl_scaler *scaler;
 	struct wp_viewporter *viewporter;
 	struct wp_presentation *presentation;
+	clockid_t presentation_clock;
 	struct zlinux_dmabuf *dmabuf_legacy;
 	struct zwp_linux_dmabuf_v1 *dmabuf;
+	int dmabuf_immed;
 	uint32_t drm_formats[32];
 	int compositor_version;
 	int seat_version;
@@ -60,6 +77,32 @@ struct window {
 	bool configured;
 	bool fullscreen;
 
+	/* last frame presented, in microseconds of the presentation clock,
+	 * and the refresh interval of the output, 0 if unknown */
+	uint64_t presented;
+	uint32_t refresh;
+
+	/* a frame is committed once the compositor has used the previous
+	 * one, the latest frame shown meanwhile waits until then */
+	struct wl_callback *frame_callback;
+	uint64_t frame_requested;	/* monotonic, in microseconds */
+	struct fb *pending;
+	int discarded_in_row;
+
+	struct window_stats stats;
+
+	/* mosaic: tiles are subsurfaces laid out in a grid over a black
+	 * background */
+	struct wl_buffer *background;
+	struct wl_list tile_list;
+	bool layout_changed;
+
+	/* tile: cell in the mosaic and position of the video in it */
+	struct window *mosaic;
+	struct wl_subsurface *subsurface;
+	int tile_x, tile_y;
+	int x, y;
+
 	window_key_cb_t key_cb;
 	void *user_data;
 };
@@ -100,7 +143,7 @@ fb_apply_extradata(struct fb *fb, const struct msm_vidc_extradata_header *hdr)
 		fb->crop_x = 0;
 		fb->crop_y = 0;
 		fb->crop_w = 0;
-		fb->crop_y = 0;
+		fb->crop_h = 0;
 	}
 }
 
@@ -141,6 +184,15 @@ handle_presented(void *data, struct wp_presentation_feedback *feedback,
 	    fb->index, tv_sec, tv_nsec / 1000000, refresh / 1000000000,
 	    refresh / 1000000);
 
+	fb->window->presented = tv_sec * 1000000 + tv_nsec / 1000;
+	fb->window->refresh = refresh / 1000;
+
+	fb->window->discarded_in_row = 0;
+
+	if (!fb->window->stats.presented++)
+		fb->window->stats.first_presented = fb->window->presented;
+	fb->window->stats.last_presented = fb->window->presented;
+
 	wp_presentation_feedback_destroy(feedback);
 	fb->presentation_feedback = NULL;
 }
@@ -152,6 +204,9 @@ handle_discarded(void *data, struct wp_presentation_feedback *feedback)
 
 	dbg("buffer %d discarded", fb->index);
 
+	fb->window->stats.discarded++;
+	fb->window->discarded_in_row++;
+
 	wp_presentation_feedback_destroy(feedback);
 	fb->presentation_feedback = NULL;
 }
@@ -176,6 +231,39 @@ static const struct wl_callback_listener sync_listener = {
 	sync_callback
 };
 
+static void window_present(struct window *w);
+
+static uint64_t
+time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The compositor is done with the last frame committed, commit the one
+ * which waited for it */
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct window *w = data;
+
+	wl_callback_destroy(callback);
+	w->frame_callback = NULL;
+
+	if (w->pending) {
+		w->buffer = w->pending;
+		w->pending = NULL;
+		window_present(w);
+	}
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
 static void
 window_commit(struct window *w)
 {
@@ -188,9 +276,15 @@ window_commit(struct window *w)
 	wl_surface_set_opaque_region(w->surface, region);
 	wl_region_destroy(region);
 
-	wl_surface_attach(w->surface, fb ? fb->buffer : NULL, 0, 0);
+	wl_surface_attach(w->surface, fb ? fb->buffer : w->background, 0, 0);
 	wl_surface_damage(w->surface, 0, 0, INT_MAX, INT_MAX);
 
+	if (fb && !w->frame_callback) {
+		w->frame_callback = wl_surface_frame(w->surface);
+		wl_callback_add_listener(w->frame_callback, &frame_listener, w);
+		w->frame_requested = time_us();
+	}
+
 	if (fb && display->presentation) {
 		if (fb->presentation_feedback)
 			wp_presentation_feedback_destroy(fb->presentation_feedback);
@@ -213,6 +307,24 @@ window_commit(struct window *w)
 		fb->busy = 1;
 
 	wl_surface_commit(w->surface);
+
+	/* tiles were moved, which only takes effect with the mosaic */
+	if (w->mosaic && w->mosaic->layout_changed && w->mosaic->configured) {
+		w->mosaic->layout_changed = false;
+		window_commit(w->mosaic);
+	}
+}
+
+static void
+tile_set_position(struct window *w, int x, int y)
+{
+	if (x == w->x && y == w->y)
+		return;
+
+	w->x = x;
+	w->y = y;
+	wl_subsurface_set_position(w->subsurface, x, y);
+	w->mosaic->layout_changed = true;
 }
 
 static int
@@ -261,6 +373,11 @@ window_recenter(struct window *w)
 		output_h = w->height;
 	}
 
+	/* center the video in its cell */
+	if (w->mosaic)
+		tile_set_position(w, w->tile_x + (w->width - output_w) / 2,
+				  w->tile_y + (w->height - output_h) / 2);
+
 	dbg("fb %dx%d ar %d:%d src %dx%d%+d%+d dst %dx%d",
 	    fb->width, fb->height, ar_x, ar_y,
 	    (int)src_w, (int)src_h, (int)src_x, (int)src_y,
@@ -285,6 +402,66 @@ window_recenter(struct window *w)
 	return 1;
 }
 
+/* Split the mosaic into a grid with a cell per tile, in creation order */
+static void
+mosaic_layout(struct window *m)
+{
+	struct window *tile;
+	int width, height;
+	int count, cols, rows;
+	int col, row, n = 0;
+
+	width = m->size_set ? m->width : MOSAIC_WIDTH;
+	height = m->size_set ? m->height : MOSAIC_HEIGHT;
+
+	wp_viewport_set_destination(m->viewport, width, height);
+
+	count = wl_list_length(&m->tile_list);
+	for (cols = 1; cols * cols < count; cols++)
+		;
+	rows = count ? (count + cols - 1) / cols : 1;
+
+	wl_list_for_each(tile, &m->tile_list, link) {
+		col = n % cols;
+		row = n / cols;
+
+		tile->tile_x = col * width / cols;
+		tile->tile_y = row * height / rows;
+		tile->width = (col + 1) * width / cols - tile->tile_x;
+		tile->height = (row + 1) * height / rows - tile->tile_y;
+		tile->size_set = true;
+
+		if (window_recenter(tile))
+			wl_surface_commit(tile->surface);
+		n++;
+	}
+
+	dbg("mosaic %dx%d, %d tiles in %dx%d", width, height, count,
+	    cols, rows);
+
+	m->layout_changed = false;
+	if (m->configured)
+		window_commit(m);
+}
+
+static void
+window_configured(struct window *w)
+{
+	if (w->background)
+		mosaic_layout(w);
+	else if (window_recenter(w))
+		window_commit(w);
+}
+
+void
+window_get_presentation(struct window *w, clockid_t *clock,
+			uint64_t *presented, uint32_t *refresh)
+{
+	*clock = w->display->presentation_clock;
+	*presented = w->presented;
+	*refresh = w->refresh;
+}
+
 void
 window_set_aspect_ratio(struct window *w, int ar_x, int ar_y)
 {
@@ -383,8 +560,7 @@ xdg_surface_handle_configure(void *data, struct zxdg_surface_v6 *xdg_surface,
 	zxdg_surface_v6_ack_configure(xdg_surface, serial);
 
 	w->configured = true;
-	if (window_recenter(w))
-		window_commit(w);
+	window_configured(w);
 }
 
 static const struct zxdg_surface_v6_listener xdg_surface_listener = {
@@ -413,8 +589,7 @@ shell_surface_handle_configure(void *data, struct wl_shell_surface *shell_surfac
 	w->size_set = true;
 	w->configured = true;
 
-	if (window_recenter(w))
-		window_commit(w);
+	window_configured(w);
 }
 
 static void
@@ -441,6 +616,7 @@ display_create_window(struct display *display)
 	window->surface = wl_compositor_create_surface(display->compositor);
 	window->ar_x = 1;
 	window->ar_y = 1;
+	wl_list_init(&window->tile_list);
 
 	if (display->xdg_shell) {
 		window->xdg_surface =
@@ -501,11 +677,108 @@ display_find_window_by_surface(struct display *display,
 	return NULL;
 }
 
+/* A single black pixel, scaled to the size of the mosaic */
+static struct wl_buffer *
+create_background(struct display *display)
+{
+	struct wl_shm_pool *pool;
+	struct wl_buffer *buffer;
+	int fd;
+
+	fd = syscall(SYS_memfd_create, "v4l-decode-background", MFD_CLOEXEC);
+	if (fd < 0) {
+		err("failed to create background buffer: %m");
+		return NULL;
+	}
+
+	if (ftruncate(fd, 4) < 0) {
+		err("failed to create background buffer: %m");
+		close(fd);
+		return NULL;
+	}
+
+	pool = wl_shm_create_pool(display->shm, fd, 4);
+	buffer = wl_shm_pool_create_buffer(pool, 0, 1, 1, 4,
+					   WL_SHM_FORMAT_XRGB8888);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	return buffer;
+}
+
+struct window *
+display_create_mosaic(struct display *display)
+{
+	struct window *window;
+
+	if (!display->subcompositor || !display->viewporter || !display->shm) {
+		err("compositor cannot do mosaics");
+		return NULL;
+	}
+
+	window = display_create_window(display);
+	if (!window)
+		return NULL;
+
+	window->background = create_background(display);
+	if (!window->background) {
+		window_destroy(window);
+		return NULL;
+	}
+
+	if (window->configured)
+		mosaic_layout(window);
+
+	return window;
+}
+
+struct window *
+window_create_tile(struct window *mosaic)
+{
+	struct display *display = mosaic->display;
+	struct window *window;
+
+	window = calloc(1, sizeof *window);
+	if (!window)
+		return NULL;
+
+	window->display = display;
+	window->surface = wl_compositor_create_surface(display->compositor);
+	window->ar_x = 1;
+	window->ar_y = 1;
+	wl_list_init(&window->tile_list);
+
+	/* tiles present their frames on their own, only their positions are
+	 * synchronized with the mosaic */
+	window->mosaic = mosaic;
+	window->subsurface =
+		wl_subcompositor_get_subsurface(display->subcompositor,
+						window->surface,
+						mosaic->surface);
+	wl_subsurface_set_desync(window->subsurface);
+	window->configured = true;
+
+	window->viewport = wp_viewporter_get_viewport(display->viewporter,
+						      window->surface);
+
+	wl_list_insert(mosaic->tile_list.prev, &window->link);
+	mosaic_layout(mosaic);
+
+	return window;
+}
+
 void
 window_destroy(struct window *window)
 {
 	wl_list_remove(&window->link);
 
+	if (window->subsurface)
+		wl_subsurface_destroy(window->subsurface);
+	if (window->background)
+		wl_buffer_destroy(window->background);
+	if (window->frame_callback)
+		wl_callback_destroy(window->frame_callback);
+
 	if (window->xdg_toplevel)
 		zxdg_toplevel_v6_destroy(window->xdg_toplevel);
 	if (window->xdg_surface)
@@ -522,17 +795,23 @@ window_destroy(struct window *window)
 	free(window);
 }
 
+static void
+fb_released(struct fb *fb)
+{
+	fb->busy = 0;
+
+	if (fb->release_cb)
+		fb->release_cb(fb, fb->cb_data);
+}
+
 static void
 buffer_release(void *data, struct wl_buffer *buffer)
 {
 	struct fb *fb = data;
 
-	fb->busy = 0;
-
 	dbg("buffer %d released", fb->index);
 
-	if (fb->release_cb)
-		fb->release_cb(fb, fb->cb_data);
+	fb_released(fb);
 }
 
 static const struct wl_buffer_listener buffer_listener = {
@@ -617,15 +896,14 @@ format_is_supported(struct display *display, uint32_t format)
 }
 
 struct fb *
-window_create_buffer(struct window *window, int group, int index, int fd,
-		     uint32_t format, int width, int height, int n_planes,
-		     const int *plane_offsets, const int *plane_strides)
+fb_create(struct window *window, int id, int index, int fd, uint32_t format,
+	  int width, int height, int n_planes, const int *plane_offsets,
+	  const int *plane_strides)
 {
-	struct display *display = window->display;
 	struct fb *fb;
 
 #if 0
-	if (!format_is_supported(display, format)) {
+	if (!format_is_supported(window->display, format)) {
 		err("unsupported display format");
 		return NULL;
 	}
@@ -637,7 +915,10 @@ window_create_buffer(struct window *window, int group, int index, int fd,
 	}
 
 	fb = calloc(1, sizeof *fb);
-	fb->group = group;
+	if (!fb)
+		return NULL;
+
+	fb->id = id;
 	fb->index = index;
 	fb->fd = fd;
 	fb->format = format;
@@ -653,16 +934,36 @@ window_create_buffer(struct window *window, int group, int index, int fd,
 
 	INIT_LIST_HEAD(&fb->link);
 
+	return fb;
+}
+
+/* Send the import requests of a buffer. With linux-dmabuf version 2, the
+ * wl_buffer is created right away, otherwise when the compositor answers
+ * on queue. */
+static void
+fb_import(struct display *display, struct fb *fb, struct wl_event_queue *queue)
+{
 	if (display->dmabuf) {
 		struct zwp_linux_buffer_params_v1 *params =
 			zwp_linux_dmabuf_v1_create_params(display->dmabuf);
 
+		if (!display->dmabuf_immed)
+			wl_proxy_set_queue((struct wl_proxy *)params, queue);
+
 		for (int i = 0; i < fb->n_planes; i++) {
 			zwp_linux_buffer_params_v1_add(params, fb->fd, i,
 						       fb->offsets[i],
 						       fb->strides[i], 0, 0);
 		}
 
+		if (display->dmabuf_immed) {
+			fb->buffer = zwp_linux_buffer_params_v1_create_immed(
+				params, fb->width, fb->height, fb->format, 0);
+			wl_buffer_add_listener(fb->buffer, &buffer_listener, fb);
+			zwp_linux_buffer_params_v1_destroy(params);
+			return;
+		}
+
 		zwp_linux_buffer_params_v1_add_listener(params, &params_listener, fb);
 		zwp_linux_buffer_params_v1_create(params, fb->width, fb->height,
 						  fb->format, 0);
@@ -670,6 +971,8 @@ window_create_buffer(struct window *window, int group, int index, int fd,
 		struct zlinux_buffer_params *params =
 			zlinux_dmabuf_create_params(display->dmabuf_legacy);
 
+		wl_proxy_set_queue((struct wl_proxy *)params, queue);
+
 		for (int i = 0; i < fb->n_planes; i++) {
 			zlinux_buffer_params_add(params, fb->fd, i,
 						 fb->offsets[i],
@@ -680,32 +983,129 @@ window_create_buffer(struct window *window, int group, int index, int fd,
 		zlinux_buffer_params_create(params, fb->width, fb->height,
 					    fb->format, 0);
 	}
+}
 
-	wl_display_roundtrip(display->display);
+int
+window_import_buffers(struct window *window, struct fb **fbs, int count)
+{
+	struct display *display = window->display;
+	struct wl_event_queue *queue = NULL;
+	int imported = 0;
+
+	/* without create_immed, wait for all the imports at once on a
+	 * private queue, so that buffers can be created from another
+	 * thread than the one dispatching events */
+	if (!display->dmabuf_immed) {
+		queue = wl_display_create_queue(display->display);
+		if (!queue)
+			return -1;
+	}
 
-	if (!fb->buffer) {
+	for (int n = 0; n < count; n++)
+		fb_import(display, fbs[n], queue);
+
+	if (queue) {
+		wl_display_roundtrip_queue(display->display, queue);
+
+		/* the buffers inherited the private queue, their release
+		 * events are dispatched with the others */
+		for (int n = 0; n < count; n++) {
+			if (fbs[n]->buffer)
+				wl_proxy_set_queue((struct wl_proxy *)
+						   fbs[n]->buffer, NULL);
+		}
+
+		wl_event_queue_destroy(queue);
+	} else {
+		wl_display_flush(display->display);
+	}
+
+	for (int n = 0; n < count; n++) {
+		if (fbs[n]->buffer) {
+			imported++;
+		} else {
+			fb_destroy(fbs[n]);
+			fbs[n] = NULL;
+		}
+	}
+
+	return imported;
+}
+
+struct fb *
+window_create_buffer(struct window *window, int id, int index, int fd,
+		     uint32_t format, int width, int height, int n_planes,
+		     const int *plane_offsets, const int *plane_strides)
+{
+	struct fb *fb;
+	int ret;
+
+	fb = fb_create(window, id, index, fd, format, width, height,
+		       n_planes, plane_offsets, plane_strides);
+	if (!fb)
+		return NULL;
+
+	ret = window_import_buffers(window, &fb, 1);
+	if (ret < 0)
 		fb_destroy(fb);
+	if (ret <= 0)
 		return NULL;
-	}
 
 	return fb;
 }
 
+static void
+window_present(struct window *w)
+{
+	window_recenter(w);
+	window_commit(w);
+	w->stats.committed++;
+}
+
 void
 window_show_buffer(struct window *window, struct fb *fb,
 		   fb_release_cb_t release_cb, void *cb_data)
 {
+	struct fb *superseded = window->pending;
+
 	fb->release_cb = release_cb;
 	fb->cb_data = cb_data;
 
+	/* at most one frame per refresh: the compositor would discard
+	 * the others, keeping their buffers meanwhile */
+	if (window->frame_callback) {
+		dbg("buffer %d waits for the next refresh", fb->index);
+
+		window->pending = fb;
+		if (superseded && superseded != fb) {
+			dbg("buffer %d superseded", superseded->index);
+			window->stats.superseded++;
+			fb_released(superseded);
+		}
+		return;
+	}
+
 	dbg("present buffer %d", fb->index);
 
 	window->buffer = fb;
 
-	if (window->configured) {
-		window_recenter(window);
-		window_commit(window);
-	}
+	if (window->configured)
+		window_present(window);
+}
+
+void
+window_get_stats(struct window *w, struct window_stats *stats)
+{
+	*stats = w->stats;
+}
+
+int
+window_is_hidden(struct window *w)
+{
+	if (w->discarded_in_row >= HIDDEN_DISCARDS)
+		return 1;
+
+	return w->frame_callback && time_us() - w->frame_requested > HIDDEN_US;
 }
 
 static void
@@ -841,6 +1241,19 @@ static const struct wl_seat_listener seat_listener = {
 	seat_handle_name,
 };
 
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+		      uint32_t clk_id)
+{
+	struct display *d = data;
+
+	d->presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry,
 		       uint32_t id, const char *interface, uint32_t version)
@@ -852,6 +1265,12 @@ registry_handle_global(void *data, struct wl_registry *registry,
 		d->compositor = wl_registry_bind(registry, id,
 						 &wl_compositor_interface,
 						 d->compositor_version);
+	} else if (!strcmp(interface, "wl_subcompositor")) {
+		d->subcompositor = wl_registry_bind(registry, id,
+						    &wl_subcompositor_interface,
+						    1);
+	} else if (!strcmp(interface, "wl_shm")) {
+		d->shm = wl_registry_bind(registry, id, &wl_shm_interface, 1);
 	} else if (!strcmp(interface, "wp_viewporter")) {
 		d->viewporter = wl_registry_bind(registry, id,
 						 &wp_viewporter_interface, 1);
@@ -862,6 +1281,8 @@ registry_handle_global(void *data, struct wl_registry *registry,
 		d->presentation = wl_registry_bind(registry, id,
 						   &wp_presentation_interface,
 						   1);
+		wp_presentation_add_listener(d->presentation,
+					     &presentation_listener, d);
 	} else if (!strcmp(interface, "zxdg_shell_v6")) {
 		d->xdg_shell = wl_registry_bind(registry, id,
 						&zxdg_shell_v6_interface, 1);
@@ -871,8 +1292,11 @@ registry_handle_global(void *data, struct wl_registry *registry,
 		d->wl_shell = wl_registry_bind(registry, id,
 					       &wl_shell_interface, 1);
 	} else if (!strcmp(interface, "zwp_linux_dmabuf_v1")) {
+		/* version 2 adds create_immed */
+		d->dmabuf_immed = version >= 2;
 		d->dmabuf = wl_registry_bind(registry, id,
-					     &zwp_linux_dmabuf_v1_interface, 1);
+					     &zwp_linux_dmabuf_v1_interface,
+					     MIN(version, 2));
 		zwp_linux_dmabuf_v1_add_listener(d->dmabuf, &dmabuf_listener,
 						 d);
 	} else if (!strcmp(interface, "zlinux_dmabuf")) {
@@ -913,6 +1337,10 @@ display_destroy(struct display *display)
 		wp_viewporter_destroy(display->viewporter);
 	if (display->presentation)
 		wp_presentation_destroy(display->presentation);
+	if (display->subcompositor)
+		wl_subcompositor_destroy(display->subcompositor);
+	if (display->shm)
+		wl_shm_destroy(display->shm);
 	if (display->compositor)
 		wl_compositor_destroy(display->compositor);
 	if (display->xdg_shell)
@@ -945,6 +1373,8 @@ display_create(void)
 		goto fail;
 	}
 
+	display->presentation_clock = CLOCK_MONOTONIC;
+
 	display->registry = wl_display_get_registry(display->display);
 	wl_registry_add_listener(display->registry, &registry_listener,
 				 display);
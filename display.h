@@ -3,6 +3,7 @@
 
 #include <wayland-client.h>
 #include <stdint.h>
+#include <time.h>
 #include <media/msm_vidc.h>
 
 #include "list.h"
@@ -20,7 +21,7 @@ typedef void (*window_key_cb_t)(struct window *w, uint32_t time, uint32_t key,
 
 struct fb {
 	struct window *window;
-	int group;
+	int id;		/* capture buffer id */
 	int index;
 	int fd;
 	int offsets[FB_MAX_PLANES];
@@ -45,6 +46,12 @@ struct wl_display *display_get_wl_display(struct display *display);
 struct display *display_create(void);
 int display_is_running(struct display *display);
 struct window *display_create_window(struct display *display);
+
+/* A window showing its tiles side by side, as subsurfaces which the
+ * compositor can put on planes of their own. Tiles are destroyed before
+ * their mosaic. */
+struct window *display_create_mosaic(struct display *display);
+struct window *window_create_tile(struct window *mosaic);
 void display_destroy(struct display *display);
 
 void window_set_user_data(struct window *w, void *data);
@@ -53,12 +60,48 @@ void window_set_key_callback(struct window *w, window_key_cb_t handler);
 void window_set_aspect_ratio(struct window *w, int ar_x, int ar_y);
 void window_toggle_fullscreen(struct window *w);
 
+/* Clock of the presentation times, time the last frame of the window was
+ * presented in microseconds, or 0, and refresh interval of its output in
+ * microseconds, or 0 if unknown */
+void window_get_presentation(struct window *w, clockid_t *clock,
+			     uint64_t *presented, uint32_t *refresh);
+
+struct window_stats {
+	unsigned long committed;	/* frames committed */
+	unsigned long superseded;	/* replaced before being committed */
+	unsigned long presented;	/* shown, as told by the compositor */
+	unsigned long discarded;	/* committed but never shown */
+
+	/* first and last frames shown, in the presentation clock */
+	uint64_t first_presented;
+	uint64_t last_presented;
+};
+
+void window_get_stats(struct window *w, struct window_stats *stats);
+
+/* Whether the compositor stopped showing the window: it discarded its
+ * last frames, or has not asked for a new one for a while */
+int window_is_hidden(struct window *w);
+
+/* Show fb, or once the compositor has used the frame shown before, in
+ * which case fb replaces and releases any frame already waiting */
 void window_show_buffer(struct window *window, struct fb *fb,
 			fb_release_cb_t release_cb, void *cb_data);
-struct fb *window_create_buffer(struct window *window, int group, int index,
+struct fb *window_create_buffer(struct window *window, int id, int index,
 				int fd, uint32_t format, int width, int height,
 				int n_planes, const int *plane_offsets,
 				const int *plane_strides);
+
+/* Allocate a buffer description, imported with window_import_buffers() */
+struct fb *fb_create(struct window *window, int id, int index, int fd,
+		     uint32_t format, int width, int height, int n_planes,
+		     const int *plane_offsets, const int *plane_strides);
+
+/* Import several buffers, without waiting for the compositor with
+ * linux-dmabuf version 2, else with a single roundtrip. Failed buffers are
+ * destroyed and set to NULL; returns the number of buffers imported, or
+ * -1. */
+int window_import_buffers(struct window *window, struct fb **fbs, int count);
 void window_destroy(struct window *window);
 
 void fb_apply_extradata(struct fb *fb,
@@ -0,0 +1,1451 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * H.264 parsing for stateless decoders
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Stateless decoders are given the parameter sets and the slice header
+ * fields of every frame, along with the list of reference frames: the
+ * decoded picture buffer. The picture order counts (8.2.1), the
+ * reference picture marking (8.2.5) and the output order of the frames
+ * (C.4.5) are worked out here. Decoders taking whole frames are
+ * supported, which build the reference picture lists themselves; so only
+ * the first slice header of a frame is parsed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "h264.h"
+
+#define DBG_TAG "  h264"
+
+#ifdef V4L2_CID_STATELESS_H264_DECODE_PARAMS
+
+#define MAX_SPS		32
+#define MAX_PPS		256
+#define MAX_MMCO	66
+
+/* Largest parameter set or slice header parsed, once unescaped */
+#define RBSP_SIZE	2048
+
+#define NAL_SLICE	1
+#define NAL_IDR_SLICE	5
+#define NAL_SPS		7
+#define NAL_PPS		8
+
+enum scaling_list {
+	LIST_ABSENT,
+	LIST_PRESENT,
+	LIST_DEFAULT,
+};
+
+/* Scaling lists in raster order, as they are given to the decoder */
+struct scaling {
+	uint8_t list4x4[6][16];
+	uint8_t list8x8[6][64];
+};
+
+struct sps {
+	int valid;
+	struct v4l2_ctrl_h264_sps v4l2;
+	int scaling_present;
+	struct scaling scaling;	/* after fall-back rule A */
+	int dpb_size;		/* frames */
+	int max_reorder;	/* frames waiting for output */
+};
+
+struct pps {
+	int valid;
+	struct v4l2_ctrl_h264_pps v4l2;
+	int scaling_present;
+	enum scaling_list state[12];
+	struct scaling scaling;	/* lists present only */
+};
+
+struct slice {
+	int nal_ref_idc;
+	int idr;
+	int slice_type;
+	int pps_id;
+	int frame_num;
+	int idr_pic_id;
+	int poc_lsb;
+	int delta_poc_bottom;
+	int delta_poc[2];
+	int poc_bit_size;
+	int marking_bit_size;
+
+	int long_term_reference;
+	int adaptive_marking;
+	int mmco_count;
+	struct {
+		int op;
+		int pic_num_diff;	/* difference_of_pic_nums_minus1 + 1 */
+		int long_term;		/* pic num, frame idx or max idx + 1 */
+	} mmco[MAX_MMCO];
+};
+
+struct ref {
+	uint64_t ts;
+	int frame_num;
+	int long_term;
+	int long_term_frame_idx;
+	int top_poc;
+	int bottom_poc;
+	int non_existing;	/* inferred from a frame_num gap */
+};
+
+/* decoded frame waiting for output */
+struct pending {
+	uint64_t ts;
+	int poc;
+};
+
+struct h264 {
+	struct sps sps[MAX_SPS];
+	struct pps pps[MAX_PPS];
+
+	struct ref refs[H264_MAX_REFS];
+	int ref_count;
+	int max_long_term_frame_idx;	/* -1 if no long-term frames */
+
+	/* state of the previous frames for picture order counts */
+	int prev_poc_msb;
+	int prev_poc_lsb;
+	int prev_frame_num;
+	int prev_frame_num_offset;
+	int prev_ref_frame_num;
+
+	/* frames decoded and not output yet, in no order */
+	struct pending pending[H264_MAX_REFS + 1];
+	int pending_count;
+
+	uint8_t rbsp[RBSP_SIZE];
+};
+
+static const uint8_t zigzag4x4[16] = {
+	0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15,
+};
+
+static const uint8_t zigzag8x8[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* Default scaling lists, tables 7-3 and 7-4, in zigzag order */
+static const uint8_t default4x4[2][16] = {
+	{ 6, 13, 13, 20, 20, 20, 28, 28, 28, 28, 32, 32, 32, 37, 37, 42 },
+	{ 10, 14, 14, 20, 20, 20, 24, 24, 24, 24, 27, 27, 27, 30, 30, 34 },
+};
+
+static const uint8_t default8x8[2][64] = {
+	{
+		6, 10, 10, 13, 11, 13, 16, 16, 16, 16, 18, 18, 18, 18, 18, 23,
+		23, 23, 23, 23, 23, 25, 25, 25, 25, 25, 25, 25, 27, 27, 27, 27,
+		27, 27, 27, 27, 29, 29, 29, 29, 29, 29, 29, 31, 31, 31, 31, 31,
+		31, 33, 33, 33, 33, 33, 36, 36, 36, 36, 38, 38, 38, 40, 40, 42,
+	}, {
+		9, 13, 13, 15, 13, 15, 17, 17, 17, 17, 19, 19, 19, 19, 19, 21,
+		21, 21, 21, 21, 21, 22, 22, 22, 22, 22, 22, 22, 24, 24, 24, 24,
+		24, 24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 27, 27, 27, 27, 27,
+		27, 28, 28, 28, 28, 28, 30, 30, 30, 30, 32, 32, 32, 33, 33, 35,
+	},
+};
+
+/* MSB first reader, reading zeros past the end */
+struct bits {
+	const uint8_t *data;
+	int size;
+	int pos;
+};
+
+static unsigned int
+read_bits(struct bits *b, int n)
+{
+	unsigned int v = 0;
+
+	while (n--) {
+		int byte = b->pos >> 3;
+
+		v <<= 1;
+		if (byte < b->size)
+			v |= (b->data[byte] >> (7 - (b->pos & 7))) & 1;
+		b->pos++;
+	}
+
+	return v;
+}
+
+static unsigned int
+read_ue(struct bits *b)
+{
+	int zeros = 0;
+
+	while (!read_bits(b, 1)) {
+		if (++zeros > 31)
+			return UINT32_MAX;
+	}
+
+	return (1u << zeros) - 1 + read_bits(b, zeros);
+}
+
+static int
+read_se(struct bits *b)
+{
+	unsigned int v = read_ue(b);
+
+	return v & 1 ? (int)((v + 1) / 2) : -(int)(v / 2);
+}
+
+static int
+bits_overrun(struct bits *b)
+{
+	return b->pos > b->size * 8;
+}
+
+/* Whether there is more data before the RBSP trailing bits */
+static int
+more_rbsp_data(struct bits *b)
+{
+	int size = b->size;
+
+	while (size > 0 && !b->data[size - 1])
+		size--;
+	if (!size)
+		return 0;
+
+	/* position of the rbsp_stop_one_bit */
+	return b->pos < size * 8 - 1 - __builtin_ctz(b->data[size - 1]);
+}
+
+/* Remove the emulation prevention bytes of the NAL unit payload */
+static int
+unescape(uint8_t *dst, int dst_size, const uint8_t *src, int src_size)
+{
+	int zeros = 0;
+	int n = 0;
+
+	for (int i = 0; i < src_size && n < dst_size; i++) {
+		if (zeros >= 2 && src[i] == 0x03) {
+			zeros = 0;
+			continue;
+		}
+
+		zeros = src[i] ? 0 : zeros + 1;
+		dst[n++] = src[i];
+	}
+
+	return n;
+}
+
+/* 7.3.2.1.1.1, returns useDefaultScalingMatrixFlag */
+static int
+read_scaling_list(struct bits *b, uint8_t *list, const uint8_t *zigzag,
+		  int size)
+{
+	int last = 8, next = 8;
+
+	for (int j = 0; j < size; j++) {
+		if (next) {
+			next = (last + read_se(b) + 256) % 256;
+			if (!j && !next)
+				return 1;
+		}
+
+		list[zigzag[j]] = next ?: last;
+		last = list[zigzag[j]];
+	}
+
+	return 0;
+}
+
+static void
+read_scaling_lists(struct bits *b, int count, enum scaling_list *state,
+		   struct scaling *s)
+{
+	int use_default;
+
+	for (int n = 0; n < 12; n++) {
+		state[n] = LIST_ABSENT;
+		if (n >= count || !read_bits(b, 1))
+			continue;
+
+		if (n < 6)
+			use_default = read_scaling_list(b, s->list4x4[n],
+							zigzag4x4, 16);
+		else
+			use_default = read_scaling_list(b, s->list8x8[n - 6],
+							zigzag8x8, 64);
+
+		state[n] = use_default ? LIST_DEFAULT : LIST_PRESENT;
+	}
+}
+
+static void
+set_default_list(uint8_t *list, const uint8_t *values, const uint8_t *zigzag,
+		 int size)
+{
+	for (int j = 0; j < size; j++)
+		list[zigzag[j]] = values[j];
+}
+
+/* Table 7-2: absent lists fall back to the previous list of the same
+ * kind, or for the first ones to the given lists, which are the default
+ * lists for the SPS (rule A) and the SPS lists for the PPS (rule B) */
+static void
+resolve_scaling_lists(struct scaling *dst, const enum scaling_list *state,
+		      const struct scaling *src, const struct scaling *fallback)
+{
+	for (int n = 0; n < 6; n++) {
+		uint8_t *list = dst->list4x4[n];
+
+		if (state[n] == LIST_PRESENT)
+			memcpy(list, src->list4x4[n], 16);
+		else if (state[n] == LIST_DEFAULT)
+			set_default_list(list, default4x4[n >= 3], zigzag4x4,
+					 16);
+		else if (n == 0 || n == 3)
+			memcpy(list, fallback->list4x4[n], 16);
+		else
+			memcpy(list, dst->list4x4[n - 1], 16);
+	}
+
+	/* intra and inter lists are interleaved */
+	for (int n = 0; n < 6; n++) {
+		uint8_t *list = dst->list8x8[n];
+
+		if (state[6 + n] == LIST_PRESENT)
+			memcpy(list, src->list8x8[n], 64);
+		else if (state[6 + n] == LIST_DEFAULT)
+			set_default_list(list, default8x8[n & 1], zigzag8x8,
+					 64);
+		else if (n < 2)
+			memcpy(list, fallback->list8x8[n], 64);
+		else
+			memcpy(list, dst->list8x8[n - 2], 64);
+	}
+}
+
+static void
+default_scaling_lists(struct scaling *s)
+{
+	for (int n = 0; n < 6; n++) {
+		set_default_list(s->list4x4[n], default4x4[n >= 3],
+				 zigzag4x4, 16);
+		set_default_list(s->list8x8[n], default8x8[n & 1],
+				 zigzag8x8, 64);
+	}
+}
+
+static int
+has_chroma_format(int profile_idc)
+{
+	switch (profile_idc) {
+	case 100: case 110: case 122: case 244: case 44: case 83:
+	case 86: case 118: case 128: case 138: case 139: case 134:
+	case 135:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* MaxDpbMbs of table A-1 */
+static const struct {
+	unsigned int level_idc;
+	int max_dpb_mbs;
+} level_limits[] = {
+	{ 9, 396 }, { 10, 396 }, { 11, 900 }, { 12, 2376 }, { 13, 2376 },
+	{ 20, 2376 }, { 21, 4752 }, { 22, 8100 }, { 30, 8100 },
+	{ 31, 18000 }, { 32, 20480 }, { 40, 32768 }, { 41, 32768 },
+	{ 42, 34816 }, { 50, 110400 }, { 51, 184320 }, { 52, 184320 },
+	{ 60, 696320 }, { 61, 696320 }, { 62, 696320 },
+};
+
+/* E.1.2 */
+static void
+skip_hrd_parameters(struct bits *b)
+{
+	unsigned int count = read_ue(b) + 1;
+
+	read_bits(b, 4 + 4);
+	for (unsigned int n = 0; n < count && !bits_overrun(b); n++) {
+		read_ue(b);
+		read_ue(b);
+		read_bits(b, 1);
+	}
+	read_bits(b, 5 + 5 + 5 + 5);
+}
+
+/* E.1.1, up to the bitstream restrictions on reordering. Returns 0 if
+ * they are given, -1 if not. */
+static int
+parse_vui(struct bits *b, int *max_reorder, int *dpb_size)
+{
+	int hrd = 0;
+
+	if (read_bits(b, 1) && read_bits(b, 8) == 255)
+		read_bits(b, 16 + 16);
+	if (read_bits(b, 1))
+		read_bits(b, 1);
+	if (read_bits(b, 1) && (read_bits(b, 3 + 1), read_bits(b, 1)))
+		read_bits(b, 8 + 8 + 8);
+	if (read_bits(b, 1)) {
+		read_ue(b);
+		read_ue(b);
+	}
+	if (read_bits(b, 1)) {
+		read_bits(b, 32);
+		read_bits(b, 32);
+		read_bits(b, 1);
+	}
+	for (int n = 0; n < 2; n++) {
+		if (read_bits(b, 1)) {
+			skip_hrd_parameters(b);
+			hrd = 1;
+		}
+	}
+	if (hrd)
+		read_bits(b, 1);
+	read_bits(b, 1);
+
+	if (!read_bits(b, 1))
+		return -1;
+
+	read_bits(b, 1);
+	for (int n = 0; n < 4; n++)
+		read_ue(b);
+	*max_reorder = read_ue(b);
+	*dpb_size = read_ue(b);
+
+	return bits_overrun(b) ? -1 : 0;
+}
+
+/* Size of the DPB and number of frames that can wait for output, from
+ * the VUI or else from the level limits, A.3.1 and E.2.1 */
+static void
+set_dpb_size(struct sps *sps, struct bits *b)
+{
+	const struct v4l2_ctrl_h264_sps *v = &sps->v4l2;
+	int mbs = (v->pic_width_in_mbs_minus1 + 1) *
+		  (v->pic_height_in_map_units_minus1 + 1);
+	int max_reorder, dpb_size;
+
+	dpb_size = H264_MAX_REFS;
+	for (unsigned int n = 0; n < ARRAY_LENGTH(level_limits); n++) {
+		if (level_limits[n].level_idc == v->level_idc)
+			dpb_size = level_limits[n].max_dpb_mbs / mbs;
+	}
+
+	/* intra profiles have no reordering */
+	max_reorder = dpb_size;
+	if ((v->constraint_set_flags & V4L2_H264_SPS_CONSTRAINT_SET3_FLAG) &&
+	    (v->profile_idc == 44 || v->profile_idc == 86 ||
+	     v->profile_idc == 100 || v->profile_idc == 110 ||
+	     v->profile_idc == 122 || v->profile_idc == 244))
+		max_reorder = dpb_size = 0;
+
+	/* vui_parameters_present_flag */
+	if (read_bits(b, 1))
+		parse_vui(b, &max_reorder, &dpb_size);
+
+	sps->dpb_size = MIN(MAX(dpb_size, (int)v->max_num_ref_frames),
+			    H264_MAX_REFS);
+	sps->dpb_size = MAX(sps->dpb_size, 1);
+	sps->max_reorder = MIN(max_reorder, sps->dpb_size);
+}
+
+/* 7.3.2.1.1 */
+static int
+parse_sps(struct h264 *h, struct bits *b)
+{
+	struct v4l2_ctrl_h264_sps v;
+	enum scaling_list state[12];
+	struct scaling lists, defaults;
+	unsigned int id, constraints;
+	int scaling_present = 0;
+
+	memzero(v);
+	v.profile_idc = read_bits(b, 8);
+	constraints = read_bits(b, 8);
+	v.level_idc = read_bits(b, 8);
+	id = read_ue(b);
+	if (id >= MAX_SPS)
+		return -1;
+	v.seq_parameter_set_id = id;
+
+	/* constraint_set0_flag is the most significant bit */
+	for (int n = 0; n < 6; n++) {
+		if (constraints & (0x80 >> n))
+			v.constraint_set_flags |= 1 << n;
+	}
+
+	v.chroma_format_idc = 1;
+	if (has_chroma_format(v.profile_idc)) {
+		v.chroma_format_idc = read_ue(b);
+		if (v.chroma_format_idc > 3)
+			return -1;
+		if (v.chroma_format_idc == 3 && read_bits(b, 1))
+			v.flags |= V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE;
+		v.bit_depth_luma_minus8 = read_ue(b);
+		v.bit_depth_chroma_minus8 = read_ue(b);
+		if (read_bits(b, 1))
+			v.flags |=
+			    V4L2_H264_SPS_FLAG_QPPRIME_Y_ZERO_TRANSFORM_BYPASS;
+
+		scaling_present = read_bits(b, 1);
+		if (scaling_present)
+			read_scaling_lists(b, v.chroma_format_idc == 3 ? 12 : 8,
+					   state, &lists);
+	}
+
+	v.log2_max_frame_num_minus4 = read_ue(b);
+	v.pic_order_cnt_type = read_ue(b);
+	if (v.log2_max_frame_num_minus4 > 12 || v.pic_order_cnt_type > 2)
+		return -1;
+
+	if (v.pic_order_cnt_type == 0) {
+		v.log2_max_pic_order_cnt_lsb_minus4 = read_ue(b);
+		if (v.log2_max_pic_order_cnt_lsb_minus4 > 12)
+			return -1;
+	} else if (v.pic_order_cnt_type == 1) {
+		unsigned int count;
+
+		if (read_bits(b, 1))
+			v.flags |= V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO;
+		v.offset_for_non_ref_pic = read_se(b);
+		v.offset_for_top_to_bottom_field = read_se(b);
+
+		count = read_ue(b);
+		if (count > 255)
+			return -1;
+		v.num_ref_frames_in_pic_order_cnt_cycle = count;
+		for (unsigned int n = 0; n < count; n++)
+			v.offset_for_ref_frame[n] = read_se(b);
+	}
+
+	v.max_num_ref_frames = read_ue(b);
+	if (v.max_num_ref_frames > H264_MAX_REFS)
+		return -1;
+	if (read_bits(b, 1))
+		v.flags |= V4L2_H264_SPS_FLAG_GAPS_IN_FRAME_NUM_VALUE_ALLOWED;
+	v.pic_width_in_mbs_minus1 = read_ue(b);
+	v.pic_height_in_map_units_minus1 = read_ue(b);
+
+	if (read_bits(b, 1)) {
+		v.flags |= V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY;
+	} else if (read_bits(b, 1)) {
+		v.flags |= V4L2_H264_SPS_FLAG_MB_ADAPTIVE_FRAME_FIELD;
+	}
+	if (read_bits(b, 1))
+		v.flags |= V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE;
+
+	/* frame_cropping_flag, the decoder crops nothing */
+	if (read_bits(b, 1)) {
+		for (int n = 0; n < 4; n++)
+			read_ue(b);
+	}
+
+	if (bits_overrun(b))
+		return -1;
+
+	h->sps[id].valid = 1;
+	h->sps[id].v4l2 = v;
+	h->sps[id].scaling_present = scaling_present;
+	set_dpb_size(&h->sps[id], b);
+
+	/* without matrix, the flat lists of the decoder are used */
+	memset(&h->sps[id].scaling, 16, sizeof (h->sps[id].scaling));
+	if (scaling_present) {
+		default_scaling_lists(&defaults);
+		resolve_scaling_lists(&h->sps[id].scaling, state, &lists,
+				      &defaults);
+	}
+
+	dbg("SPS %u: profile %u level %u, %ux%u macroblocks, "
+	    "poc type %u, %u reference frames, DPB of %d frames, "
+	    "%d reordered", id, v.profile_idc, v.level_idc,
+	    v.pic_width_in_mbs_minus1 + 1,
+	    v.pic_height_in_map_units_minus1 + 1, v.pic_order_cnt_type,
+	    v.max_num_ref_frames, h->sps[id].dpb_size,
+	    h->sps[id].max_reorder);
+
+	return 0;
+}
+
+/* 7.3.2.2 */
+static int
+parse_pps(struct h264 *h, struct bits *b)
+{
+	struct pps p;
+	const struct sps *sps;
+	unsigned int id, sps_id;
+
+	memzero(p);
+	id = read_ue(b);
+	sps_id = read_ue(b);
+	if (id >= MAX_PPS || sps_id >= MAX_SPS || !h->sps[sps_id].valid)
+		return -1;
+	sps = &h->sps[sps_id];
+
+	p.v4l2.pic_parameter_set_id = id;
+	p.v4l2.seq_parameter_set_id = sps_id;
+
+	if (read_bits(b, 1))
+		p.v4l2.flags |= V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE;
+	if (read_bits(b, 1))
+		p.v4l2.flags |=
+		    V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT;
+
+	/* slice groups are not supported by hardware decoders */
+	if (read_ue(b)) {
+		err("PPS %u: slice groups are not supported", id);
+		return -1;
+	}
+
+	p.v4l2.num_ref_idx_l0_default_active_minus1 = read_ue(b);
+	p.v4l2.num_ref_idx_l1_default_active_minus1 = read_ue(b);
+	if (read_bits(b, 1))
+		p.v4l2.flags |= V4L2_H264_PPS_FLAG_WEIGHTED_PRED;
+	p.v4l2.weighted_bipred_idc = read_bits(b, 2);
+	p.v4l2.pic_init_qp_minus26 = read_se(b);
+	p.v4l2.pic_init_qs_minus26 = read_se(b);
+	p.v4l2.chroma_qp_index_offset = read_se(b);
+	if (read_bits(b, 1))
+		p.v4l2.flags |=
+		    V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT;
+	if (read_bits(b, 1))
+		p.v4l2.flags |= V4L2_H264_PPS_FLAG_CONSTRAINED_INTRA_PRED;
+	if (read_bits(b, 1))
+		p.v4l2.flags |= V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT;
+
+	p.v4l2.second_chroma_qp_index_offset = p.v4l2.chroma_qp_index_offset;
+
+	if (more_rbsp_data(b)) {
+		int transform_8x8 = read_bits(b, 1);
+
+		if (transform_8x8)
+			p.v4l2.flags |= V4L2_H264_PPS_FLAG_TRANSFORM_8X8_MODE;
+
+		p.scaling_present = read_bits(b, 1);
+		if (p.scaling_present)
+			read_scaling_lists(b, 6 + (transform_8x8 ?
+				(sps->v4l2.chroma_format_idc == 3 ? 6 : 2) : 0),
+				p.state, &p.scaling);
+
+		p.v4l2.second_chroma_qp_index_offset = read_se(b);
+	}
+
+	if (bits_overrun(b))
+		return -1;
+
+	p.valid = 1;
+	h->pps[id] = p;
+
+	return 0;
+}
+
+static void
+read_ref_pic_list_modification(struct bits *b)
+{
+	unsigned int idc;
+
+	if (!read_bits(b, 1))
+		return;
+
+	do {
+		idc = read_ue(b);
+		if (idc < 3)
+			read_ue(b);	/* abs_diff_pic_num, long_term_pic_num */
+	} while (idc < 3 && !bits_overrun(b));
+}
+
+static void
+read_pred_weight_table(struct bits *b, const struct sps *sps, int slice_type,
+		       int num_ref_idx[2])
+{
+	int chroma = !(sps->v4l2.flags &
+		       V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE) &&
+		     sps->v4l2.chroma_format_idc;
+
+	read_ue(b);		/* luma_log2_weight_denom */
+	if (chroma)
+		read_ue(b);	/* chroma_log2_weight_denom */
+
+	for (int list = 0; list < (slice_type == 1 ? 2 : 1); list++) {
+		for (int n = 0; n < num_ref_idx[list]; n++) {
+			if (read_bits(b, 1)) {
+				read_se(b);
+				read_se(b);
+			}
+			if (chroma && read_bits(b, 1)) {
+				for (int c = 0; c < 4; c++)
+					read_se(b);
+			}
+		}
+	}
+}
+
+/* 7.3.3.3 */
+static int
+read_dec_ref_pic_marking(struct bits *b, struct slice *s)
+{
+	if (s->idr) {
+		read_bits(b, 1);	/* no_output_of_prior_pics_flag */
+		s->long_term_reference = read_bits(b, 1);
+		return 0;
+	}
+
+	s->adaptive_marking = read_bits(b, 1);
+	if (!s->adaptive_marking)
+		return 0;
+
+	for (;;) {
+		unsigned int op = read_ue(b);
+
+		if (!op)
+			break;
+		if (op > 6 || s->mmco_count == MAX_MMCO || bits_overrun(b))
+			return -1;
+
+		s->mmco[s->mmco_count].op = op;
+		if (op == 1 || op == 3)
+			s->mmco[s->mmco_count].pic_num_diff = read_ue(b) + 1;
+		if (op == 2 || op == 3 || op == 4 || op == 6)
+			s->mmco[s->mmco_count].long_term = read_ue(b);
+		s->mmco_count++;
+	}
+
+	return 0;
+}
+
+/* 7.3.3, up to dec_ref_pic_marking() */
+static int
+parse_slice_header(struct h264 *h, struct bits *b, struct slice *s)
+{
+	const struct sps *sps;
+	const struct pps *pps;
+	int num_ref_idx[2];
+	int pos;
+
+	read_ue(b);	/* first_mb_in_slice */
+	s->slice_type = read_ue(b) % 5;
+	s->pps_id = read_ue(b);
+	if (s->pps_id >= MAX_PPS || !h->pps[s->pps_id].valid) {
+		err("slice refers to unknown PPS %d", s->pps_id);
+		return -1;
+	}
+
+	pps = &h->pps[s->pps_id];
+	sps = &h->sps[pps->v4l2.seq_parameter_set_id];
+
+	if (sps->v4l2.flags & V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE)
+		read_bits(b, 2);	/* colour_plane_id */
+
+	s->frame_num = read_bits(b, sps->v4l2.log2_max_frame_num_minus4 + 4);
+
+	if (!(sps->v4l2.flags & V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY) &&
+	    read_bits(b, 1)) {
+		err("field pictures are not supported");
+		return -1;
+	}
+
+	if (s->idr)
+		s->idr_pic_id = read_ue(b);
+
+	pos = b->pos;
+
+	if (sps->v4l2.pic_order_cnt_type == 0) {
+		s->poc_lsb = read_bits(b,
+			sps->v4l2.log2_max_pic_order_cnt_lsb_minus4 + 4);
+		if (pps->v4l2.flags &
+		    V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT)
+			s->delta_poc_bottom = read_se(b);
+	}
+
+	if (sps->v4l2.pic_order_cnt_type == 1 &&
+	    !(sps->v4l2.flags & V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO)) {
+		s->delta_poc[0] = read_se(b);
+		if (pps->v4l2.flags &
+		    V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT)
+			s->delta_poc[1] = read_se(b);
+	}
+
+	s->poc_bit_size = b->pos - pos;
+
+	if (pps->v4l2.flags & V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT)
+		read_ue(b);	/* redundant_pic_cnt */
+
+	if (s->slice_type == V4L2_H264_SLICE_TYPE_B)
+		read_bits(b, 1);	/* direct_spatial_mv_pred_flag */
+
+	num_ref_idx[0] = pps->v4l2.num_ref_idx_l0_default_active_minus1 + 1;
+	num_ref_idx[1] = pps->v4l2.num_ref_idx_l1_default_active_minus1 + 1;
+
+	if (s->slice_type == V4L2_H264_SLICE_TYPE_P ||
+	    s->slice_type == V4L2_H264_SLICE_TYPE_SP ||
+	    s->slice_type == V4L2_H264_SLICE_TYPE_B) {
+		if (read_bits(b, 1)) {
+			num_ref_idx[0] = read_ue(b) + 1;
+			if (s->slice_type == V4L2_H264_SLICE_TYPE_B)
+				num_ref_idx[1] = read_ue(b) + 1;
+		}
+		if (num_ref_idx[0] > 32 || num_ref_idx[1] > 32)
+			return -1;
+	}
+
+	if (s->slice_type != V4L2_H264_SLICE_TYPE_I &&
+	    s->slice_type != V4L2_H264_SLICE_TYPE_SI)
+		read_ref_pic_list_modification(b);
+	if (s->slice_type == V4L2_H264_SLICE_TYPE_B)
+		read_ref_pic_list_modification(b);
+
+	if (((pps->v4l2.flags & V4L2_H264_PPS_FLAG_WEIGHTED_PRED) &&
+	     (s->slice_type == V4L2_H264_SLICE_TYPE_P ||
+	      s->slice_type == V4L2_H264_SLICE_TYPE_SP)) ||
+	    (pps->v4l2.weighted_bipred_idc == 1 &&
+	     s->slice_type == V4L2_H264_SLICE_TYPE_B))
+		read_pred_weight_table(b, sps, s->slice_type, num_ref_idx);
+
+	if (s->nal_ref_idc) {
+		pos = b->pos;
+		if (read_dec_ref_pic_marking(b, s) < 0)
+			return -1;
+		s->marking_bit_size = b->pos - pos;
+	}
+
+	if (bits_overrun(b)) {
+		err("truncated slice header");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+has_mmco5(const struct slice *s)
+{
+	for (int n = 0; n < s->mmco_count; n++) {
+		if (s->mmco[n].op == 5)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* 8.2.1, for frames; returns TopFieldOrderCnt and BottomFieldOrderCnt */
+static void
+picture_order_count(struct h264 *h, const struct sps *sps,
+		    const struct slice *s, int *top, int *bottom)
+{
+	const struct v4l2_ctrl_h264_sps *v = &sps->v4l2;
+	int max_frame_num = 1 << (v->log2_max_frame_num_minus4 + 4);
+	int frame_num_offset = 0;
+
+	if (v->pic_order_cnt_type == 0) {
+		int max_lsb = 1 << (v->log2_max_pic_order_cnt_lsb_minus4 + 4);
+		int prev_msb = s->idr ? 0 : h->prev_poc_msb;
+		int prev_lsb = s->idr ? 0 : h->prev_poc_lsb;
+		int msb;
+
+		if (s->poc_lsb < prev_lsb &&
+		    prev_lsb - s->poc_lsb >= max_lsb / 2)
+			msb = prev_msb + max_lsb;
+		else if (s->poc_lsb > prev_lsb &&
+			 s->poc_lsb - prev_lsb > max_lsb / 2)
+			msb = prev_msb - max_lsb;
+		else
+			msb = prev_msb;
+
+		*top = msb + s->poc_lsb;
+		*bottom = *top + s->delta_poc_bottom;
+
+		/* the previous reference frame is the base of the next */
+		if (s->nal_ref_idc) {
+			h->prev_poc_msb = msb;
+			h->prev_poc_lsb = s->poc_lsb;
+		}
+		return;
+	}
+
+	if (!s->idr) {
+		frame_num_offset = h->prev_frame_num_offset;
+		if (h->prev_frame_num > s->frame_num)
+			frame_num_offset += max_frame_num;
+	}
+
+	h->prev_frame_num_offset = frame_num_offset;
+	h->prev_frame_num = s->frame_num;
+
+	if (v->pic_order_cnt_type == 1) {
+		int cycle = v->num_ref_frames_in_pic_order_cnt_cycle;
+		int abs_frame_num = 0, expected = 0, delta = 0;
+
+		if (cycle)
+			abs_frame_num = frame_num_offset + s->frame_num;
+		if (!s->nal_ref_idc && abs_frame_num > 0)
+			abs_frame_num--;
+
+		for (int n = 0; n < cycle; n++)
+			delta += v->offset_for_ref_frame[n];
+
+		if (abs_frame_num > 0) {
+			int count = (abs_frame_num - 1) / cycle;
+			int in_cycle = (abs_frame_num - 1) % cycle;
+
+			expected = count * delta;
+			for (int n = 0; n <= in_cycle; n++)
+				expected += v->offset_for_ref_frame[n];
+		}
+
+		if (!s->nal_ref_idc)
+			expected += v->offset_for_non_ref_pic;
+
+		*top = expected + s->delta_poc[0];
+		*bottom = *top + v->offset_for_top_to_bottom_field +
+			  s->delta_poc[1];
+		return;
+	}
+
+	if (s->idr)
+		*top = 0;
+	else if (!s->nal_ref_idc)
+		*top = 2 * (frame_num_offset + s->frame_num) - 1;
+	else
+		*top = 2 * (frame_num_offset + s->frame_num);
+	*bottom = *top;
+}
+
+/* FrameNumWrap, 8.2.4.1 */
+static int
+frame_num_wrap(const struct ref *r, int frame_num, int max_frame_num)
+{
+	return r->frame_num > frame_num ? r->frame_num - max_frame_num :
+					  r->frame_num;
+}
+
+static void
+release_ref(struct h264 *h, int n, struct h264_frame *frame)
+{
+	if (!h->refs[n].non_existing)
+		frame->release[frame->release_count++] = h->refs[n].ts;
+
+	h->ref_count--;
+	memmove(&h->refs[n], &h->refs[n + 1],
+		(h->ref_count - n) * sizeof (h->refs[0]));
+}
+
+static void
+release_all_refs(struct h264 *h, struct h264_frame *frame)
+{
+	while (h->ref_count)
+		release_ref(h, h->ref_count - 1, frame);
+}
+
+/* 8.2.5.3, returns -1 if no short-term frame can be removed */
+static int
+sliding_window(struct h264 *h, const struct sps *sps, int frame_num,
+	       struct h264_frame *frame)
+{
+	int max_frame_num = 1 << (sps->v4l2.log2_max_frame_num_minus4 + 4);
+	int max_refs = MAX(sps->v4l2.max_num_ref_frames, 1);
+	int oldest = -1;
+
+	if (h->ref_count < max_refs)
+		return 0;
+
+	for (int n = 0; n < h->ref_count; n++) {
+		if (h->refs[n].long_term)
+			continue;
+		if (oldest < 0 ||
+		    frame_num_wrap(&h->refs[n], frame_num, max_frame_num) <
+		    frame_num_wrap(&h->refs[oldest], frame_num, max_frame_num))
+			oldest = n;
+	}
+
+	if (oldest < 0)
+		return -1;
+
+	release_ref(h, oldest, frame);
+
+	return 0;
+}
+
+static int
+find_short_term(struct h264 *h, int pic_num, int frame_num,
+		int max_frame_num)
+{
+	for (int n = 0; n < h->ref_count; n++) {
+		if (!h->refs[n].long_term &&
+		    frame_num_wrap(&h->refs[n], frame_num, max_frame_num) ==
+		    pic_num)
+			return n;
+	}
+
+	return -1;
+}
+
+static int
+find_long_term(struct h264 *h, int long_term_frame_idx)
+{
+	for (int n = 0; n < h->ref_count; n++) {
+		if (h->refs[n].long_term &&
+		    h->refs[n].long_term_frame_idx == long_term_frame_idx)
+			return n;
+	}
+
+	return -1;
+}
+
+/* 8.2.5.4, returns 1 if the current frame was marked as long-term */
+static int
+adaptive_marking(struct h264 *h, const struct sps *sps,
+		 const struct slice *s, struct h264_frame *frame)
+{
+	int max_frame_num = 1 << (sps->v4l2.log2_max_frame_num_minus4 + 4);
+	int long_term = 0;
+	int n, k;
+
+	for (int m = 0; m < s->mmco_count; m++) {
+		int pic_num = s->frame_num - s->mmco[m].pic_num_diff;
+		int idx = s->mmco[m].long_term;
+
+		switch (s->mmco[m].op) {
+		case 1:
+			n = find_short_term(h, pic_num, s->frame_num,
+					    max_frame_num);
+			if (n >= 0)
+				release_ref(h, n, frame);
+			break;
+		case 2:
+			n = find_long_term(h, idx);
+			if (n >= 0)
+				release_ref(h, n, frame);
+			break;
+		case 3:
+			n = find_short_term(h, pic_num, s->frame_num,
+					    max_frame_num);
+			if (n < 0)
+				break;
+
+			/* the index moves from another long-term frame */
+			k = find_long_term(h, idx);
+			if (k >= 0) {
+				release_ref(h, k, frame);
+				if (k < n)
+					n--;
+			}
+
+			h->refs[n].long_term = 1;
+			h->refs[n].long_term_frame_idx = idx;
+			break;
+		case 4:
+			h->max_long_term_frame_idx = idx - 1;
+			for (n = h->ref_count - 1; n >= 0; n--) {
+				if (h->refs[n].long_term &&
+				    h->refs[n].long_term_frame_idx >= idx)
+					release_ref(h, n, frame);
+			}
+			break;
+		case 5:
+			release_all_refs(h, frame);
+			h->max_long_term_frame_idx = -1;
+			break;
+		case 6:
+			n = find_long_term(h, idx);
+			if (n >= 0)
+				release_ref(h, n, frame);
+			long_term = 1;
+			break;
+		}
+	}
+
+	return long_term;
+}
+
+/* 8.2.5.2, frames missing from the stream are inferred so that the
+ * sliding window keeps working */
+static void
+fill_frame_num_gap(struct h264 *h, const struct sps *sps,
+		   const struct slice *s, struct h264_frame *frame)
+{
+	int max_frame_num = 1 << (sps->v4l2.log2_max_frame_num_minus4 + 4);
+	int frame_num = (h->prev_ref_frame_num + 1) % max_frame_num;
+
+	if (s->idr || s->frame_num == h->prev_ref_frame_num ||
+	    s->frame_num == frame_num)
+		return;
+
+	if (!(sps->v4l2.flags &
+	      V4L2_H264_SPS_FLAG_GAPS_IN_FRAME_NUM_VALUE_ALLOWED)) {
+		dbg("frame_num %d after %d, frames lost", s->frame_num,
+		    h->prev_ref_frame_num);
+		return;
+	}
+
+	for (; frame_num != s->frame_num;
+	     frame_num = (frame_num + 1) % max_frame_num) {
+		struct ref *r;
+
+		if (sliding_window(h, sps, frame_num, frame) < 0)
+			break;
+
+		r = &h->refs[h->ref_count++];
+		memzero(*r);
+		r->frame_num = frame_num;
+		r->non_existing = 1;
+
+		if (h->prev_frame_num > frame_num)
+			h->prev_frame_num_offset += max_frame_num;
+		h->prev_frame_num = frame_num;
+	}
+
+	h->prev_ref_frame_num = (frame_num + max_frame_num - 1) %
+				max_frame_num;
+}
+
+static void
+fill_decode_params(struct h264 *h, const struct sps *sps,
+		   const struct slice *s, int top, int bottom,
+		   struct v4l2_ctrl_h264_decode_params *d)
+{
+	int max_frame_num = 1 << (sps->v4l2.log2_max_frame_num_minus4 + 4);
+	int count = 0;
+
+	memzero(*d);
+
+	for (int n = 0; n < h->ref_count; n++) {
+		const struct ref *r = &h->refs[n];
+		struct v4l2_h264_dpb_entry *e = &d->dpb[count];
+
+		if (r->non_existing)
+			continue;
+
+		e->reference_ts = r->ts;
+		e->frame_num = r->frame_num;
+		e->fields = V4L2_H264_FRAME_REF;
+		e->top_field_order_cnt = r->top_poc;
+		e->bottom_field_order_cnt = r->bottom_poc;
+		e->flags = V4L2_H264_DPB_ENTRY_FLAG_VALID |
+			   V4L2_H264_DPB_ENTRY_FLAG_ACTIVE;
+
+		/* LongTermPicNum and PicNum of frames, 8.2.4.1 */
+		if (r->long_term) {
+			e->flags |= V4L2_H264_DPB_ENTRY_FLAG_LONG_TERM;
+			e->pic_num = r->long_term_frame_idx;
+		} else {
+			e->pic_num = frame_num_wrap(r, s->frame_num,
+						    max_frame_num);
+		}
+
+		count++;
+	}
+
+	d->nal_ref_idc = s->nal_ref_idc;
+	d->frame_num = s->frame_num;
+	d->top_field_order_cnt = top;
+	d->bottom_field_order_cnt = bottom;
+	d->idr_pic_id = s->idr_pic_id;
+	d->pic_order_cnt_lsb = s->poc_lsb;
+	d->delta_pic_order_cnt_bottom = s->delta_poc_bottom;
+	d->delta_pic_order_cnt0 = s->delta_poc[0];
+	d->delta_pic_order_cnt1 = s->delta_poc[1];
+	d->dec_ref_pic_marking_bit_size = s->marking_bit_size;
+	d->pic_order_cnt_bit_size = s->poc_bit_size;
+
+	if (s->idr)
+		d->flags |= V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC;
+	if (s->slice_type == V4L2_H264_SLICE_TYPE_P ||
+	    s->slice_type == V4L2_H264_SLICE_TYPE_SP)
+		d->flags |= V4L2_H264_DECODE_PARAM_FLAG_PFRAME;
+	else if (s->slice_type == V4L2_H264_SLICE_TYPE_B)
+		d->flags |= V4L2_H264_DECODE_PARAM_FLAG_BFRAME;
+}
+
+/* 8.2.5.1, once the frame is decoded */
+static void
+mark_references(struct h264 *h, const struct sps *sps, const struct slice *s,
+		uint64_t ts, int top, int bottom, struct h264_frame *frame)
+{
+	int long_term = 0;
+	struct ref *r;
+
+	if (!s->nal_ref_idc)
+		return;
+
+	if (s->idr) {
+		release_all_refs(h, frame);
+		long_term = s->long_term_reference;
+		h->max_long_term_frame_idx = long_term ? 0 : -1;
+	} else if (s->adaptive_marking) {
+		long_term = adaptive_marking(h, sps, s, frame);
+	} else {
+		sliding_window(h, sps, s->frame_num, frame);
+	}
+
+	/* a broken stream could overflow the DPB */
+	if (h->ref_count == H264_MAX_REFS &&
+	    sliding_window(h, sps, s->frame_num, frame) < 0)
+		release_ref(h, 0, frame);
+
+	r = &h->refs[h->ref_count++];
+	memzero(*r);
+	r->ts = ts;
+	r->frame_num = s->frame_num;
+	r->top_poc = top;
+	r->bottom_poc = bottom;
+	r->long_term = long_term;
+	for (int m = 0; m < s->mmco_count; m++) {
+		if (s->mmco[m].op == 6)
+			r->long_term_frame_idx = s->mmco[m].long_term;
+	}
+
+	h->prev_ref_frame_num = s->frame_num;
+
+	/* after memory_management_control_operation 5, the frame counts
+	 * as frame_num 0 with its order counts made relative to it */
+	if (has_mmco5(s)) {
+		int poc = MIN(top, bottom);
+
+		r->frame_num = 0;
+		r->top_poc -= poc;
+		r->bottom_poc -= poc;
+
+		h->prev_ref_frame_num = 0;
+		h->prev_frame_num = 0;
+		h->prev_frame_num_offset = 0;
+		h->prev_poc_msb = 0;
+		h->prev_poc_lsb = r->top_poc;
+	}
+}
+
+/* Output the waiting frame first in picture order count order */
+static void
+bump(struct h264 *h, struct h264_frame *frame)
+{
+	int first = 0;
+
+	for (int n = 1; n < h->pending_count; n++) {
+		if (h->pending[n].poc < h->pending[first].poc)
+			first = n;
+	}
+
+	frame->output[frame->output_count++] = h->pending[first].ts;
+	h->pending[first] = h->pending[--h->pending_count];
+}
+
+/* Frames held by the DPB, as reference frames or waiting for output */
+static int
+dpb_fullness(struct h264 *h)
+{
+	int count = h->ref_count;
+
+	for (int n = 0; n < h->pending_count; n++) {
+		int ref = 0;
+
+		for (int r = 0; r < h->ref_count; r++) {
+			if (!h->refs[r].non_existing &&
+			    h->refs[r].ts == h->pending[n].ts)
+				ref = 1;
+		}
+
+		count += !ref;
+	}
+
+	return count;
+}
+
+/* C.4.5, once the frame is decoded and marked: frames are output in
+ * picture order count order when the DPB has no room for the current
+ * frame, or when more frames are waiting than the stream reorders */
+static void
+output_frames(struct h264 *h, const struct sps *sps, const struct slice *s,
+	      uint64_t ts, int poc, struct h264_frame *frame)
+{
+	int full;
+
+	/* no frame before them is output after them */
+	if (s->idr || has_mmco5(s)) {
+		while (h->pending_count)
+			bump(h, frame);
+	}
+
+	/* the current frame is counted among the reference frames */
+	full = dpb_fullness(h) - !!s->nal_ref_idc >= sps->dpb_size;
+
+	if (full && !s->nal_ref_idc) {
+		int first = 1;
+
+		for (int n = 0; n < h->pending_count; n++) {
+			if (h->pending[n].poc < poc)
+				first = 0;
+		}
+
+		/* C.4.5.2, output without storing it */
+		if (first) {
+			frame->output[frame->output_count++] = ts;
+			return;
+		}
+	}
+
+	while (h->pending_count &&
+	       (dpb_fullness(h) - !!s->nal_ref_idc >= sps->dpb_size ||
+		h->pending_count == (int)ARRAY_LENGTH(h->pending)))
+		bump(h, frame);
+
+	h->pending[h->pending_count].ts = ts;
+	h->pending[h->pending_count].poc = poc;
+	h->pending_count++;
+
+	while (h->pending_count > sps->max_reorder)
+		bump(h, frame);
+}
+
+int
+h264_parse_frame(struct h264 *h, const uint8_t *data, int size, uint64_t ts,
+		 struct h264_frame *frame)
+{
+	const struct sps *sps;
+	const struct pps *pps;
+	struct slice s;
+	struct bits b;
+	int pos, next, end, type, top, bottom;
+
+	memzero(s);
+
+	for (pos = bitstream_find_sc(data, size); pos >= 0; pos = next) {
+		pos += 3;
+		next = bitstream_find_sc(data + pos, size - pos);
+		if (next >= 0)
+			next += pos;
+
+		end = next < 0 ? size : next;
+		if (pos >= end)
+			continue;
+
+		type = data[pos] & 0x1f;
+		if (type != NAL_SPS && type != NAL_PPS &&
+		    type != NAL_SLICE && type != NAL_IDR_SLICE)
+			continue;
+
+		b = (struct bits){ h->rbsp, 0, 0 };
+		b.size = unescape(h->rbsp, sizeof (h->rbsp), data + pos + 1,
+				  end - pos - 1);
+
+		if (type == NAL_SPS && parse_sps(h, &b) < 0)
+			err("ignoring unsupported SPS");
+		else if (type == NAL_PPS && parse_pps(h, &b) < 0)
+			err("ignoring unsupported PPS");
+
+		if (type != NAL_SLICE && type != NAL_IDR_SLICE)
+			continue;
+
+		/* the decoder parses the other slices itself */
+		s.nal_ref_idc = data[pos] >> 5;
+		s.idr = type == NAL_IDR_SLICE;
+		if (parse_slice_header(h, &b, &s) < 0)
+			return -1;
+		break;
+	}
+
+	if (pos < 0) {
+		err("no slice in frame");
+		return -1;
+	}
+
+	pps = &h->pps[s.pps_id];
+	sps = &h->sps[pps->v4l2.seq_parameter_set_id];
+
+	frame->ref = !!s.nal_ref_idc;
+	frame->release_count = 0;
+	frame->output_count = 0;
+
+	fill_frame_num_gap(h, sps, &s, frame);
+	picture_order_count(h, sps, &s, &top, &bottom);
+
+	frame->sps = sps->v4l2;
+	frame->pps = pps->v4l2;
+
+	/* lists are given when any is not flat, PPS lists override */
+	if (sps->scaling_present || pps->scaling_present) {
+		struct scaling scaling = sps->scaling, defaults;
+		const struct scaling *fallback = &sps->scaling;
+
+		/* rule A without SPS lists, rule B with them */
+		if (!sps->scaling_present) {
+			default_scaling_lists(&defaults);
+			fallback = &defaults;
+		}
+
+		if (pps->scaling_present)
+			resolve_scaling_lists(&scaling, pps->state,
+					      &pps->scaling, fallback);
+
+		memcpy(frame->scaling_matrix.scaling_list_4x4,
+		       scaling.list4x4, sizeof (scaling.list4x4));
+		memcpy(frame->scaling_matrix.scaling_list_8x8,
+		       scaling.list8x8, sizeof (scaling.list8x8));
+		frame->pps.flags |= V4L2_H264_PPS_FLAG_SCALING_MATRIX_PRESENT;
+	}
+
+	fill_decode_params(h, sps, &s, top, bottom, &frame->decode_params);
+	mark_references(h, sps, &s, ts, top, bottom, frame);
+
+	/* frames after memory_management_control_operation 5 are output
+	 * after it, with order counts relative to it */
+	output_frames(h, sps, &s, ts, has_mmco5(&s) ? 0 : MIN(top, bottom),
+		      frame);
+
+	return 0;
+}
+
+void
+h264_flush_frames(struct h264 *h, struct h264_frame *frame)
+{
+	frame->ref = 0;
+	frame->release_count = 0;
+	frame->output_count = 0;
+
+	while (h->pending_count)
+		bump(h, frame);
+}
+
+struct h264 *
+h264_create(void)
+{
+	struct h264 *h;
+
+	h = calloc(1, sizeof (*h));
+	if (!h)
+		return NULL;
+
+	h->max_long_term_frame_idx = -1;
+
+	return h;
+}
+
+void
+h264_destroy(struct h264 *h)
+{
+	free(h);
+}
+
+#endif /* V4L2_CID_STATELESS_H264_DECODE_PARAMS */
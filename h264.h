@@ -0,0 +1,66 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * H.264 parsing for stateless decoders header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef INCLUDE_H264_H
+#define INCLUDE_H264_H
+
+#include <stdint.h>
+#include <linux/videodev2.h>
+
+#ifdef V4L2_CID_STATELESS_H264_DECODE_PARAMS
+
+/* Maximum number of reference frames */
+#define H264_MAX_REFS	V4L2_H264_NUM_DPB_ENTRIES
+
+struct h264;
+
+/* Controls of an access unit, what decoding it does to the reference
+ * frames and which frames are output once it is decoded. Frames are known
+ * by their CAPTURE buffer timestamp. */
+struct h264_frame {
+	struct v4l2_ctrl_h264_sps sps;
+	struct v4l2_ctrl_h264_pps pps;
+	struct v4l2_ctrl_h264_scaling_matrix scaling_matrix;
+	struct v4l2_ctrl_h264_decode_params decode_params;
+
+	int ref;		/* kept as a reference frame */
+	int release_count;	/* frames no longer referenced */
+	uint64_t release[H264_MAX_REFS + 1];
+	int output_count;	/* frames to show, in order */
+	uint64_t output[H264_MAX_REFS + 2];
+};
+
+struct h264 *h264_create(void);
+
+void h264_destroy(struct h264 *h);
+
+/* Parse the Annex-B access unit in data, to be decoded to the CAPTURE
+ * buffer with timestamp ts in nanoseconds, then mark the reference frames
+ * as decoding it does, and output the frames due in picture order count
+ * order. Only progressive frames are supported. Returns -1 if the frame
+ * cannot be decoded. */
+int h264_parse_frame(struct h264 *h, const uint8_t *data, int size,
+		     uint64_t ts, struct h264_frame *frame);
+
+/* Output the frames still waiting, at the end of the stream; only the
+ * output list of frame is set */
+void h264_flush_frames(struct h264 *h, struct h264_frame *frame);
+
+#endif /* V4L2_CID_STATELESS_H264_DECODE_PARAMS */
+
+#endif /* INCLUDE_H264_H */
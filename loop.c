@@ -0,0 +1,295 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Event loop, on top of epoll and timerfd
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "common.h"
+#include "loop.h"
+
+#define DBG_TAG "  loop"
+
+/* maximum number of sources reported by one loop_wait() */
+#define LOOP_MAX_EVENTS	16
+
+struct loop_source {
+	struct loop *loop;
+	int fd;
+	uint32_t events;
+	int timer;
+	int removed;
+	loop_fd_cb_t fd_cb;
+	loop_timer_cb_t timer_cb;
+	void *data;
+	struct list_head link;
+};
+
+struct loop {
+	int epfd;
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	int ready;
+
+	/* sources removed while events are pending, freed once they are
+	 * dispatched */
+	struct list_head removed;
+};
+
+struct loop *
+loop_create(void)
+{
+	struct loop *loop;
+
+	loop = calloc(1, sizeof (*loop));
+	if (!loop)
+		return NULL;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		err("failed to create epoll instance: %m");
+		free(loop);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&loop->removed);
+
+	return loop;
+}
+
+static void
+free_removed(struct loop *loop)
+{
+	struct loop_source *src, *next;
+
+	list_for_each_entry_safe(src, next, &loop->removed, link) {
+		list_del(&src->link);
+		free(src);
+	}
+}
+
+void
+loop_destroy(struct loop *loop)
+{
+	free_removed(loop);
+	close(loop->epfd);
+	free(loop);
+}
+
+static struct loop_source *
+add_source(struct loop *loop, int fd, uint32_t events, void *data)
+{
+	struct loop_source *src;
+	struct epoll_event ev;
+
+	src = calloc(1, sizeof (*src));
+	if (!src)
+		return NULL;
+
+	src->loop = loop;
+	src->fd = fd;
+	src->events = events;
+	src->data = data;
+	INIT_LIST_HEAD(&src->link);
+
+	memzero(ev);
+	ev.events = events;
+	ev.data.ptr = src;
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		err("failed to watch fd %d: %m", fd);
+		free(src);
+		return NULL;
+	}
+
+	return src;
+}
+
+struct loop_source *
+loop_add_fd(struct loop *loop, int fd, uint32_t events, loop_fd_cb_t cb,
+	    void *data)
+{
+	struct loop_source *src;
+
+	src = add_source(loop, fd, events, data);
+	if (src)
+		src->fd_cb = cb;
+
+	return src;
+}
+
+int
+loop_update_fd(struct loop_source *src, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (events == src->events)
+		return 0;
+
+	memzero(ev);
+	ev.events = events;
+	ev.data.ptr = src;
+
+	if (epoll_ctl(src->loop->epfd, EPOLL_CTL_MOD, src->fd, &ev) < 0) {
+		err("failed to update fd %d: %m", src->fd);
+		return -1;
+	}
+
+	src->events = events;
+
+	return 0;
+}
+
+struct loop_source *
+loop_add_timer(struct loop *loop, loop_timer_cb_t cb, void *data)
+{
+	struct loop_source *src;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		err("failed to create timer: %m");
+		return NULL;
+	}
+
+	src = add_source(loop, fd, EPOLLIN | EPOLLET, data);
+	if (!src) {
+		close(fd);
+		return NULL;
+	}
+
+	src->timer = 1;
+	src->timer_cb = cb;
+
+	return src;
+}
+
+static void
+us_to_timespec(uint64_t us, struct timespec *ts)
+{
+	ts->tv_sec = us / 1000000;
+	ts->tv_nsec = (us % 1000000) * 1000;
+}
+
+int
+loop_timer_arm(struct loop_source *src, uint64_t delay_us,
+	       uint64_t interval_us)
+{
+	struct itimerspec its;
+
+	us_to_timespec(delay_us, &its.it_value);
+	us_to_timespec(interval_us, &its.it_interval);
+
+	if (timerfd_settime(src->fd, 0, &its, NULL) < 0) {
+		err("failed to arm timer: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+loop_timer_arm_abs(struct loop_source *src, uint64_t time_us)
+{
+	struct itimerspec its;
+
+	/* 0 would disarm the timer, a time in the past fires at once */
+	us_to_timespec(time_us ? time_us : 1, &its.it_value);
+	us_to_timespec(0, &its.it_interval);
+
+	if (timerfd_settime(src->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		err("failed to arm timer: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+loop_remove(struct loop_source *src)
+{
+	struct loop *loop = src->loop;
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL) < 0)
+		err("failed to stop watching fd %d: %m", src->fd);
+
+	if (src->timer)
+		close(src->fd);
+
+	/* the source may still be in the events returned by loop_wait() */
+	src->removed = 1;
+	if (loop->ready > 0)
+		list_add_tail(&src->link, &loop->removed);
+	else
+		free(src);
+}
+
+int
+loop_wait(struct loop *loop, int timeout)
+{
+	int ret;
+
+	ret = epoll_wait(loop->epfd, loop->events, LOOP_MAX_EVENTS, timeout);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		err("epoll_wait: %m");
+		return -1;
+	}
+
+	loop->ready = ret;
+
+	return ret;
+}
+
+static void
+dispatch_timer(struct loop_source *src)
+{
+	uint64_t expirations;
+
+	if (read(src->fd, &expirations, sizeof (expirations)) < 0) {
+		/* rearmed or disarmed since it expired */
+		if (errno != EAGAIN)
+			err("failed to read timer: %m");
+		return;
+	}
+
+	src->timer_cb(src, expirations, src->data);
+}
+
+void
+loop_dispatch(struct loop *loop)
+{
+	struct loop_source *src;
+
+	for (int n = 0; n < loop->ready; n++) {
+		src = loop->events[n].data.ptr;
+		if (src->removed)
+			continue;
+
+		if (src->timer)
+			dispatch_timer(src);
+		else
+			src->fd_cb(src, loop->events[n].events, src->data);
+	}
+
+	loop->ready = 0;
+	free_removed(loop);
+}
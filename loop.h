@@ -0,0 +1,71 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Event loop header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef INCLUDE_LOOP_H
+#define INCLUDE_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+struct loop;
+struct loop_source;
+
+/* events is a mask of EPOLLIN, EPOLLOUT, EPOLLPRI, EPOLLERR... */
+typedef void (*loop_fd_cb_t)(struct loop_source *src, uint32_t events,
+			     void *data);
+
+/* expirations is the number of times the timer expired since the last
+ * call */
+typedef void (*loop_timer_cb_t)(struct loop_source *src,
+				uint64_t expirations, void *data);
+
+struct loop *loop_create(void);
+void loop_destroy(struct loop *loop);
+
+/* Watch fd for events; add EPOLLET for edge-triggered notification, the
+ * handler must then consume everything until EAGAIN */
+struct loop_source *loop_add_fd(struct loop *loop, int fd, uint32_t events,
+				loop_fd_cb_t cb, void *data);
+
+/* Change the events watched, without a syscall if they did not change */
+int loop_update_fd(struct loop_source *src, uint32_t events);
+
+/* Add a CLOCK_MONOTONIC timer, initially disarmed */
+struct loop_source *loop_add_timer(struct loop *loop, loop_timer_cb_t cb,
+				   void *data);
+
+/* Fire after delay_us, then every interval_us if not 0. A delay of 0
+ * disarms the timer. */
+int loop_timer_arm(struct loop_source *src, uint64_t delay_us,
+		   uint64_t interval_us);
+
+/* Fire at the CLOCK_MONOTONIC time time_us */
+int loop_timer_arm_abs(struct loop_source *src, uint64_t time_us);
+
+/* Stop watching and free the source; a timer's fd is closed, other fds
+ * are left to their owner */
+void loop_remove(struct loop_source *src);
+
+/* Wait up to timeout milliseconds (-1 for ever) for events. Returns the
+ * number of ready sources, 0 on timeout or if interrupted, -1 on error. */
+int loop_wait(struct loop *loop, int timeout);
+
+/* Call the handlers of the sources found ready by loop_wait() */
+void loop_dispatch(struct loop *loop);
+
+#endif /* INCLUDE_LOOP_H */
@@ -26,19 +26,24 @@
 #include <linux/input.h>
 #include <linux/videodev2.h>
 #include <media/msm_vidc.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/signalfd.h>
 #include <signal.h>
-#include <poll.h>
 #include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "args.h"
 #include "common.h"
 #include "video.h"
 #include "display.h"
+#include "loop.h"
+#include "reader.h"
+#include "sched.h"
+#include "stateless.h"
 
 #define DBG_TAG "  main"
 
@@ -51,7 +56,7 @@
 
 static void stream_close(struct instance *i);
 
-static const int event_type[] = {
+static const int msm_event_type[] = {
 	V4L2_EVENT_MSM_VIDC_FLUSH_DONE,
 	V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_SUFFICIENT,
 	V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_INSUFFICIENT,
@@ -62,12 +67,26 @@ static const int event_type[] = {
 	V4L2_EVENT_MSM_VIDC_RELEASE_UNQUEUED_BUFFER,
 };
 
+static const int std_event_type[] = {
+	V4L2_EVENT_SOURCE_CHANGE,
+	V4L2_EVENT_EOS,
+};
+
 static int
 subscribe_events(struct instance *i)
 {
-	const int n_events = sizeof(event_type) / sizeof(event_type[0]);
+	const int *event_type;
+	int n_events;
 	int idx;
 
+	if (i->video.msm) {
+		event_type = msm_event_type;
+		n_events = ARRAY_LENGTH(msm_event_type);
+	} else {
+		event_type = std_event_type;
+		n_events = ARRAY_LENGTH(std_event_type);
+	}
+
 	for (idx = 0; idx < n_events; idx++) {
 		if (video_subscribe_event(i, event_type[idx]))
 			return -1;
@@ -76,59 +95,314 @@ subscribe_events(struct instance *i)
 	return 0;
 }
 
+static uint64_t
+get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+wake_parser(struct instance *i)
+{
+	uint64_t val = 1;
+
+	if (write(i->parser_evfd, &val, sizeof (val)) < 0)
+		err("failed to wake up parser thread: %m");
+}
+
+static void
+wake_main(struct instance *i)
+{
+	uint64_t val = 1;
+
+	if (write(i->main_evfd, &val, sizeof (val)) < 0)
+		err("failed to wake up main thread: %m");
+}
+
+static void
+finish(struct instance *i)
+{
+	i->finish = 1;
+	wake_parser(i);
+}
+
+/* Whether the window buffer was imported with the current capture
+ * format and geometry */
+static int
+fb_is_current(struct video *vid, struct fb *fb)
+{
+	if (fb->format != vid->cap_buf_format ||
+	    fb->width != vid->cap_w || fb->height != vid->cap_h ||
+	    fb->n_planes != vid->cap_planes_count)
+		return 0;
+
+	for (int p = 0; p < fb->n_planes; p++) {
+		if (fb->offsets[p] != vid->cap_plane_off[p] ||
+		    fb->strides[p] != vid->cap_plane_stride[p])
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Index of the capture buffer the window buffer was imported from, or -1
+ * if that buffer is not used by the CAPTURE queue anymore */
+static int
+fb_capture_index(struct instance *i, struct fb *fb)
+{
+	struct video *vid = &i->video;
+
+	for (int n = 0; n < vid->cap_buf_cnt; n++) {
+		if (vid->cap_buf_id[n] == fb->id)
+			return n;
+	}
+
+	return -1;
+}
+
+/* Window buffer of the previous reconfiguration which can be kept for
+ * capture buffer id */
 static struct fb *
-find_fb(struct instance *i, int group, int index)
+find_reusable_fb(struct instance *i, int id)
 {
 	struct fb *fb;
 
-	list_for_each_entry(fb, &i->fb_list, link) {
-		if (fb->group == group && fb->index == index && fb->buffer)
+	for (int n = 0; n < MAX_CAP_BUF; n++) {
+		fb = i->cap_fb[n];
+		if (fb && fb->id == id && fb_is_current(&i->video, fb))
 			return fb;
 	}
 
 	return NULL;
 }
 
+/* Whether capture buffer n is still on screen, possibly through a window
+ * buffer imported before a reconfiguration */
+static int
+capture_buf_busy(struct instance *i, int n)
+{
+	struct fb *fb;
+
+	if (i->cap_fb[n] && i->cap_fb[n]->busy)
+		return 1;
+
+	list_for_each_entry(fb, &i->retired_fbs, link) {
+		if (fb->index == n && fb->busy)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reconfiguring the CAPTURE queue allocates and maps a new set of buffers
+ * and imports them in the compositor, which takes long enough to be
+ * noticed. The queue is stopped by the main thread, then a helper thread
+ * sets up and imports the new buffers while the main thread keeps
+ * servicing the compositor, the OUTPUT queue and signals, with the last
+ * frame on screen. The main thread switches to the new buffers in
+ * restart_capture_done() once the helper thread is finished.
+ */
+static void *
+reconfig_thread_func(void *data)
+{
+	struct instance *i = data;
+	struct reconfig *r = &i->reconfig;
+	struct video *vid = &i->video;
+	struct fb *fbs[MAX_CAP_BUF], *fb;
+	uint64_t setup_end;
+	int count = 0, extra = 0;
+
+	/* stateless decoders keep the reference frames in CAPTURE buffers
+	 * held by the application */
+	if (vid->stateless)
+		extra = stateless_dpb_size(i);
+
+	r->ret = video_setup_capture(i, 4 + extra, r->width, r->height);
+
+	setup_end = get_time_us();
+	r->setup_time = setup_end - r->start;
+
+	/* import the buffers now rather than on their first display; the
+	 * main thread leaves the window buffers alone until
+	 * restart_capture_done() */
+	for (int n = 0; !r->ret && i->window && n < vid->cap_buf_cnt; n++) {
+		if (find_reusable_fb(i, vid->cap_buf_id[n]))
+			continue;
+
+		fb = fb_create(i->window, vid->cap_buf_id[n], n,
+			       vid->cap_buf_fd[n], vid->cap_buf_format,
+			       vid->cap_w, vid->cap_h, vid->cap_planes_count,
+			       vid->cap_plane_off, vid->cap_plane_stride);
+		if (fb)
+			fbs[count++] = fb;
+	}
+
+	/* in a single batch; failed imports are retried by get_fb() */
+	if (count > 0 && window_import_buffers(i->window, fbs, count) < 0) {
+		for (int n = 0; n < count; n++)
+			fb_destroy(fbs[n]);
+		count = 0;
+	}
+
+	for (int n = 0; n < count; n++) {
+		if (fbs[n])
+			r->fbs[fbs[n]->index] = fbs[n];
+	}
+
+	r->import_time = get_time_us() - setup_end;
+
+	atomic_store(&r->done, 1);
+	wake_main(i);
+
+	return NULL;
+}
+
 static int
 restart_capture(struct instance *i)
 {
 	struct video *vid = &i->video;
-	struct fb *fb, *next;
-	int n;
+	struct reconfig *r = &i->reconfig;
 
-	/*
-	 * Destroy window buffers that are not in use by the
-	 * wayland compositor; buffers in use will be destroyed
-	 * when the release callback is called
-	 */
-	list_for_each_entry_safe(fb, next, &i->fb_list, link) {
-		if (!fb->busy)
-			fb_destroy(fb);
+	if (r->running) {
+		r->again = 1;
+		return 0;
 	}
 
-	/* Stop capture and release buffers */
+	r->start = get_time_us();
+
+	i->reconfigure_pending = 1;
+
+	/* keep the last frame decoded on screen, the buffers of the others
+	 * are going away */
+	if (i->sched)
+		sched_flush(i->sched);
+
+	/* Stop capture and return the buffers to the pool */
 	if (vid->cap_buf_cnt > 0 && video_stop_capture(i))
 		return -1;
 
-	/* Setup capture queue with new parameters */
-	if (video_setup_capture(i, 4, i->width, i->height))
+	if (vid->stateless)
+		stateless_reset_dpb(i);
+
+	/* Setup capture queue with new parameters, reusing pooled buffers
+	 * when they fit. In adaptive playback the buffers are sized for the
+	 * largest rendition, the decoder then switches to smaller ones
+	 * without a reconfiguration. */
+	r->width = MAX(i->width, i->max_width);
+	r->height = MAX(i->height, i->max_height);
+	memset(r->fbs, 0, sizeof (r->fbs));
+	atomic_store(&r->done, 0);
+
+	if (pthread_create(&r->thread, NULL, reconfig_thread_func, i)) {
+		err("failed to create reconfiguration thread");
+		return -1;
+	}
+
+	r->running = 1;
+
+	return 0;
+}
+
+static int
+restart_capture_done(struct instance *i)
+{
+	struct video *vid = &i->video;
+	struct reconfig *r = &i->reconfig;
+	struct fb *old[MAX_CAP_BUF], *fb;
+	uint64_t elapsed;
+	int n;
+
+	pthread_join(r->thread, NULL);
+	r->running = 0;
+
+	if (r->ret) {
+		err("failed to reconfigure capture");
 		return -1;
+	}
+
+	/*
+	 * Keep the window buffers of reused capture buffers if the geometry
+	 * did not change, take the ones imported by the helper thread for
+	 * the others
+	 */
+	memcpy(old, i->cap_fb, sizeof (old));
+	memset(i->cap_fb, 0, sizeof (i->cap_fb));
+
+	for (n = 0; n < vid->cap_buf_cnt; n++) {
+		fb = r->fbs[n];
+
+		for (int k = 0; !fb && k < MAX_CAP_BUF; k++) {
+			if (old[k] && old[k]->id == vid->cap_buf_id[n] &&
+			    fb_is_current(vid, old[k])) {
+				fb = old[k];
+				old[k] = NULL;
+			}
+		}
+
+		if (fb)
+			fb->index = n;
+
+		i->cap_fb[n] = fb;
+	}
+
+	/*
+	 * Destroy the other window buffers unless they are in use by the
+	 * wayland compositor; buffers in use are retired and destroyed
+	 * when the release callback is called. Their index is now the one
+	 * of the capture buffer sharing their memory, if any.
+	 */
+	list_for_each_entry(fb, &i->retired_fbs, link)
+		fb->index = fb_capture_index(i, fb);
+
+	for (n = 0; n < MAX_CAP_BUF; n++) {
+		fb = old[n];
+		if (!fb)
+			continue;
+
+		if (fb->busy) {
+			fb->index = fb_capture_index(i, fb);
+			list_add_tail(&fb->link, &i->retired_fbs);
+		} else {
+			fb_destroy(fb);
+		}
+	}
 
 	/* Start streaming */
 	if (video_stream(i, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
 			 VIDIOC_STREAMON))
 		return -1;
 
-	/* Queue all capture buffers */
+	/* Queue all capture buffers, except reused ones still on screen,
+	 * which are queued when released */
 	for (n = 0; n < vid->cap_buf_cnt; n++) {
+		if (capture_buf_busy(i, n))
+			continue;
+
 		if (video_queue_buf_cap(i, n))
 			return -1;
 	}
 
-	/*
-	 * Recreate the window frame buffers
-	 */
-	i->group++;
+	elapsed = get_time_us() - r->start;
+	r->total_time += elapsed;
+	r->max_time = MAX(r->max_time, elapsed);
+	r->count++;
+
+	info("Capture reconfigured to %dx%d in %.1f ms (setup %.1f ms, "
+	     "import %.1f ms)", vid->cap_w, vid->cap_h, elapsed / 1000.0,
+	     r->setup_time / 1000.0, r->import_time / 1000.0);
+
+	/* the stream changed again in the meantime */
+	if (r->again) {
+		r->again = 0;
+		return restart_capture(i);
+	}
+
+	i->reconfigure_pending = 0;
 
 	return 0;
 }
@@ -187,13 +461,149 @@ pic_struct_to_string(int pic)
 	return "unknown";
 }
 
+/*
+ * The capacity estimate was too optimistic: decode only the I-frames of
+ * the lowest priority stream on the decoder which still decodes all its
+ * frames, or of the last one started for the same priority.
+ */
+static void
+handle_overload(struct instance *i)
+{
+	struct player *p = i->player;
+	struct instance *victim = NULL;
+	uint64_t load;
+
+	for (int n = 0; n < p->count; n++) {
+		struct instance *s = &p->instances[n];
+
+		if (s->device != i->device || !s->video.msm ||
+		    s->skip_frames || s->finish)
+			continue;
+
+		if (!victim || s->priority <= victim->priority)
+			victim = s;
+	}
+
+	if (!victim) {
+		err("decoder overloaded, no stream left to downgrade");
+		return;
+	}
+
+	if (video_set_iframe_only(victim, 1))
+		return;
+
+	victim->skip_frames = 1;
+
+	load = device_iframe_load(victim->load);
+	if (victim->device)
+		device_update(victim->device, victim->load, load);
+	victim->load = load;
+
+	info("Decoding %s I-frames only", victim->url);
+}
+
+/* late frames among the last 32 which make a stream catch up harder */
+#define CATCH_UP_LATE_FRAMES	8
+
+/* the last frames must be on time to step back */
+#define CATCH_UP_RECOVER_FRAMES	4
+
+/* minimum time spent at each step */
+#define CATCH_UP_HOLD_US	2000000
+
+/*
+ * Dropping late frames keeps the picture on time, but the decoder still
+ * spends its time on them. When frames keep being late, stop sending the
+ * packets no other frame depends on, then decode only the I-frames, and
+ * step back once frames are on time again. The skip mode set by -i or by
+ * the admission control is left alone.
+ */
+static void
+update_catch_up(struct instance *i)
+{
+	uint64_t now = get_time_us();
+	int level = i->catch_up;
+
+	/* frames are late on purpose */
+	if (i->hidden)
+		return;
+
+	if (sched_late_frames(i->sched, 32) >= CATCH_UP_LATE_FRAMES) {
+		if (level == CATCH_UP_IFRAMES)
+			return;
+
+		if (level == CATCH_UP_DROP_NONREF) {
+			if (!i->video.msm || i->skip_frames ||
+			    video_set_iframe_only(i, 1))
+				return;
+			info("%s is late, decoding I-frames only", i->url);
+		} else {
+			info("%s is late, dropping non-reference frames",
+			     i->url);
+		}
+
+		level++;
+	} else if (level != CATCH_UP_NONE &&
+		   now - i->catch_up_since >= CATCH_UP_HOLD_US &&
+		   !sched_late_frames(i->sched, CATCH_UP_RECOVER_FRAMES)) {
+		if (level == CATCH_UP_IFRAMES) {
+			/* downgraded meanwhile for good */
+			if (!i->skip_frames && video_set_iframe_only(i, 0))
+				return;
+			info("%s is catching up, decoding reference frames "
+			     "only", i->url);
+		} else {
+			info("%s is on time, decoding all frames", i->url);
+		}
+
+		level--;
+	} else {
+		return;
+	}
+
+	i->catch_up = level;
+	i->catch_up_since = now;
+	sched_clear_late(i->sched);
+}
+
+/*
+ * Nobody sees the frames of a hidden window: decode only the I-frames, at
+ * the nominal clock rate, until the window is shown again, which is
+ * noticed on the next frame decoded, so within a GOP. Other decoders
+ * are not sent the frames nothing depends on meanwhile.
+ */
+static void
+update_visibility(struct instance *i)
+{
+	int hidden = window_is_hidden(i->window);
+
+	if (hidden == i->hidden)
+		return;
+
+	i->hidden = hidden;
+	info("%s is %s", i->url, hidden ? "hidden" : "visible again");
+
+	if (!i->video.msm)
+		return;
+
+	if (!i->skip_frames && i->catch_up != CATCH_UP_IFRAMES)
+		video_set_iframe_only(i, hidden);
+
+	video_set_perf_level(i, !hidden);
+
+	if (!hidden)
+		sched_clear_late(i->sched);
+}
+
 static int
 handle_video_event(struct instance *i)
 {
 	struct v4l2_event event;
+	int ret;
 
-	if (video_dequeue_event(i, &event))
-		return -1;
+	ret = video_dequeue_event(i, &event);
+	if (ret < 0)
+		return ret;
 
 	switch (event.type) {
 	case V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_INSUFFICIENT: {
@@ -239,6 +649,11 @@ handle_video_event(struct instance *i)
 			     colorspace_to_string(cspace));
 		}
 
+		if (i->max_width &&
+		    (width > i->max_width || height > i->max_height))
+			info("  larger than the adaptive playback size %dx%d",
+			     i->max_width, i->max_height);
+
 		i->width = width;
 		i->height = height;
 		i->reconfigure_pending = 1;
@@ -248,9 +663,18 @@ handle_video_event(struct instance *i)
 		video_flush(i, V4L2_QCOM_CMD_FLUSH_CAPTURE);
 		break;
 	}
-	case V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_SUFFICIENT:
-		dbg("Setting changed sufficient");
+	case V4L2_EVENT_MSM_VIDC_PORT_SETTINGS_CHANGED_SUFFICIENT: {
+		unsigned int *ptr = (unsigned int *)event.u.data;
+
+		/* the current buffers fit, only the crop of the following
+		 * frames changes */
+		info("Port Reconfig received sufficient, new size %ux%u",
+		     ptr[1], ptr[0]);
+
+		i->width = ptr[1];
+		i->height = ptr[0];
 		break;
+	}
 	case V4L2_EVENT_MSM_VIDC_FLUSH_DONE: {
 		unsigned int *ptr = (unsigned int *)event.u.data;
 		unsigned int flags = ptr[0];
@@ -263,7 +687,6 @@ handle_video_event(struct instance *i)
 		if (i->reconfigure_pending) {
 			dbg("Reconfiguring output");
 			restart_capture(i);
-			i->reconfigure_pending = 0;
 		}
 		break;
 	}
@@ -271,7 +694,8 @@ handle_video_event(struct instance *i)
 		dbg("SYS Error received");
 		break;
 	case V4L2_EVENT_MSM_VIDC_HW_OVERLOAD:
-		dbg("HW Overload received");
+		info("HW Overload received");
+		handle_overload(i);
 		break;
 	case V4L2_EVENT_MSM_VIDC_HW_UNSUPPORTED:
 		dbg("HW Unsupported received");
@@ -282,6 +706,27 @@ handle_video_event(struct instance *i)
 	case V4L2_EVENT_MSM_VIDC_RELEASE_UNQUEUED_BUFFER:
 		dbg("Release unqueued buffer");
 		break;
+	case V4L2_EVENT_SOURCE_CHANGE:
+		if (!(event.u.src_change.changes &
+		      V4L2_EVENT_SRC_CH_RESOLUTION))
+			break;
+
+		if (video_get_capture_size(i, &i->width, &i->height))
+			return -1;
+
+		info("Source changed, new size %dx%d", i->width, i->height);
+
+		i->reconfigure_pending = 1;
+
+		/* nothing decoded with the previous format, so there is
+		 * nothing to drain; otherwise the capture queue is
+		 * reconfigured once its last buffer has been dequeued */
+		if (!i->prerolled)
+			restart_capture(i);
+		break;
+	case V4L2_EVENT_EOS:
+		dbg("End of stream event received");
+		break;
 	default:
 		dbg("unknown event type occurred %x", event.type);
 		break;
@@ -294,118 +739,229 @@ static void
 cleanup(struct instance *i)
 {
 	stream_close(i);
+	if (i->sched)
+		sched_destroy(i->sched);
 	if (i->window)
 		window_destroy(i->window);
-	if (i->display)
-		display_destroy(i->display);
-	if (i->sigfd != 1)
-		close(i->sigfd);
+	if (i->parser_evfd >= 0)
+		close(i->parser_evfd);
+	if (i->main_evfd >= 0)
+		close(i->main_evfd);
+	stateless_close(i);
+	video_free_capture_pool(i);
 	if (i->video.fd)
 		video_close(i);
+	if (i->device)
+		device_release(i->device, i->load);
 }
 
-struct ts_entry {
-	uint64_t pts;
-	uint64_t dts;
-	uint64_t duration;
-	uint64_t base;
-	struct list_head link;
-};
-
 #define TIMESTAMP_NONE	((uint64_t)-1)
 
-static struct ts_entry *
-ts_insert(struct video *vid, uint64_t pts, uint64_t dts, uint64_t duration,
-	  uint64_t base)
-{
-	struct ts_entry *l;
-
-	l = malloc(sizeof (*l));
-	if (!l)
-		return NULL;
+/* Initial number of pending timestamp slots, grown on demand */
+#define TS_HEAP_SIZE	64
 
-	l->pts = pts;
-	l->dts = dts;
-	l->duration = duration;
-	l->base = base;
+/*
+ * Pending timestamps are kept in a binary min-heap ordered by DTS, so
+ * that finding the next frame in decode order is O(1), and inserting
+ * or removing it is O(log n), without allocating in steady state.
+ */
+static int
+ts_init(struct video *vid)
+{
+	vid->pending_ts = calloc(TS_HEAP_SIZE, sizeof (*vid->pending_ts));
+	if (!vid->pending_ts)
+		return -1;
 
-	list_add_tail(&l->link, &vid->pending_ts_list);
+	vid->pending_ts_size = TS_HEAP_SIZE;
+	vid->pending_ts_count = 0;
 
-	return l;
+	return 0;
 }
 
 static void
-ts_remove(struct ts_entry *l)
+ts_swap(struct ts_entry *a, struct ts_entry *b)
 {
-	list_del(&l->link);
-	free(l);
+	struct ts_entry tmp = *a;
+	*a = *b;
+	*b = tmp;
 }
 
 static int
-parse_frame(struct instance *i, AVPacket *pkt)
+ts_insert(struct video *vid, uint64_t pts, uint64_t dts, uint64_t duration,
+	  uint64_t base, uint64_t queued)
 {
-	int ret;
+	struct ts_entry *heap;
+	int n, parent;
 
-	if (!i->bsf_data_pending) {
-		ret = av_read_frame(i->avctx, pkt);
-		if (ret < 0)
-			return ret;
+	/* entries without DTS can never be matched to a decoded frame */
+	if (dts == TIMESTAMP_NONE)
+		return 0;
 
-		if (pkt->stream_index != i->stream->index) {
-			av_packet_unref(pkt);
-			return AVERROR(EAGAIN);
-		}
+	if (vid->pending_ts_count == vid->pending_ts_size) {
+		int size = vid->pending_ts_size * 2;
 
-		if (i->bsf) {
-			ret = av_bsf_send_packet(i->bsf, pkt);
-			if (ret < 0)
-				return ret;
+		heap = realloc(vid->pending_ts, size * sizeof (*heap));
+		if (!heap)
+			return -1;
 
-			i->bsf_data_pending = 1;
-		}
+		vid->pending_ts = heap;
+		vid->pending_ts_size = size;
 	}
 
-	if (i->bsf) {
-		ret = av_bsf_receive_packet(i->bsf, pkt);
-		if (ret == AVERROR(EAGAIN))
-			i->bsf_data_pending = 0;
+	heap = vid->pending_ts;
+	n = vid->pending_ts_count++;
 
-		if (ret < 0)
-			return ret;
+	heap[n].pts = pts;
+	heap[n].dts = dts;
+	heap[n].duration = duration;
+	heap[n].base = base;
+	heap[n].queued = queued;
+
+	while (n > 0) {
+		parent = (n - 1) / 2;
+		if (heap[parent].dts <= heap[n].dts)
+			break;
+		ts_swap(&heap[parent], &heap[n]);
+		n = parent;
 	}
 
 	return 0;
 }
 
-static void
-finish(struct instance *i)
+static struct ts_entry *
+ts_min(struct video *vid)
 {
-	pthread_mutex_lock(&i->lock);
-	i->finish = 1;
-	pthread_cond_signal(&i->cond);
-	pthread_mutex_unlock(&i->lock);
+	return vid->pending_ts_count > 0 ? &vid->pending_ts[0] : NULL;
 }
 
-static int
-send_eos(struct instance *i, int buf_index)
+static void
+ts_remove_min(struct video *vid)
 {
-	struct video *vid = &i->video;
-	struct timeval tv;
+	struct ts_entry *heap = vid->pending_ts;
+	int count, n, child;
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-
-	if (video_queue_buf_out(i, buf_index, 0,
-				V4L2_QCOM_BUF_FLAG_EOS |
-				V4L2_QCOM_BUF_TIMESTAMP_INVALID, tv) < 0)
-		return -1;
+	if (vid->pending_ts_count == 0)
+		return;
 
-	vid->out_buf_flag[buf_index] = 1;
+	count = --vid->pending_ts_count;
+	heap[0] = heap[count];
 
-	return 0;
+	n = 0;
+	while ((child = 2 * n + 1) < count) {
+		if (child + 1 < count && heap[child + 1].dts < heap[child].dts)
+			child++;
+		if (heap[n].dts <= heap[child].dts)
+			break;
+		ts_swap(&heap[n], &heap[child]);
+		n = child;
+	}
 }
 
-static char *
+static int
+parse_frame(struct instance *i, AVPacket *pkt)
+{
+	int ret;
+
+	ret = av_read_frame(i->avctx, pkt);
+	if (ret < 0)
+		return ret;
+
+	if (pkt->stream_index != i->stream->index) {
+		av_packet_unref(pkt);
+		return AVERROR(EAGAIN);
+	}
+
+	return 0;
+}
+
+/*
+ * OUTPUT buffers are handed over from the main thread, which dequeues
+ * them, to the parser thread, which fills them, through a lock-free
+ * ring. The parser thread only sleeps on its eventfd once it announced
+ * it is waiting, so the main thread only pays for a syscall when the
+ * parser thread actually ran out of buffers.
+ */
+static void
+put_buffer(struct instance *i, int n)
+{
+	ring_push(&i->video.out_free, n);
+}
+
+/* Wake the parser thread up if it waits for the buffers put back */
+static void
+put_buffers_done(struct instance *i)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_exchange(&i->parser_waiting, 0))
+		wake_parser(i);
+}
+
+static int
+get_buffer(struct instance *i)
+{
+	struct video *vid = &i->video;
+	uint64_t val;
+	int n;
+
+	while (!i->finish) {
+		if (ring_pop(&vid->out_free, &n))
+			return n;
+
+		i->parser_waiting = 1;
+		atomic_thread_fence(memory_order_seq_cst);
+
+		/* a buffer may have been put back before we said we
+		 * were waiting */
+		if (ring_pop(&vid->out_free, &n)) {
+			i->parser_waiting = 0;
+			return n;
+		}
+
+		if (i->finish)
+			break;
+
+		if (read(i->parser_evfd, &val, sizeof (val)) < 0 &&
+		    errno != EINTR) {
+			err("failed to wait for buffers: %m");
+			break;
+		}
+	}
+
+	return -1;
+}
+
+static int
+send_eos(struct instance *i, int buf_index)
+{
+	struct video *vid = &i->video;
+	struct timeval tv;
+
+	/* stateless decoders have nothing to drain, the main thread
+	 * finishes once every queued frame has been decoded */
+	if (vid->stateless) {
+		stateless_set_eos(i);
+		wake_main(i);
+		return 0;
+	}
+
+	/* standard decoders are drained with a command instead of an
+	 * empty buffer, buf_index is left unused */
+	if (!vid->msm)
+		return video_stop_decoder(i);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+
+	if (video_queue_buf_out(i, buf_index, 0,
+				V4L2_QCOM_BUF_FLAG_EOS |
+				V4L2_QCOM_BUF_TIMESTAMP_INVALID, tv) < 0)
+		return -1;
+
+	return 0;
+}
+
+static char *
 dump_pkt(const uint8_t *data, size_t size)
 {
 	static char *buf;
@@ -434,34 +990,6 @@ dump_pkt(const uint8_t *data, size_t size)
 }
 
 
-/*
- * Escape start codes in BDU
- */
-static int
-rbdu_escape(uint8_t *dst, int dst_size, const uint8_t *src, int src_size)
-{
-	uint8_t *dstp = dst;
-	const uint8_t *srcp = src;
-	const uint8_t *end = src + src_size;
-	int count = 0;
-
-	while (srcp < end) {
-		if (count == 2 && *srcp <= 0x03) {
-			*dstp++ = 0x03;
-			count = 0;
-		}
-
-		if (*srcp == 0)
-			count++;
-		else
-			count = 0;
-
-		*dstp++ = *srcp++;
-	}
-
-	return dstp - dst;
-}
-
 /*
  * Transform RBDU (raw bitstream decodable units)
  *  into an EBDU (encapsulated bitstream decodable units)
@@ -471,7 +999,10 @@ vc1_write_bdu(uint8_t *dst, int dst_size,
 	      uint8_t *bdu, int bdu_size,
 	      uint8_t type)
 {
-	int len;
+	int len, n;
+
+	if (dst_size < 5)
+		return -1;
 
 	/* add start code */
 	dst[0] = 0x00;
@@ -480,8 +1011,11 @@ vc1_write_bdu(uint8_t *dst, int dst_size,
 	dst[3] = type;
 	len = 4;
 
-	/* escape start codes */
-	len += rbdu_escape(dst + len, dst_size - len, bdu, bdu_size);
+	/* escape start codes, leaving room for the flushing byte */
+	n = bitstream_escape(dst + len, dst_size - len - 1, bdu, bdu_size);
+	if (n < 0)
+		return -1;
+	len += n;
 
 	/* add flushing byte at the end of the BDU */
 	dst[len++] = 0x80;
@@ -492,14 +1026,8 @@ vc1_write_bdu(uint8_t *dst, int dst_size,
 static int
 vc1_find_sc(const uint8_t *data, int size)
 {
-	for (int i = 0; i < size - 4; i++) {
-		if (data[i + 0] == 0x00 &&
-		    data[i + 1] == 0x00 &&
-		    data[i + 2] == 0x01)
-			return i;
-	}
-
-	return -1;
+	/* a start code must be followed by the BDU type */
+	return bitstream_find_sc(data, size - 1);
 }
 
 static int
@@ -560,18 +1088,28 @@ write_sequence_header(struct instance *i, uint8_t *data, int size)
 	}
 }
 
+/* A compressed frame written to an OUTPUT buffer, with timestamps in
+ * microseconds */
+struct packet {
+	int size;
+	uint64_t pts;
+	uint64_t dts;
+	uint64_t duration;
+	uint64_t start_time;
+	int key;
+};
+
+static const AVRational v4l_timebase = { 1, 1000000 };
+
+/* Copy a packet read by libavformat to an OUTPUT buffer, rewriting its
+ * payload if the decoder needs it */
 static int
-send_pkt(struct instance *i, int buf_index, AVPacket *pkt)
+fill_pkt(struct instance *i, int buf_index, AVPacket *pkt, struct packet *p)
 {
 	struct video *vid = &i->video;
-	struct timeval tv;
-	uint64_t pts, dts, duration, start_time;
-	int flags;
-	int size;
 	uint8_t *data;
-	const char *hex;
+	int size;
 	AVRational vid_timebase;
-	AVRational v4l_timebase = { 1, 1000000 };
 	AVCodecParameters *codecpar = i->stream->codecpar;
 
 	data = (uint8_t *)vid->out_buf_addr[buf_index];
@@ -595,84 +1133,190 @@ send_pkt(struct instance *i, int buf_index, AVPacket *pkt)
 		i->need_header = 0;
 	}
 
-	if ((codecpar->codec_id == AV_CODEC_ID_WMV3 ||
-	     codecpar->codec_id == AV_CODEC_ID_VC1) &&
-	    i->insert_sc) {
-		size += vc1_write_bdu(data + size, vid->out_buf_size - size,
+	if (codecpar->codec_id == AV_CODEC_ID_H264 ||
+	    codecpar->codec_id == AV_CODEC_ID_HEVC) {
+		int n = annexb_write(&i->annexb, data + size,
+				     vid->out_buf_size - size,
+				     pkt->data, pkt->size,
+				     pkt->flags & AV_PKT_FLAG_KEY);
+		if (n < 0)
+			return AVERROR(ENOSPC);
+
+		size += n;
+	} else if ((codecpar->codec_id == AV_CODEC_ID_WMV3 ||
+		    codecpar->codec_id == AV_CODEC_ID_VC1) &&
+		   i->insert_sc) {
+		int n = vc1_write_bdu(data + size, vid->out_buf_size - size,
 				      pkt->data, pkt->size, 0x0d);
+		if (n < 0)
+			return AVERROR(ENOSPC);
+
+		size += n;
 	} else {
+		if (size + pkt->size > vid->out_buf_size)
+			return AVERROR(ENOSPC);
+
 		memcpy(data + size, pkt->data, pkt->size);
 		size += pkt->size;
 	}
 
-	flags = 0;
-
 	vid_timebase = i->stream->time_base;
 
-	start_time = 0;
+	p->size = size;
+	p->key = !!(pkt->flags & AV_PKT_FLAG_KEY);
+
+	p->start_time = 0;
 	if (i->stream->start_time != AV_NOPTS_VALUE)
-		start_time = av_rescale_q(i->stream->start_time,
-					  vid_timebase, v4l_timebase);
+		p->start_time = av_rescale_q(i->stream->start_time,
+					     vid_timebase, v4l_timebase);
 
-	pts = TIMESTAMP_NONE;
+	p->pts = TIMESTAMP_NONE;
 	if (pkt->pts != AV_NOPTS_VALUE)
-		pts = av_rescale_q(pkt->pts, vid_timebase, v4l_timebase);
+		p->pts = av_rescale_q(pkt->pts, vid_timebase, v4l_timebase);
 
-	dts = TIMESTAMP_NONE;
+	p->dts = TIMESTAMP_NONE;
 	if (pkt->dts != AV_NOPTS_VALUE)
-		dts = av_rescale_q(pkt->dts, vid_timebase, v4l_timebase);
+		p->dts = av_rescale_q(pkt->dts, vid_timebase, v4l_timebase);
 
-	duration = TIMESTAMP_NONE;
+	p->duration = TIMESTAMP_NONE;
 	if (pkt->duration) {
-		duration = av_rescale_q(pkt->duration,
-					vid_timebase, v4l_timebase);
+		p->duration = av_rescale_q(pkt->duration,
+					   vid_timebase, v4l_timebase);
 	}
 
+	return 0;
+}
+
+/* Read the next frame with the native reader, straight into the
+ * OUTPUT buffer */
+static int
+read_native_pkt(struct instance *i, int buf_index, struct packet *p)
+{
+	struct video *vid = &i->video;
+	struct reader *r = i->reader;
+	struct reader_frame frame;
+	AVRational timebase = { r->tb_num, r->tb_den };
+	int ret;
+
+	frame.header = vid->stateless ?
+		stateless_frame_header(i, buf_index) : NULL;
+
+	ret = reader_read_frame(r, vid->out_buf_addr[buf_index],
+				vid->out_buf_size, &frame);
+	if (ret == 0)
+		return AVERROR_EOF;
+	if (ret < 0)
+		return ret;
+
+	p->size = frame.size;
+	p->key = frame.key;
+	p->start_time = 0;
+	p->dts = av_rescale_q(frame.dts, timebase, v4l_timebase);
+
+	/* elementary streams carry no presentation time */
+	p->pts = TIMESTAMP_NONE;
+	if (frame.pts != READER_NOPTS)
+		p->pts = av_rescale_q(frame.pts, timebase, v4l_timebase);
+
+	p->duration = TIMESTAMP_NONE;
+	if (frame.duration) {
+		p->duration = av_rescale_q(frame.duration,
+					   timebase, v4l_timebase);
+	}
+
+	return 0;
+}
+
+static int
+send_pkt(struct instance *i, int buf_index, struct packet *p)
+{
+	struct video *vid = &i->video;
+	struct timeval tv;
+	int flags, ret;
+	const char *hex;
+	uint64_t queued;
+
+	flags = 0;
+
 	if (debug_level > 3)
-		hex = dump_pkt(data, size);
+		hex = dump_pkt((uint8_t *)vid->out_buf_addr[buf_index],
+			       p->size);
 	else
 		hex = "";
 
 	dbg("input size=%d pts=%" PRIi64 " dts=%" PRIi64 " duration=%" PRIu64
-	     " start_time=%" PRIi64 "%s", size, pts, dts, duration,
-	     start_time, hex);
-
-	if (pts != TIMESTAMP_NONE) {
-		tv.tv_sec = pts / 1000000;
-		tv.tv_usec = pts % 1000000;
+	     " start_time=%" PRIi64 "%s", p->size, p->pts, p->dts,
+	     p->duration, p->start_time, hex);
+
+	if (p->pts != TIMESTAMP_NONE) {
+		tv.tv_sec = p->pts / 1000000;
+		tv.tv_usec = p->pts % 1000000;
+	} else if (!vid->msm && p->dts != TIMESTAMP_NONE) {
+		/* without an invalid timestamp flag, keep timestamps
+		 * unique: stateless decoders find the reference frames by
+		 * them. They are not presentation times, the PTS is
+		 * guessed when the frame is decoded. */
+		tv.tv_sec = p->dts / 1000000;
+		tv.tv_usec = p->dts % 1000000;
+		atomic_store(&vid->dts_timestamps, 1);
 	} else {
-		flags |= V4L2_QCOM_BUF_TIMESTAMP_INVALID;
+		if (vid->msm)
+			flags |= V4L2_QCOM_BUF_TIMESTAMP_INVALID;
 		tv.tv_sec = 0;
 		tv.tv_usec = 0;
 	}
 
-	if ((pkt->flags & AV_PKT_FLAG_KEY) &&
-	    pts != TIMESTAMP_NONE && dts != TIMESTAMP_NONE)
-		vid->pts_dts_delta = pts - dts;
+	if (p->key && p->pts != TIMESTAMP_NONE && p->dts != TIMESTAMP_NONE)
+		vid->pts_dts_delta = p->pts - p->dts;
+
+	queued = get_time_us();
 
-	if (video_queue_buf_out(i, buf_index, size, flags, tv) < 0)
+	if (vid->stateless)
+		ret = stateless_queue_buf(i, buf_index, p->size, tv);
+	else
+		ret = video_queue_buf_out(i, buf_index, p->size, flags, tv);
+	if (ret < 0)
 		return -1;
 
+	if (!vid->first_queued)
+		vid->first_queued = queued;
+	vid->total_bytes += p->size;
+
 	pthread_mutex_lock(&i->lock);
-	ts_insert(vid, pts, dts, duration, start_time);
+	ts_insert(vid, p->pts, p->dts, p->duration, p->start_time, queued);
 	pthread_mutex_unlock(&i->lock);
 
-	vid->out_buf_flag[buf_index] = 1;
-
 	return 0;
 }
 
+/* Keep the packet out of the decoder if the stream is late or hidden and
+ * no other frame depends on it */
 static int
-get_buffer_unlocked(struct instance *i)
+drop_packet(struct instance *i, int buf_index, struct packet *p)
 {
-	struct video *vid = &i->video;
+	struct frame_info info;
+	int ret;
 
-	for (int n = 0; n < vid->out_buf_cnt; n++) {
-		if (!vid->out_buf_flag[n])
-			return n;
-	}
+	/* every frame is classified, HEVC sub-layers are learnt from the
+	 * stream; this only parses the headers */
+	ret = bitstream_classify(&i->classify, i->fourcc,
+				 (uint8_t *)i->video.out_buf_addr[buf_index],
+				 p->size, &info);
 
-	return -1;
+	/* the MSM decoder skips them itself while hidden */
+	if (i->catch_up < CATCH_UP_DROP_NONREF &&
+	    (!i->hidden || i->video.msm))
+		return 0;
+
+	if (ret < 0 || info.ref)
+		return 0;
+
+	dbg("dropping non-reference %c frame, pts %" PRIi64,
+	    "IPB"[info.type], p->pts);
+
+	i->dropped_packets++;
+
+	return 1;
 }
 
 /* This threads is responsible for parsing the stream and
@@ -681,31 +1325,38 @@ static void *
 parser_thread_func(void *args)
 {
 	struct instance *i = (struct instance *)args;
+	struct packet packet;
 	AVPacket pkt;
 	int buf, parse_ret;
 
 	dbg("Parser thread started");
 
 	av_init_packet(&pkt);
+	parse_ret = 0;
+	buf = -1;
 
 	while (1) {
-		parse_ret = parse_frame(i, &pkt);
-		if (parse_ret == AVERROR(EAGAIN))
-			continue;
-
-
-		buf = -1;
-
-		pthread_mutex_lock(&i->lock);
-		while (!i->finish && (buf = get_buffer_unlocked(i)) < 0)
-			pthread_cond_wait(&i->cond, &i->lock);
-		pthread_mutex_unlock(&i->lock);
+		if (!i->reader) {
+			parse_ret = parse_frame(i, &pkt);
+			if (parse_ret == AVERROR(EAGAIN))
+				continue;
+		}
 
+		/* the buffer of a dropped packet is filled again */
+		if (buf < 0)
+			buf = get_buffer(i);
 		if (buf < 0) {
 			/* decoding stopped before parsing ended, abort */
 			break;
 		}
 
+		if (i->reader) {
+			parse_ret = read_native_pkt(i, buf, &packet);
+		} else if (parse_ret >= 0) {
+			parse_ret = fill_pkt(i, buf, &pkt, &packet);
+			av_packet_unref(&pkt);
+		}
+
 		if (parse_ret < 0) {
 			if (parse_ret == AVERROR_EOF)
 				dbg("Queue end of stream");
@@ -716,10 +1367,13 @@ parser_thread_func(void *args)
 			break;
 		}
 
-		if (send_pkt(i, buf, &pkt) < 0)
+		if (drop_packet(i, buf, &packet))
+			continue;
+
+		if (send_pkt(i, buf, &packet) < 0)
 			break;
 
-		av_packet_unref(&pkt);
+		buf = -1;
 	}
 
 	av_packet_unref(&pkt);
@@ -733,147 +1387,317 @@ static void
 buffer_released(struct fb *fb, void *data)
 {
 	struct instance *i = data;
-	int n = fb->index;
+	int n;
 
-	if (fb->group != i->group) {
-		fb_destroy(fb);
+	/* the capture buffers are being replaced, restart_capture_done()
+	 * sorts out the released window buffers */
+	if (i->reconfig.running)
 		return;
+
+	n = fb->index;
+
+	/* imported before a reconfiguration */
+	if (n < 0 || i->cap_fb[n] != fb) {
+		fb_destroy(fb);
+		if (n < 0 || capture_buf_busy(i, n))
+			return;
 	}
 
-	if (!i->reconfigure_pending)
+	if (!i->reconfigure_pending && !i->video.cap_buf_held[n] &&
+	    !i->video.cap_buf_flag[n])
 		video_queue_buf_cap(i, n);
 }
 
+static void
+present_frame(struct fb *fb, void *data)
+{
+	struct instance *i = data;
+
+	window_show_buffer(i->window, fb, buffer_released, i);
+}
+
 static struct fb *
 get_fb(struct instance *i, int n)
 {
 	struct video *vid = &i->video;
 	struct fb *fb;
 
-	fb = find_fb(i, i->group, n);
+	fb = i->cap_fb[n];
 	if (!fb) {
-		fb = window_create_buffer(i->window, i->group, n,
+		fb = window_create_buffer(i->window, vid->cap_buf_id[n], n,
 					  vid->cap_buf_fd[n],
 					  vid->cap_buf_format,
 					  vid->cap_w, vid->cap_h,
 					  vid->cap_planes_count,
 					  vid->cap_plane_off,
 					  vid->cap_plane_stride);
-		if (fb)
-			list_add_tail(&fb->link, &i->fb_list);
+		i->cap_fb[n] = fb;
 	}
 
 	return fb;
 }
 
+static void
+bench_add_latency(struct video *vid, uint64_t latency)
+{
+	if (vid->latency_count == vid->latency_size) {
+		int size = vid->latency_size ? vid->latency_size * 2 : 1024;
+		uint64_t *l = realloc(vid->latency, size * sizeof (*l));
+		if (!l)
+			return;
+		vid->latency = l;
+		vid->latency_size = size;
+	}
+
+	vid->latency[vid->latency_count++] = latency;
+}
+
 static int
-handle_video_capture(struct instance *i)
+compare_u64(const void *a, const void *b)
 {
-	struct video *vid = &i->video;
-	struct timeval tv;
-	uint32_t flags;
-	uint64_t pts;
-	unsigned int bytesused;
-	struct msm_vidc_extradata_header *extradata;
-	bool busy;
-	int ret, n;
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
 
-	/* capture buffer is ready */
+	return x < y ? -1 : x > y;
+}
 
-	ret = video_dequeue_capture(i, &n, &bytesused, &flags, &tv, &extradata);
-	if (ret < 0) {
-		err("dequeue capture buffer fail");
-		return ret;
+static uint64_t
+bench_percentile(struct video *vid, int pct)
+{
+	return vid->latency[(vid->latency_count - 1) * pct / 100];
+}
+
+static void
+bench_print_stats(struct instance *i)
+{
+	struct video *vid = &i->video;
+	uint64_t elapsed;
+
+	if (!vid->total_captured || vid->last_captured <= vid->first_queued) {
+		info("Benchmark: no frames decoded");
+		return;
 	}
 
-	if (flags & V4L2_QCOM_BUF_TIMESTAMP_INVALID)
-		pts = TIMESTAMP_NONE;
-	else
-		pts = ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+	elapsed = vid->last_captured - vid->first_queued;
 
-	busy = false;
+	info("Benchmark: %lu frames in %.3f s, %.2f frames/s, %.3f Mbit/s",
+	     vid->total_captured, elapsed / 1e6,
+	     vid->total_captured * 1e6 / elapsed,
+	     vid->total_bytes * 8.0 / elapsed);
 
-	if (bytesused > 0) {
-		struct ts_entry *l, *min = NULL;
-		int pending = 0;
+	if (!vid->latency_count)
+		return;
 
-		vid->total_captured++;
+	qsort(vid->latency, vid->latency_count, sizeof (*vid->latency),
+	      compare_u64);
 
-		pthread_mutex_lock(&i->lock);
+	info("Benchmark: latency p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, "
+	     "max %.3f ms", bench_percentile(vid, 50) / 1e3,
+	     bench_percentile(vid, 95) / 1e3, bench_percentile(vid, 99) / 1e3,
+	     vid->latency[vid->latency_count - 1] / 1e3);
+}
 
-		/* PTS are expected to be monotonically increasing,
-		 * so when unknown use the lowest pending DTS */
-		list_for_each_entry(l, &vid->pending_ts_list, link) {
-			if (l->dts == TIMESTAMP_NONE)
-				continue;
-			if (min == NULL || min->dts > l->dts)
-				min = l;
-			pending++;
-		}
+/* Work out the presentation time of a decoded frame, from its timestamp
+ * or from the oldest pending packet, and queue it for display. Returns 1
+ * if the buffer is on its way to the screen, 0 if not, -1 on error. */
+static int
+show_frame(struct instance *i, int n, uint64_t pts,
+	   struct msm_vidc_extradata_header *extradata)
+{
+	struct video *vid = &i->video;
+	struct ts_entry *min;
+	int busy = 0;
 
-		if (min) {
-			dbg("pending %d min pts %" PRIi64
-			    " dts %" PRIi64
-			    " duration %" PRIi64, pending,
-			    min->pts, min->dts, min->duration);
-		}
+	vid->total_captured++;
+	vid->last_captured = get_time_us();
 
-		if (pts == TIMESTAMP_NONE) {
-			dbg("no pts on frame");
-			if (min && vid->pts_dts_delta != TIMESTAMP_NONE) {
-				dbg("reuse dts %" PRIu64
-				    " delta %" PRIu64,
-				    min->dts, vid->pts_dts_delta);
-				pts = min->dts + vid->pts_dts_delta;
-			}
+	pthread_mutex_lock(&i->lock);
+
+	/* PTS are expected to be monotonically increasing,
+	 * so when unknown use the lowest pending DTS */
+	min = ts_min(vid);
+
+	if (min) {
+		dbg("pending %d min pts %" PRIi64
+		    " dts %" PRIi64
+		    " duration %" PRIi64, vid->pending_ts_count,
+		    min->pts, min->dts, min->duration);
+	}
+
+	if (pts == TIMESTAMP_NONE) {
+		dbg("no pts on frame");
+		if (min && vid->pts_dts_delta != TIMESTAMP_NONE) {
+			dbg("reuse dts %" PRIu64
+			    " delta %" PRIu64,
+			    min->dts, vid->pts_dts_delta);
+			pts = min->dts + vid->pts_dts_delta;
 		}
+	}
 
-		if (pts == TIMESTAMP_NONE) {
-			if (min && vid->cap_last_pts != TIMESTAMP_NONE)
-				pts = vid->cap_last_pts + min->duration;
-			else
-				pts = 0;
+	if (pts == TIMESTAMP_NONE) {
+		if (min && vid->cap_last_pts != TIMESTAMP_NONE)
+			pts = vid->cap_last_pts + min->duration;
+		else
+			pts = 0;
+
+		dbg("guessing pts %" PRIu64, pts);
+	}
+
+	vid->cap_last_pts = pts;
 
-			dbg("guessing pts %" PRIu64, pts);
+	if (min != NULL) {
+		/* the oldest pending packet measures how long a
+		 * frame stays in the decoder pipeline */
+		if (i->bench)
+			bench_add_latency(vid, vid->last_captured -
+					  min->queued);
+		pts -= min->base;
+		ts_remove_min(vid);
+	}
+
+	pthread_mutex_unlock(&i->lock);
+
+	if (i->window) {
+		struct fb *fb = get_fb(i, n);
+		if (!fb) {
+			err("could not get framebuffer for "
+			    "video buffer %d", n);
+			return -1;
 		}
 
-		vid->cap_last_pts = pts;
+		info("show buffer pts=%" PRIu64, pts);
+
+		fb_apply_extradata(fb, extradata);
 
-		if (min != NULL) {
-			pts -= min->base;
-			ts_remove(min);
+		/* without crop extradata, show the current
+		 * rendition out of the larger adaptive playback
+		 * buffer */
+		if (i->max_width && !fb->crop_w) {
+			fb->crop_w = MIN(i->width, fb->width);
+			fb->crop_h = MIN(i->height, fb->height);
 		}
+		sched_queue(i->sched, fb, pts);
+		update_visibility(i);
+		update_catch_up(i);
+		busy = 1;
+	}
 
-		pthread_mutex_unlock(&i->lock);
+	i->prerolled = 1;
 
-		if (i->window) {
-			struct fb *fb = get_fb(i, n);
-			if (!fb) {
-				err("could not get framebuffer for "
-				    "video buffer %d", n);
-				return -1;
-			}
+	return busy;
+}
 
-			info("show buffer pts=%" PRIu64, pts);
+/* Show the frames a stateless decoder outputs, in presentation order,
+ * and queue again the CAPTURE buffers it no longer holds */
+static int
+stateless_show(struct instance *i, struct stateless_output *out)
+{
+	struct video *vid = &i->video;
 
-			fb_apply_extradata(fb, extradata);
-			window_show_buffer(i->window, fb,
-					   buffer_released, i);
-			busy = true;
-		}
+	for (int k = 0; k < out->show_count; k++) {
+		uint64_t pts = out->show_pts[k];
+
+		if (atomic_load(&vid->dts_timestamps))
+			pts = TIMESTAMP_NONE;
+
+		if (show_frame(i, out->show[k], pts, NULL) < 0)
+			return -1;
+	}
+
+	/* unless they are still on screen */
+	for (int k = 0; k < out->release_count; k++) {
+		if (!capture_buf_busy(i, out->release[k]))
+			video_queue_buf_cap(i, out->release[k]);
+	}
+
+	return 0;
+}
+
+/* Every frame queued to a stateless decoder was decoded */
+static void
+stateless_finish(struct instance *i)
+{
+	struct stateless_output out;
+
+	stateless_flush(i, &out);
+	stateless_show(i, &out);
+
+	info("End of stream");
+	finish(i);
+}
+
+static int
+handle_video_capture(struct instance *i)
+{
+	struct video *vid = &i->video;
+	struct timeval tv;
+	uint32_t flags;
+	uint64_t pts;
+	unsigned int bytesused;
+	struct msm_vidc_extradata_header *extradata;
+	int busy = 0;
+	int ret, n;
 
-		i->prerolled = 1;
+	/* capture buffer is ready */
 
+	ret = video_dequeue_capture(i, &n, &bytesused, &flags, &tv, &extradata);
+	if (ret == -EPIPE) {
+		/* the decoder already returned its last buffer */
+		finish(i);
+		return 0;
+	}
+	if (ret < 0) {
+		if (ret != -EAGAIN)
+			err("dequeue capture buffer fail");
+		return ret;
 	}
 
-	if (!busy && !i->reconfigure_pending)
+	if (vid->msm && (flags & V4L2_QCOM_BUF_TIMESTAMP_INVALID))
+		pts = TIMESTAMP_NONE;
+	else if (atomic_load(&vid->dts_timestamps))
+		pts = TIMESTAMP_NONE;
+	else
+		pts = ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+
+	if (vid->stateless) {
+		struct stateless_output out;
+
+		/* frames come out of the decoder in decoding order,
+		 * the backend tells which to show */
+		stateless_capture_done(i, n, tv, &out);
+		if (stateless_show(i, &out) < 0)
+			return -1;
+	} else if (bytesused > 0) {
+		busy = show_frame(i, n, pts, extradata);
+		if (busy < 0)
+			return -1;
+	}
+
+	/* standard decoders need CAPTURE buffers to drain before a
+	 * reconfiguration, MSM flushes them instead; stateless buffers
+	 * are queued again above */
+	if (!busy && !vid->stateless &&
+	    (!i->reconfigure_pending || !vid->msm))
 		video_queue_buf_cap(i, n);
 
-	if (flags & V4L2_QCOM_BUF_FLAG_EOS) {
+	if (vid->msm && (flags & V4L2_QCOM_BUF_FLAG_EOS)) {
 		info("End of stream");
 		finish(i);
 	}
 
+	if (!vid->msm && (flags & V4L2_BUF_FLAG_LAST)) {
+		if (i->reconfigure_pending) {
+			dbg("Reconfiguring capture");
+			restart_capture(i);
+		} else {
+			info("End of stream");
+			finish(i);
+		}
+	}
+
+	if (vid->stateless && stateless_drained(i))
+		stateless_finish(i);
+
 	return 0;
 }
 
@@ -885,40 +1709,92 @@ handle_video_output(struct instance *i)
 
 	ret = video_dequeue_output(i, &n);
 	if (ret < 0) {
-		err("dequeue output buffer fail");
+		if (ret != -EAGAIN)
+			err("dequeue output buffer fail");
 		return ret;
 	}
 
-	pthread_mutex_lock(&i->lock);
-	vid->out_buf_flag[n] = 0;
-	pthread_cond_signal(&i->cond);
-	pthread_mutex_unlock(&i->lock);
+	if (vid->stateless)
+		stateless_output_done(i, n);
+
+	put_buffer(i, n);
 
 	return 0;
 }
 
+static void
+handle_wakeup(struct loop_source *src, uint32_t events, void *data)
+{
+	struct instance *i = data;
+	uint64_t val;
+
+	if (read(i->main_evfd, &val, sizeof (val)) < 0)
+		return;
+
+	if (i->reconfig.running && atomic_load(&i->reconfig.done) &&
+	    restart_capture_done(i))
+		finish(i);
+
+	if (i->video.stateless && stateless_drained(i))
+		stateless_finish(i);
+}
+
+static void
+player_cleanup(struct player *p)
+{
+	if (p->mosaic)
+		window_destroy(p->mosaic);
+	if (p->display)
+		display_destroy(p->display);
+	if (p->sigfd != -1)
+		close(p->sigfd);
+	if (p->loop)
+		loop_destroy(p->loop);
+	free(p->instances);
+}
+
+static void
+finish_all(struct player *p)
+{
+	for (int n = 0; n < p->count; n++)
+		finish(&p->instances[n]);
+}
+
 static int
-handle_signal(struct instance *i)
+player_running(struct player *p)
+{
+	for (int n = 0; n < p->count; n++) {
+		if (!p->instances[n].finish)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+handle_signal(struct loop_source *src, uint32_t events, void *data)
 {
+	struct player *p = data;
 	struct signalfd_siginfo siginfo;
 	sigset_t sigmask;
+	ssize_t ret;
 
-	if (read(i->sigfd, &siginfo, sizeof (siginfo)) < 0) {
-		perror("signalfd/read");
-		return -1;
-	}
+	/* edge-triggered, read all the pending signals */
+	while ((ret = read(p->sigfd, &siginfo, sizeof (siginfo))) ==
+	       sizeof (siginfo)) {
+		sigemptyset(&sigmask);
+		sigaddset(&sigmask, siginfo.ssi_signo);
+		sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
 
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, siginfo.ssi_signo);
-	sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
-
-	finish(i);
+		finish_all(p);
+	}
 
-	return 0;
+	if (ret < 0 && errno != EAGAIN)
+		perror("signalfd/read");
 }
 
 static int
-setup_signal(struct instance *i)
+setup_signal(struct player *p)
 {
 	sigset_t sigmask;
 	int fd;
@@ -927,115 +1803,193 @@ setup_signal(struct instance *i)
 	sigaddset(&sigmask, SIGINT);
 	sigaddset(&sigmask, SIGTERM);
 
-	fd = signalfd(-1, &sigmask, SFD_CLOEXEC);
-	if (fd < 0) {
-		perror("signalfd");
-		return -1;
+	fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		perror("signalfd");
+		return -1;
+	}
+
+	sigprocmask(SIG_BLOCK, &sigmask, NULL);
+	p->sigfd = fd;
+
+	return 0;
+}
+
+static int
+kbd_init(struct player *p)
+{
+	struct termios newt;
+
+	if (tcgetattr(STDIN_FILENO, &p->stdin_termios) < 0)
+		return -1;
+
+	newt = p->stdin_termios;
+	newt.c_lflag &= ~ICANON;
+	newt.c_lflag &= ~ECHO;
+
+	if (tcsetattr(STDIN_FILENO, TCSANOW, &newt) < 0)
+		return -1;
+
+	p->stdin_valid = 1;
+
+	return STDIN_FILENO;
+}
+
+static void
+kbd_handle_key(struct loop_source *src, uint32_t events, void *data)
+{
+	struct player *p = data;
+	uint8_t key[3];
+	int ret;
+
+	ret = read(STDIN_FILENO, key, 3);
+	if (ret <= 0)
+		return;
+
+	/* the terminal is shared, step all the streams */
+	if (key[0] == 's') {
+		info("Frame Step");
+		for (int n = 0; n < p->count; n++)
+			p->instances[n].prerolled = 0;
+	}
+}
+
+static void
+kbd_shutdown(struct player *p)
+{
+	if (p->stdin_valid)
+		tcsetattr(STDIN_FILENO, TCSANOW, &p->stdin_termios);
+}
+
+/*
+ * The V4L2 fd is edge-triggered: every ready buffer and event is handled
+ * before waiting again, and the parser thread is woken up once for all
+ * the OUTPUT buffers.
+ */
+static void
+handle_video_fd(struct loop_source *src, uint32_t events, void *data)
+{
+	struct instance *i = data;
+	struct video *vid = &i->video;
+	int n;
+
+	if (events & EPOLLPRI) {
+		while (handle_video_event(i) == 0)
+			;
 	}
 
-	sigprocmask(SIG_BLOCK, &sigmask, NULL);
-	i->sigfd = fd;
-
-	return 0;
-}
+	if (events & EPOLLIN) {
+		/* stop early when paused or reconfiguring, the fd is
+		 * watched for CAPTURE buffers again afterwards, which
+		 * reports those left */
+		for (n = 0; !i->finish && !(i->paused && i->prerolled) &&
+			     !i->reconfig.running; n++) {
+			if (handle_video_capture(i) < 0)
+				break;
+		}
 
-enum {
-	EV_VIDEO,
-	EV_DISPLAY,
-	EV_STDIN,
-	EV_SIGNAL,
-	EV_COUNT
-};
+		vid->cap_wakeups++;
+		vid->cap_dequeues += n;
+	}
 
-static int
-kbd_init(struct instance *i)
-{
-	struct termios newt;
+	if (events & EPOLLOUT) {
+		for (n = 0; handle_video_output(i) == 0; n++)
+			;
 
-	if (tcgetattr(STDIN_FILENO, &i->stdin_termios) < 0)
-		return -1;
+		put_buffers_done(i);
 
-	newt = i->stdin_termios;
-	newt.c_lflag &= ~ICANON;
-	newt.c_lflag &= ~ECHO;
+		vid->out_wakeups++;
+		vid->out_dequeues += n;
+	}
+}
 
-	if (tcsetattr(STDIN_FILENO, TCSANOW, &newt) < 0)
-		return -1;
+static void
+handle_display_fd(struct loop_source *src, uint32_t events, void *data)
+{
+	/* incoming events are read by main_loop() before the other sources
+	 * are dispatched, only stop waiting for the socket to be writable */
+	if (events & EPOLLOUT)
+		loop_update_fd(src, EPOLLIN);
+}
 
-	i->stdin_valid = 1;
+static void
+stream_remove_sources(struct instance *i)
+{
+	if (i->wakeup_src) {
+		loop_remove(i->wakeup_src);
+		i->wakeup_src = NULL;
+	}
 
-	return STDIN_FILENO;
+	if (i->video_src) {
+		loop_remove(i->video_src);
+		i->video_src = NULL;
+	}
 }
 
 static int
-kbd_handle_key(struct instance *i)
+stream_add_sources(struct instance *i)
 {
-	uint8_t key[3];
-	int ret;
-
-	ret = read(STDIN_FILENO, key, 3);
-	if (ret < 0)
+	i->video_src = loop_add_fd(i->loop, i->video.fd,
+				   EPOLLOUT | EPOLLPRI | EPOLLET,
+				   handle_video_fd, i);
+	if (!i->video_src)
 		return -1;
 
-	if (key[0] == 's') {
-		info("Frame Step");
-		i->prerolled = 0;
+	i->wakeup_src = loop_add_fd(i->loop, i->main_evfd, EPOLLIN | EPOLLET,
+				    handle_wakeup, i);
+	if (!i->wakeup_src) {
+		stream_remove_sources(i);
+		return -1;
 	}
 
 	return 0;
 }
 
-static void
-kbd_shutdown(struct instance *i)
-{
-	if (i->stdin_valid)
-		tcsetattr(STDIN_FILENO, TCSANOW, &i->stdin_termios);
-}
-
-void main_loop(struct instance *i)
+/*
+ * A single thread services all the streams: their V4L2 fds and wakeups
+ * are watched along with the compositor socket, stdin and the signals,
+ * until every stream has finished.
+ */
+void main_loop(struct player *p)
 {
-	struct video *vid = &i->video;
 	struct wl_display *wl_display = NULL;
-	struct pollfd pfd[EV_COUNT];
-	int ev[EV_COUNT];
-	short revents;
-	int nfds = 0;
-	int ret;
+	struct loop_source *display_src = NULL;
+	struct loop_source *stdin_src = NULL;
+	struct loop_source *signal_src = NULL;
+	struct instance *i;
+	uint32_t video_events;
+	int ret, n;
 
 	dbg("main thread started");
 
-	for (int i = 0; i < EV_COUNT; i++)
-		ev[i] = -1;
-
-	memset(pfd, 0, sizeof (pfd));
-
-	pfd[nfds].fd = vid->fd;
-	pfd[nfds].events = POLLOUT | POLLWRNORM | POLLPRI;
-	ev[EV_VIDEO] = nfds++;
-
-	if (i->display) {
-		wl_display = display_get_wl_display(i->display);
-		pfd[nfds].fd = wl_display_get_fd(wl_display);
-		pfd[nfds].events = POLLIN;
-		ev[EV_DISPLAY] = nfds++;
+	for (n = 0; n < p->count; n++) {
+		i = &p->instances[n];
+		if (stream_add_sources(i))
+			finish(i);
 	}
 
-	ret = kbd_init(i);
-	if (ret >= 0) {
-		pfd[nfds].fd = ret;
-		pfd[nfds].events = POLLIN;
-		ev[EV_STDIN] = nfds++;
+	/* libwayland reads a bounded amount of data at a time, so the
+	 * socket is level-triggered */
+	if (p->display) {
+		wl_display = display_get_wl_display(p->display);
+		display_src = loop_add_fd(p->loop, wl_display_get_fd(wl_display),
+					  EPOLLIN, handle_display_fd, p);
 	}
 
-	if (i->sigfd != -1) {
-		pfd[nfds].fd = i->sigfd;
-		pfd[nfds].events = POLLIN;
-		ev[EV_SIGNAL] = nfds++;
-	}
+	/* so is stdin, which cannot be made non-blocking without affecting
+	 * the shell sharing the terminal */
+	ret = kbd_init(p);
+	if (ret >= 0)
+		stdin_src = loop_add_fd(p->loop, ret, EPOLLIN,
+					kbd_handle_key, p);
 
-	while (!i->finish) {
-		if (i->display) {
-			if (!display_is_running(i->display))
+	if (p->sigfd != -1)
+		signal_src = loop_add_fd(p->loop, p->sigfd, EPOLLIN | EPOLLET,
+					 handle_signal, p);
+
+	while (player_running(p)) {
+		if (p->display) {
+			if (!display_is_running(p->display))
 				break;
 
 			while (wl_display_prepare_read(wl_display) != 0)
@@ -1044,7 +1998,8 @@ void main_loop(struct instance *i)
 			ret = wl_display_flush(wl_display);
 			if (ret < 0) {
 				if (errno == EAGAIN)
-					pfd[ev[EV_DISPLAY]].events |= POLLOUT;
+					loop_update_fd(display_src,
+						       EPOLLIN | EPOLLOUT);
 				else if (errno != EPIPE) {
 					err("wl_display_flush: %m");
 					wl_display_cancel_read(wl_display);
@@ -1053,18 +2008,36 @@ void main_loop(struct instance *i)
 			}
 		}
 
-		if (i->paused && i->prerolled)
-			pfd[ev[EV_VIDEO]].events &= ~(POLLIN | POLLRDNORM);
-		else
-			pfd[ev[EV_VIDEO]].events |= POLLIN | POLLRDNORM;
+		for (n = 0; n < p->count; n++) {
+			i = &p->instances[n];
+
+			/* the others keep playing, with the last frame of
+			 * this one on screen */
+			if (i->finish) {
+				if (i->video_src && i->sched)
+					sched_flush(i->sched);
+				stream_remove_sources(i);
+				continue;
+			}
+
+			/* no CAPTURE buffers while paused or being
+			 * replaced */
+			video_events = EPOLLOUT | EPOLLPRI | EPOLLET;
+			if (!(i->paused && i->prerolled) && !i->reconfig.running)
+				video_events |= EPOLLIN;
+			loop_update_fd(i->video_src, video_events);
+		}
 
-		ret = poll(pfd, nfds, -1);
-		if (ret <= 0) {
-			err("poll error");
+		ret = loop_wait(p->loop, -1);
+		if (ret < 0) {
+			if (p->display)
+				wl_display_cancel_read(wl_display);
 			break;
 		}
 
-		if (i->display) {
+		/* read the compositor events first, handlers may wait for
+		 * some on a private queue */
+		if (p->display) {
 			ret = wl_display_read_events(wl_display);
 			if (ret < 0) {
 				err("wl_display_read_events: %m");
@@ -1078,48 +2051,29 @@ void main_loop(struct instance *i)
 			}
 		}
 
-		for (int idx = 0; idx < nfds; idx++) {
-			revents = pfd[idx].revents;
-			if (!revents)
-				continue;
-
-			if (idx == ev[EV_VIDEO]) {
-				if (revents & (POLLIN | POLLRDNORM))
-					handle_video_capture(i);
-				if (revents & (POLLOUT | POLLWRNORM))
-					handle_video_output(i);
-				if (revents & POLLPRI)
-					handle_video_event(i);
-
-			} else if (idx == ev[EV_DISPLAY]) {
-				if (revents & POLLOUT)
-					pfd[ev[EV_DISPLAY]].events &= ~POLLOUT;
+		loop_dispatch(p->loop);
+	}
 
-			} else if (idx == ev[EV_STDIN]) {
-				kbd_handle_key(i);
-				break;
+	/* when leaving on an error, stop the streams still playing */
+	finish_all(p);
 
-			} else if (idx == ev[EV_SIGNAL]) {
-				handle_signal(i);
-				break;
-			}
-		}
-	}
+	for (n = 0; n < p->count; n++)
+		stream_remove_sources(&p->instances[n]);
+	if (signal_src)
+		loop_remove(signal_src);
+	if (stdin_src)
+		loop_remove(stdin_src);
+	if (display_src)
+		loop_remove(display_src);
 
-	kbd_shutdown(i);
+	kbd_shutdown(p);
 
 	dbg("main thread finished");
 }
 
 static void
-handle_window_key(struct window *window, uint32_t time, uint32_t key,
-		  enum wl_keyboard_key_state state)
+stream_handle_key(struct instance *i, uint32_t key)
 {
-	struct instance *i = window_get_user_data(window);
-
-	if (state != WL_KEYBOARD_KEY_STATE_PRESSED)
-		return;
-
 	switch (key) {
 	case KEY_ESC:
 		finish(i);
@@ -1128,6 +2082,8 @@ handle_window_key(struct window *window, uint32_t time, uint32_t key,
 	case KEY_SPACE:
 		info("%s", i->paused ? "Resume" : "Pause");
 		i->paused = !i->paused;
+		if (!i->avctx)
+			break;
 		if (i->paused)
 			av_read_pause(i->avctx);
 		else
@@ -1146,24 +2102,78 @@ handle_window_key(struct window *window, uint32_t time, uint32_t key,
 	}
 }
 
+static void
+handle_window_key(struct window *window, uint32_t time, uint32_t key,
+		  enum wl_keyboard_key_state state)
+{
+	struct instance *i = window_get_user_data(window);
+
+	if (state != WL_KEYBOARD_KEY_STATE_PRESSED)
+		return;
+
+	stream_handle_key(i, key);
+}
+
+/* The tiles cannot have the keyboard focus, the keys of the mosaic apply
+ * to all the streams */
+static void
+handle_mosaic_key(struct window *window, uint32_t time, uint32_t key,
+		  enum wl_keyboard_key_state state)
+{
+	struct player *p = window_get_user_data(window);
+
+	if (state != WL_KEYBOARD_KEY_STATE_PRESSED)
+		return;
+
+	if (key == KEY_F) {
+		window_toggle_fullscreen(window);
+		return;
+	}
+
+	for (int n = 0; n < p->count; n++)
+		stream_handle_key(&p->instances[n], key);
+}
+
+static int
+setup_mosaic(struct player *p, int fullscreen)
+{
+	p->mosaic = display_create_mosaic(p->display);
+	if (!p->mosaic)
+		return -1;
+
+	window_set_user_data(p->mosaic, p);
+	window_set_key_callback(p->mosaic, handle_mosaic_key);
+
+	if (fullscreen)
+		window_toggle_fullscreen(p->mosaic);
+
+	return 0;
+}
+
 static int
-setup_display(struct instance *i)
+setup_window(struct instance *i)
 {
 	AVRational ar;
 
-	i->display = display_create();
-	if (!i->display)
+	if (i->player->mosaic)
+		i->window = window_create_tile(i->player->mosaic);
+	else
+		i->window = display_create_window(i->display);
+	if (!i->window)
 		return -1;
 
-	i->window = display_create_window(i->display);
-	if (!i->window)
+	i->sched = sched_create(i->loop, i->window, present_frame,
+				buffer_released, i);
+	if (!i->sched)
 		return -1;
 
 	window_set_user_data(i->window, i);
 	window_set_key_callback(i->window, handle_window_key);
 
-	ar = av_guess_sample_aspect_ratio(i->avctx, i->stream, NULL);
-	window_set_aspect_ratio(i->window, ar.num, ar.den);
+	if (i->stream) {
+		ar = av_guess_sample_aspect_ratio(i->avctx, i->stream, NULL);
+		window_set_aspect_ratio(i->window, ar.num, ar.den);
+	}
 
 	if (i->fullscreen)
 		window_toggle_fullscreen(i->window);
@@ -1174,9 +2184,13 @@ setup_display(struct instance *i)
 static void
 stream_close(struct instance *i)
 {
+	if (i->reader) {
+		reader_close(i->reader);
+		i->reader = NULL;
+	}
+
 	i->stream = NULL;
-	if (i->bsf)
-		av_bsf_free(&i->bsf);
+	annexb_free(&i->annexb);
 	if (i->avctx)
 		avformat_close_input(&i->avctx);
 }
@@ -1200,12 +2214,21 @@ get_av_log_level(void)
 static int
 stream_open(struct instance *i)
 {
-	const AVBitStreamFilter *filter;
 	AVCodecParameters *codecpar;
 	AVRational framerate;
 	int codec;
 	int ret;
 
+	i->reader = reader_open(i->url);
+	if (i->reader) {
+		i->fourcc = i->reader->fourcc;
+		i->width = i->reader->width ?: 320;
+		i->height = i->reader->height ?: 240;
+		i->fps_n = i->reader->fps_n;
+		i->fps_d = i->reader->fps_d;
+		return 0;
+	}
+
 	av_log_set_level(get_av_log_level());
 
 	av_register_all();
@@ -1243,19 +2266,15 @@ stream_open(struct instance *i)
 	i->fps_n = framerate.num;
 	i->fps_d = framerate.den;
 
-	filter = NULL;
-
 	switch (codecpar->codec_id) {
 	case AV_CODEC_ID_H263:
 		codec = V4L2_PIX_FMT_H263;
 		break;
 	case AV_CODEC_ID_H264:
 		codec = V4L2_PIX_FMT_H264;
-		filter = av_bsf_get_by_name("h264_mp4toannexb");
 		break;
 	case AV_CODEC_ID_HEVC:
 		codec = V4L2_PIX_FMT_HEVC;
-		filter = av_bsf_get_by_name("hevc_mp4toannexb");
 		break;
 	case AV_CODEC_ID_MPEG2VIDEO:
 		codec = V4L2_PIX_FMT_MPEG2;
@@ -1285,21 +2304,14 @@ stream_open(struct instance *i)
 
 	i->fourcc = codec;
 
-	if (filter) {
-		ret = av_bsf_alloc(filter, &i->bsf);
-		if (ret < 0) {
-			av_err(ret, "cannot allocate bistream filter");
-			goto fail;
-		}
-
-		avcodec_parameters_copy(i->bsf->par_in, codecpar);
-		i->bsf->time_base_in = i->stream->time_base;
-
-		ret = av_bsf_init(i->bsf);
-		if (ret < 0) {
-			av_err(ret, "failed to initialize bitstream filter");
+	if (codecpar->codec_id == AV_CODEC_ID_H264 ||
+	    codecpar->codec_id == AV_CODEC_ID_HEVC) {
+		ret = annexb_init(&i->annexb,
+				  codecpar->codec_id == AV_CODEC_ID_HEVC,
+				  codecpar->extradata,
+				  codecpar->extradata_size);
+		if (ret < 0)
 			goto fail;
-		}
 	}
 
 	return 0;
@@ -1309,96 +2321,350 @@ fail:
 	return -1;
 }
 
-int main(int argc, char **argv)
+static void
+admit_stream(struct instance *i)
+{
+	uint64_t load, iframe_load;
+	int downgraded;
+
+	load = device_stream_load(i->width, i->height, i->fps_n, i->fps_d);
+	iframe_load = device_iframe_load(load);
+
+	/* already decoding the I-frames only, nothing to downgrade */
+	if (i->skip_frames) {
+		load = iframe_load;
+		iframe_load = 0;
+	}
+
+	i->device = device_admit(&i->player->devices, i->fourcc, load,
+				 iframe_load, &downgraded);
+	if (!i->device) {
+		info("Rejected %s, no decoder capacity left", i->url);
+		return;
+	}
+
+	if (downgraded) {
+		load = iframe_load;
+		i->skip_frames = 1;
+	}
+
+	i->load = load;
+	i->video.name = i->device->path;
+
+	info("Decoding %s on %s%s, %" PRIu64 " of %" PRIu64 " MB/s used",
+	     i->url, i->video.name, downgraded ? " I-frames only" : "",
+	     i->device->load, i->device->capacity);
+}
+
+/*
+ * Streams are admitted by decreasing priority, in the order they were
+ * given for the same priority; those rejected are closed and dropped.
+ */
+static void
+admit_streams(struct player *p)
+{
+	struct instance **order;
+	struct instance *i;
+	int count, n, k;
+
+	order = calloc(p->count, sizeof (*order));
+	if (!order)
+		return;
+
+	for (n = 0; n < p->count; n++) {
+		i = &p->instances[n];
+		for (k = n; k > 0 && order[k - 1]->priority < i->priority; k--)
+			order[k] = order[k - 1];
+		order[k] = i;
+	}
+
+	for (n = 0; n < p->count; n++)
+		admit_stream(order[n]);
+
+	free(order);
+
+	for (n = 0, count = 0; n < p->count; n++) {
+		i = &p->instances[n];
+		if (!i->device) {
+			stream_close(i);
+			continue;
+		}
+
+		if (count != n)
+			p->instances[count] = *i;
+		count++;
+	}
+
+	p->count = count;
+}
+
+static int
+stream_start(struct instance *i)
 {
-	struct instance inst;
-	pthread_t parser_thread;
 	int ret;
 
-	ret = parse_args(&inst, argc, argv);
-	if (ret) {
-		print_usage(argv[0]);
-		return 1;
+	pthread_mutex_init(&i->lock, 0);
+
+	i->main_evfd = -1;
+	i->parser_evfd = eventfd(0, EFD_CLOEXEC);
+	if (i->parser_evfd < 0) {
+		err("failed to create eventfd: %m");
+		return -1;
 	}
 
-	inst.sigfd = -1;
-	pthread_mutex_init(&inst.lock, 0);
-	pthread_cond_init(&inst.cond, 0);
+	i->main_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (i->main_evfd < 0) {
+		err("failed to create eventfd: %m");
+		return -1;
+	}
 
-	INIT_LIST_HEAD(&inst.video.pending_ts_list);
-	INIT_LIST_HEAD(&inst.fb_list);
-	inst.video.pts_dts_delta = TIMESTAMP_NONE;
-	inst.video.cap_last_pts = TIMESTAMP_NONE;
-	inst.video.extradata_index = -1;
-	inst.video.extradata_size = 0;
-	inst.video.extradata_ion_fd = -1;
+	INIT_LIST_HEAD(&i->retired_fbs);
+	i->video.pts_dts_delta = TIMESTAMP_NONE;
+	i->video.cap_last_pts = TIMESTAMP_NONE;
+	i->video.extradata_index = -1;
+	i->video.extradata_size = 0;
+	i->video.extradata_ion_fd = -1;
+	i->video.out_ion_fd = -1;
 
-	ret = stream_open(&inst);
+	ret = ts_init(&i->video);
 	if (ret)
-		goto err;
+		return ret;
 
-	ret = video_open(&inst, inst.video.name);
+	ret = video_open(i, i->video.name);
 	if (ret)
-		goto err;
+		return ret;
 
-	ret = subscribe_events(&inst);
-	if (ret)
-		goto err;
+	ret = stateless_open(i);
+	if (ret < 0)
+		return ret;
 
-	if (inst.secure) {
-		ret = video_set_secure(&inst);
+	/* stateless decoders do not send events */
+	if (!i->video.stateless) {
+		ret = subscribe_events(i);
 		if (ret)
-			goto err;
+			return ret;
 	}
 
-	ret = video_setup_output(&inst, inst.fourcc,
-				 STREAM_BUUFER_SIZE, 6);
-	if (ret)
-		goto err;
+	if (i->secure) {
+		ret = video_set_secure(i);
+		if (ret)
+			return ret;
+	}
 
-	ret = setup_display(&inst);
+	ret = video_setup_output(i, i->fourcc, STREAM_BUUFER_SIZE, 6);
 	if (ret)
-		err("display server not available, continuing anyway...");
+		return ret;
+
+	if (i->video.stateless) {
+		ret = stateless_setup(i);
+		if (ret)
+			return ret;
+	}
+
+	if (i->display) {
+		ret = setup_window(i);
+		if (ret)
+			err("cannot create window, continuing anyway...");
+	}
 
-	ret = video_set_control(&inst);
+	ret = video_set_control(i);
 	if (ret)
-		goto err;
+		return ret;
 
-	ret = video_stream(&inst, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+	ret = video_stream(i, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
 			   VIDIOC_STREAMON);
 	if (ret)
-		goto err;
+		return ret;
 
-	ret = restart_capture(&inst);
-	if (ret)
+	return restart_capture(i);
+}
+
+static void
+print_stats(struct instance *i)
+{
+	info("Total frames captured %ld", i->video.total_captured);
+
+	if (i->video.cap_wakeups && i->video.out_wakeups)
+		info("Dequeues per wakeup: capture %.2f, output %.2f",
+		     (double)i->video.cap_dequeues / i->video.cap_wakeups,
+		     (double)i->video.out_dequeues / i->video.out_wakeups);
+
+	if (i->reconfig.count)
+		info("Capture reconfigurations %u, average %.1f ms, "
+		     "max %.1f ms", i->reconfig.count,
+		     i->reconfig.total_time / 1000.0 / i->reconfig.count,
+		     i->reconfig.max_time / 1000.0);
+
+	if (i->sched) {
+		unsigned long presented, dropped;
+
+		sched_get_stats(i->sched, &presented, &dropped);
+		info("Frames due %lu, dropped late %lu", presented, dropped);
+	}
+
+	if (i->window) {
+		struct window_stats ws;
+
+		window_get_stats(i->window, &ws);
+		info("Frames committed %lu, superseded %lu", ws.committed,
+		     ws.superseded);
+
+		if (ws.presented > 1 && ws.last_presented > ws.first_presented)
+			info("Frames shown %lu, discarded %lu, cadence %.2f fps",
+			     ws.presented, ws.discarded,
+			     (ws.presented - 1) * 1000000.0 /
+			     (ws.last_presented - ws.first_presented));
+	}
+
+	if (i->dropped_packets)
+		info("Non-reference frames not decoded %lu",
+		     i->dropped_packets);
+
+	if (i->bench)
+		bench_print_stats(i);
+}
+
+int main(int argc, char **argv)
+{
+	struct instance opts;
+	struct player player;
+	struct instance *i;
+	int started;
+	int ret, n;
+
+	ret = parse_args(&opts, argc, argv);
+	if (ret) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	memzero(player);
+	player.sigfd = -1;
+
+	/* spread the streams over several decoders, or check that they fit
+	 * on the one given */
+	if (opts.device_name_count > 1 ||
+	    (opts.device_name_count == 1 &&
+	     !strcmp(opts.device_names[0], "auto"))) {
+		ret = device_probe(&player.devices, opts.device_names,
+				   opts.device_name_count);
+		if (ret <= 0)
+			return 1;
+	} else if (device_probe(&player.devices, &opts.video.name, 1) <= 0) {
+		err("continuing without admission control");
+	}
+
+	player.instances = calloc(opts.url_count, sizeof (*player.instances));
+	if (!player.instances)
+		return 1;
+
+	player.loop = loop_create();
+	if (!player.loop)
 		goto err;
 
+	if (!opts.bench) {
+		player.display = display_create();
+		if (!player.display)
+			err("display server not available, continuing anyway...");
+	}
+
+	/* several streams are shown in a single window */
+	if (player.display && opts.url_count > 1 &&
+	    setup_mosaic(&player, opts.fullscreen))
+		err("cannot create mosaic, using a window per stream");
+
+	/* each stream has its own decoder, parser thread and window, on
+	 * the display and event loop of the process */
+	for (n = 0; n < opts.url_count; n++) {
+		i = &player.instances[n];
+		*i = opts;
+		i->url = opts.urls[n];
+		i->priority = opts.priorities ? opts.priorities[n] : 0;
+		i->loop = player.loop;
+		i->display = player.display;
+		i->player = &player;
+		i->parser_evfd = -1;
+		i->main_evfd = -1;
+		player.count++;
+
+		ret = stream_open(i);
+		if (ret)
+			goto err;
+	}
+
+	if (player.devices.count) {
+		admit_streams(&player);
+		if (!player.count)
+			goto err;
+	}
+
+	for (n = 0; n < player.count; n++) {
+		ret = stream_start(&player.instances[n]);
+		if (ret)
+			goto err;
+	}
+
 	dbg("Launching threads");
 
-	setup_signal(&inst);
+	setup_signal(&player);
 
-	if (pthread_create(&parser_thread, NULL, parser_thread_func, &inst))
-		goto err;
+	for (started = 0; started < player.count; started++) {
+		i = &player.instances[started];
+		if (pthread_create(&i->parser_thread, NULL,
+				   parser_thread_func, i))
+			break;
+	}
 
-	main_loop(&inst);
+	if (started == player.count)
+		main_loop(&player);
+	else
+		finish_all(&player);
+
+	for (n = 0; n < started; n++)
+		pthread_join(player.instances[n].parser_thread, 0);
+
+	if (started < player.count)
+		goto err;
 
-	pthread_join(parser_thread, 0);
+	for (n = 0; n < player.count; n++) {
+		i = &player.instances[n];
+		if (i->reconfig.running)
+			pthread_join(i->reconfig.thread, NULL);
+	}
 
 	dbg("Threads have finished");
 
-	video_stop_output(&inst);
-	video_stop_capture(&inst);
+	for (n = 0; n < player.count; n++) {
+		i = &player.instances[n];
+
+		video_stop_output(i);
+		video_stop_capture(i);
+
+		if (player.count > 1)
+			info("Stream %d: %s", n, i->url);
+
+		print_stats(i);
 
-	cleanup(&inst);
+		cleanup(i);
 
-	pthread_cond_destroy(&inst.cond);
-	pthread_mutex_destroy(&inst.lock);
+		pthread_mutex_destroy(&i->lock);
 
-	info("Total frames captured %ld", inst.video.total_captured);
+		free(i->video.latency);
+		free(i->video.pending_ts);
+	}
+
+	player_cleanup(&player);
+	free(opts.priorities);
 
 	return 0;
 err:
-	cleanup(&inst);
+	for (n = 0; n < player.count; n++) {
+		i = &player.instances[n];
+		if (i->reconfig.running)
+			pthread_join(i->reconfig.thread, NULL);
+		cleanup(i);
+	}
+	player_cleanup(&player);
+	free(opts.priorities);
 	return 1;
 }
-
@@ -0,0 +1,1119 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Native container readers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "common.h"
+#include "reader.h"
+
+#define DBG_TAG "  read"
+
+#ifndef V4L2_PIX_FMT_FWHT
+#define V4L2_PIX_FMT_FWHT	v4l2_fourcc('F', 'W', 'H', 'T')
+#endif
+
+/* Number of bytes read from the start of a file to probe its format */
+#define PROBE_SIZE	32
+
+struct reader_ops {
+	const char *name;
+	int (*probe)(const uint8_t *data, int size);
+	int (*open)(struct reader *r, const uint8_t *data, int size);
+	int (*read_frame)(struct reader *r, void *data, int size,
+			  struct reader_frame *frame);
+	void (*close)(struct reader *r);
+};
+
+static inline uint16_t
+rl16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static inline uint32_t
+rl32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t
+rb32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline uint64_t
+rl64(const uint8_t *p)
+{
+	return rl32(p) | (uint64_t)rl32(p + 4) << 32;
+}
+
+static inline uint16_t
+rb16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static inline uint64_t
+rb64(const uint8_t *p)
+{
+	return (uint64_t)rb32(p) << 32 | rb32(p + 4);
+}
+
+static int
+read_full(int fd, void *data, int size)
+{
+	int n = 0;
+
+	while (n < size) {
+		ssize_t ret = read(fd, (uint8_t *)data + n, size - n);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			break;
+		n += ret;
+	}
+
+	return n;
+}
+
+static int
+pread_full(int fd, void *data, int size, uint64_t offset)
+{
+	int n = 0;
+
+	while (n < size) {
+		ssize_t ret = pread(fd, (uint8_t *)data + n, size - n,
+				    offset + n);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			break;
+		n += ret;
+	}
+
+	return n;
+}
+
+/*
+ * IVF, as produced by libvpx: a 32 bytes file header followed by frames,
+ * each prefixed with a 12 bytes header holding its size and timestamp.
+ */
+#define IVF_FILE_HEADER_SIZE	32
+#define IVF_FRAME_HEADER_SIZE	12
+
+static int
+ivf_probe(const uint8_t *data, int size)
+{
+	return size >= IVF_FILE_HEADER_SIZE && !memcmp(data, "DKIF", 4);
+}
+
+static int
+ivf_open(struct reader *r, const uint8_t *data, int size)
+{
+	int header_size = rl16(data + 6);
+
+	if (!memcmp(data + 8, "VP80", 4)) {
+		r->fourcc = V4L2_PIX_FMT_VP8;
+	} else if (!memcmp(data + 8, "VP90", 4)) {
+		r->fourcc = V4L2_PIX_FMT_VP9;
+	} else {
+		dbg("unsupported IVF fourcc %.4s", data + 8);
+		return -1;
+	}
+
+	r->width = rl16(data + 12);
+	r->height = rl16(data + 14);
+	r->tb_den = rl32(data + 16);
+	r->tb_num = rl32(data + 20);
+
+	if (!r->tb_num || !r->tb_den) {
+		r->tb_num = 1;
+		r->tb_den = 30;
+	}
+
+	/* timestamps usually count frames */
+	r->fps_n = r->tb_den;
+	r->fps_d = r->tb_num;
+
+	if (header_size < IVF_FILE_HEADER_SIZE)
+		header_size = IVF_FILE_HEADER_SIZE;
+
+	if (lseek(r->fd, header_size, SEEK_SET) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+vp8_is_key_frame(const uint8_t *data, int size)
+{
+	return size > 0 && !(data[0] & 0x01);
+}
+
+static int
+vp9_is_key_frame(const uint8_t *data, int size)
+{
+	int profile, bit;
+
+	if (size < 1)
+		return 0;
+
+	/* frame_marker(2) profile_low_bit(1) profile_high_bit(1) */
+	profile = (data[0] >> 5 & 1) | (data[0] >> 4 & 1) << 1;
+	bit = 4;
+	if (profile == 3)
+		bit++;
+
+	/* show_existing_frame */
+	if (data[0] & (0x80 >> bit))
+		return 0;
+	bit++;
+
+	/* frame_type, 0 for key frames */
+	return !(data[bit / 8] & (0x80 >> (bit % 8)));
+}
+
+static int
+ivf_read_frame(struct reader *r, void *data, int size,
+	       struct reader_frame *frame)
+{
+	uint8_t hdr[IVF_FRAME_HEADER_SIZE];
+	uint32_t frame_size;
+	int ret;
+
+	ret = read_full(r->fd, hdr, sizeof (hdr));
+	if (ret < 0)
+		return ret;
+	if (ret < (int)sizeof (hdr)) {
+		if (ret > 0)
+			dbg("ignoring truncated IVF frame header");
+		return 0;
+	}
+
+	frame_size = rl32(hdr);
+	if (frame_size > (uint32_t)size) {
+		err("IVF frame too large (%u bytes, buffer is %d bytes)",
+		    frame_size, size);
+		return -ENOSPC;
+	}
+
+	ret = read_full(r->fd, data, frame_size);
+	if (ret < 0)
+		return ret;
+	if (ret < (int)frame_size) {
+		dbg("ignoring truncated IVF frame");
+		return 0;
+	}
+
+	frame->size = frame_size;
+	frame->pts = rl64(hdr + 4);
+	frame->dts = frame->pts;
+	frame->duration = 1;
+
+	if (r->fourcc == V4L2_PIX_FMT_VP8)
+		frame->key = vp8_is_key_frame(data, frame_size);
+	else
+		frame->key = vp9_is_key_frame(data, frame_size);
+
+	return 1;
+}
+
+static const struct reader_ops ivf_ops = {
+	.name = "ivf",
+	.probe = ivf_probe,
+	.open = ivf_open,
+	.read_frame = ivf_read_frame,
+};
+
+/*
+ * Raw FWHT, as produced by the vicodec encoder: a sequence of frames, each
+ * made of a 44 bytes header (struct fwht_cframe_hdr) followed by the
+ * compressed data. The decoder expects the whole frame, header included.
+ */
+#define FWHT_HEADER_SIZE	44
+#define FWHT_MAGIC1		0x4f4f4f4f
+#define FWHT_MAGIC2		0xffffffff
+#define FWHT_FL_I_FRAME		(1 << 10)
+
+static int
+fwht_probe(const uint8_t *data, int size)
+{
+	return size >= FWHT_HEADER_SIZE &&
+	       rl32(data) == FWHT_MAGIC1 && rl32(data + 4) == FWHT_MAGIC2;
+}
+
+static int
+fwht_open(struct reader *r, const uint8_t *data, int size)
+{
+	(void)size;
+
+	r->fourcc = V4L2_PIX_FMT_FWHT;
+	r->width = rb32(data + 12);
+	r->height = rb32(data + 16);
+
+	/* no timing information in the stream */
+	r->tb_num = 1;
+	r->tb_den = 30;
+	r->fps_n = 30;
+	r->fps_d = 1;
+
+	if (lseek(r->fd, 0, SEEK_SET) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+fwht_read_frame(struct reader *r, void *data, int size,
+		struct reader_frame *frame)
+{
+	uint8_t *hdr = frame->header ? frame->header : data;
+	uint8_t *payload = frame->header ? data : hdr + FWHT_HEADER_SIZE;
+	uint32_t frame_size;
+	int ret;
+
+	if (!frame->header) {
+		if (size < FWHT_HEADER_SIZE)
+			return -ENOSPC;
+		size -= FWHT_HEADER_SIZE;
+	}
+
+	ret = read_full(r->fd, hdr, FWHT_HEADER_SIZE);
+	if (ret < 0)
+		return ret;
+	if (ret < FWHT_HEADER_SIZE) {
+		if (ret > 0)
+			dbg("ignoring truncated FWHT frame header");
+		return 0;
+	}
+
+	if (!fwht_probe(hdr, FWHT_HEADER_SIZE)) {
+		err("bad FWHT frame header");
+		return -EINVAL;
+	}
+
+	frame_size = rb32(hdr + 40);
+	if (frame_size > (uint32_t)size) {
+		err("FWHT frame too large (%u bytes, buffer is %d bytes)",
+		    frame_size, size);
+		return -ENOSPC;
+	}
+
+	ret = read_full(r->fd, payload, frame_size);
+	if (ret < 0)
+		return ret;
+	if (ret < (int)frame_size) {
+		dbg("ignoring truncated FWHT frame");
+		return 0;
+	}
+
+	frame->size = frame_size;
+	if (!frame->header)
+		frame->size += FWHT_HEADER_SIZE;
+	frame->pts = r->frame_count++;
+	frame->dts = frame->pts;
+	frame->duration = 1;
+	frame->key = !!(rb32(hdr + 20) & FWHT_FL_I_FRAME);
+
+	return 1;
+}
+
+static const struct reader_ops fwht_ops = {
+	.name = "fwht",
+	.probe = fwht_probe,
+	.open = fwht_open,
+	.read_frame = fwht_read_frame,
+};
+
+/*
+ * MP4 and QuickTime files which are not fragmented: the sample tables of
+ * the first video track are loaded from the moov box, then each sample is
+ * read from its offset straight into the destination buffer. H.264 and
+ * HEVC samples are turned into Annex-B in place.
+ */
+
+/* largest moov box loaded, hours of samples */
+#define MP4_MAX_MOOV_SIZE	(64 << 20)
+
+/* size of a visual sample entry before its child boxes */
+#define MP4_VISUAL_ENTRY_SIZE	78
+
+struct mp4_sample {
+	uint64_t offset;
+	int64_t dts;
+	uint32_t size;
+	uint32_t duration;
+	int32_t cts;		/* composition time offset */
+	int key;
+};
+
+struct mp4 {
+	struct mp4_sample *samples;
+	uint32_t count;
+	uint32_t next;
+
+	/* length prefixed H.264 or HEVC */
+	int rewrite;
+	struct annexb annexb;
+};
+
+static int
+mp4_probe(const uint8_t *data, int size)
+{
+	return size >= 8 &&
+	       (!memcmp(data + 4, "ftyp", 4) || !memcmp(data + 4, "moov", 4));
+}
+
+/* Payload of the first box of the given type in data, or NULL */
+static const uint8_t *
+mp4_find_box(const uint8_t *data, uint32_t size, const char *type,
+	     uint32_t *box_size)
+{
+	uint32_t pos = 0;
+
+	while (size - pos >= 8) {
+		uint64_t len = rb32(data + pos);
+		uint32_t header = 8;
+
+		if (len == 1) {
+			if (size - pos < 16)
+				return NULL;
+			len = rb64(data + pos + 8);
+			header = 16;
+		} else if (len == 0) {
+			len = size - pos;
+		}
+
+		if (len < header || len > size - pos)
+			return NULL;
+
+		if (!memcmp(data + pos + 4, type, 4)) {
+			*box_size = len - header;
+			return data + pos + header;
+		}
+
+		pos += len;
+	}
+
+	return NULL;
+}
+
+/* Box at the end of a path of nested boxes, such as "minf/stbl" */
+static const uint8_t *
+mp4_find_path(const uint8_t *data, uint32_t size, const char *path,
+	      uint32_t *box_size)
+{
+	while (data) {
+		data = mp4_find_box(data, size, path, &size);
+		if (path[4] != '/')
+			break;
+		path += 5;
+	}
+
+	*box_size = size;
+
+	return data;
+}
+
+/* Entries of a table in a full box, once checked that they fit in it */
+static const uint8_t *
+mp4_table(const uint8_t *box, uint32_t size, uint32_t count_offset,
+	  uint32_t entry_size, uint32_t *count)
+{
+	*count = 0;
+
+	if (!box || size < count_offset + 4)
+		return NULL;
+
+	*count = rb32(box + count_offset);
+	if (entry_size && *count > (size - count_offset - 4) / entry_size)
+		return NULL;
+
+	return box + count_offset + 4;
+}
+
+static void
+mp4_free(struct mp4 *m)
+{
+	free(m->samples);
+	annexb_free(&m->annexb);
+	memset(m, 0, sizeof (*m));
+}
+
+/* Sample format and codec data from the first sample description */
+static int
+mp4_load_format(struct reader *r, struct mp4 *m, const uint8_t *stbl,
+		uint32_t stbl_size)
+{
+	const uint8_t *stsd, *entry, *config = NULL;
+	uint32_t size, entry_size, config_size = 0;
+	int hevc = 0;
+
+	stsd = mp4_find_box(stbl, stbl_size, "stsd", &size);
+	if (!stsd || size < 16)
+		return -1;
+
+	entry = stsd + 8;
+	entry_size = rb32(entry);
+	if (entry_size < 8 + MP4_VISUAL_ENTRY_SIZE || entry_size > size - 8)
+		return -1;
+
+	r->width = rb16(entry + 8 + 24);
+	r->height = rb16(entry + 8 + 26);
+
+	if (!memcmp(entry + 4, "avc1", 4) || !memcmp(entry + 4, "avc3", 4)) {
+		r->fourcc = V4L2_PIX_FMT_H264;
+		config = mp4_find_box(entry + 8 + MP4_VISUAL_ENTRY_SIZE,
+				      entry_size - 8 - MP4_VISUAL_ENTRY_SIZE,
+				      "avcC", &config_size);
+	} else if (!memcmp(entry + 4, "hvc1", 4) ||
+		   !memcmp(entry + 4, "hev1", 4)) {
+		r->fourcc = V4L2_PIX_FMT_HEVC;
+		config = mp4_find_box(entry + 8 + MP4_VISUAL_ENTRY_SIZE,
+				      entry_size - 8 - MP4_VISUAL_ENTRY_SIZE,
+				      "hvcC", &config_size);
+		hevc = 1;
+	} else if (!memcmp(entry + 4, "vp09", 4)) {
+		r->fourcc = V4L2_PIX_FMT_VP9;
+		return 0;
+	} else {
+		dbg("unsupported MP4 sample format %.4s", entry + 4);
+		return -1;
+	}
+
+	if (!config || annexb_init(&m->annexb, hevc, config, config_size) < 0)
+		return -1;
+
+	/* the other prefix sizes would need the payload to be moved */
+	if (m->annexb.length_size && m->annexb.length_size != 4) {
+		dbg("cannot rewrite %d bytes NAL lengths in place",
+		    m->annexb.length_size);
+		return -1;
+	}
+
+	m->rewrite = 1;
+
+	return 0;
+}
+
+static int
+mp4_load_samples(struct mp4 *m, const uint8_t *stbl, uint32_t stbl_size)
+{
+	const uint8_t *stsz, *stco, *stsc, *stts, *ctts, *stss, *box;
+	uint32_t size, count, chunks, stsc_count, stts_count, ctts_count;
+	uint32_t stss_count, sample_size, n;
+	int co64 = 0;
+	int64_t dts;
+
+	box = mp4_find_box(stbl, stbl_size, "stsz", &size);
+	if (!box || size < 12)
+		return -1;
+	sample_size = rb32(box + 4);
+	stsz = mp4_table(box, size, 8, sample_size ? 0 : 4, &count);
+
+	box = mp4_find_box(stbl, stbl_size, "stco", &size);
+	if (!box) {
+		box = mp4_find_box(stbl, stbl_size, "co64", &size);
+		co64 = 1;
+	}
+	stco = mp4_table(box, size, 4, co64 ? 8 : 4, &chunks);
+
+	box = mp4_find_box(stbl, stbl_size, "stsc", &size);
+	stsc = mp4_table(box, size, 4, 12, &stsc_count);
+
+	box = mp4_find_box(stbl, stbl_size, "stts", &size);
+	stts = mp4_table(box, size, 4, 8, &stts_count);
+
+	if (!stsz || !count || !stco || !stsc || !stts)
+		return -1;
+
+	box = mp4_find_box(stbl, stbl_size, "ctts", &size);
+	ctts = mp4_table(box, size, 4, 8, &ctts_count);
+
+	box = mp4_find_box(stbl, stbl_size, "stss", &size);
+	stss = mp4_table(box, size, 4, 4, &stss_count);
+
+	m->samples = calloc(count, sizeof (*m->samples));
+	if (!m->samples)
+		return -1;
+	m->count = count;
+
+	for (n = 0; n < count; n++)
+		m->samples[n].size = sample_size ?: rb32(stsz + 4 * n);
+
+	/* runs of chunks holding the same number of samples */
+	n = 0;
+	for (uint32_t e = 0; e < stsc_count && n < count; e++) {
+		uint32_t first = rb32(stsc + 12 * e);
+		uint32_t per_chunk = rb32(stsc + 12 * e + 4);
+		uint32_t last = e + 1 < stsc_count ?
+			rb32(stsc + 12 * (e + 1)) : chunks + 1;
+
+		if (!first || last > chunks + 1)
+			return -1;
+
+		for (uint32_t c = first; c < last && n < count; c++) {
+			uint64_t offset = co64 ? rb64(stco + 8 * (c - 1)) :
+						 rb32(stco + 4 * (c - 1));
+
+			for (uint32_t k = 0; k < per_chunk && n < count; k++) {
+				m->samples[n].offset = offset;
+				offset += m->samples[n++].size;
+			}
+		}
+	}
+
+	if (n < count)
+		return -1;
+
+	dts = 0;
+	n = 0;
+	for (uint32_t e = 0; e < stts_count; e++) {
+		uint32_t samples = rb32(stts + 8 * e);
+		uint32_t delta = rb32(stts + 8 * e + 4);
+
+		for (uint32_t k = 0; k < samples && n < count; k++) {
+			m->samples[n].dts = dts;
+			m->samples[n++].duration = delta;
+			dts += delta;
+		}
+	}
+
+	for (; n < count; n++)
+		m->samples[n].dts = dts;
+
+	n = 0;
+	for (uint32_t e = 0; ctts && e < ctts_count; e++) {
+		uint32_t samples = rb32(ctts + 8 * e);
+		int32_t offset = rb32(ctts + 8 * e + 4);
+
+		for (uint32_t k = 0; k < samples && n < count; k++)
+			m->samples[n++].cts = offset;
+	}
+
+	/* without sync sample table, every sample is a sync sample */
+	for (n = 0; n < count; n++)
+		m->samples[n].key = !stss;
+
+	for (uint32_t e = 0; stss && e < stss_count; e++) {
+		n = rb32(stss + 4 * e);
+		if (n >= 1 && n <= count)
+			m->samples[n - 1].key = 1;
+	}
+
+	return 0;
+}
+
+static int
+mp4_load_track(struct reader *r, struct mp4 *m, const uint8_t *trak,
+	       uint32_t trak_size)
+{
+	const uint8_t *mdia, *box, *stbl;
+	uint32_t mdia_size, size, stbl_size, timescale;
+	int64_t duration;
+
+	mdia = mp4_find_box(trak, trak_size, "mdia", &mdia_size);
+	if (!mdia)
+		return -1;
+
+	box = mp4_find_box(mdia, mdia_size, "hdlr", &size);
+	if (!box || size < 12 || memcmp(box + 8, "vide", 4))
+		return -1;
+
+	box = mp4_find_box(mdia, mdia_size, "mdhd", &size);
+	if (!box || size < 24)
+		return -1;
+	timescale = rb32(box + (box[0] == 1 ? 20 : 12));
+	if (!timescale)
+		return -1;
+
+	stbl = mp4_find_path(mdia, mdia_size, "minf/stbl", &stbl_size);
+	if (!stbl)
+		return -1;
+
+	if (mp4_load_format(r, m, stbl, stbl_size) < 0 ||
+	    mp4_load_samples(m, stbl, stbl_size) < 0)
+		return -1;
+
+	r->tb_num = 1;
+	r->tb_den = timescale;
+
+	duration = m->samples[m->count - 1].dts +
+		   m->samples[m->count - 1].duration;
+	if (duration > 0 && duration / m->count) {
+		r->fps_n = timescale;
+		r->fps_d = duration / m->count;
+	}
+
+	return 0;
+}
+
+/* Load the top level moov box, which can be before or after the data */
+static uint8_t *
+mp4_read_moov(int fd, uint32_t *moov_size)
+{
+	uint8_t header[16], *moov;
+	uint64_t pos = 0, len;
+	uint32_t header_size;
+	int ret;
+
+	for (;;) {
+		ret = pread_full(fd, header, sizeof (header), pos);
+		if (ret < 8)
+			return NULL;
+
+		len = rb32(header);
+		header_size = 8;
+		if (len == 1) {
+			if (ret < 16)
+				return NULL;
+			len = rb64(header + 8);
+			header_size = 16;
+		}
+
+		/* a box running to the end of the file, or garbage */
+		if (len < header_size)
+			return NULL;
+
+		/* fragmented files keep their samples out of the sample
+		 * tables */
+		if (!memcmp(header + 4, "moof", 4))
+			return NULL;
+
+		if (!memcmp(header + 4, "moov", 4))
+			break;
+
+		pos += len;
+	}
+
+	if (len - header_size > MP4_MAX_MOOV_SIZE)
+		return NULL;
+
+	*moov_size = len - header_size;
+	moov = malloc(*moov_size);
+	if (!moov)
+		return NULL;
+
+	if (pread_full(fd, moov, *moov_size, pos + header_size) !=
+	    (int)*moov_size) {
+		free(moov);
+		return NULL;
+	}
+
+	return moov;
+}
+
+static int
+mp4_open(struct reader *r, const uint8_t *data, int size)
+{
+	const uint8_t *p, *trak;
+	uint32_t left, trak_size, box_size;
+	struct mp4 *m;
+	uint8_t *moov;
+	uint32_t moov_size;
+	int ret = -1;
+
+	(void)data;
+	(void)size;
+
+	moov = mp4_read_moov(r->fd, &moov_size);
+	if (!moov) {
+		dbg("no usable moov box");
+		return -1;
+	}
+
+	m = calloc(1, sizeof (*m));
+	if (!m || mp4_find_box(moov, moov_size, "mvex", &box_size))
+		goto out;
+
+	/* the first video track in a format handled */
+	p = moov;
+	left = moov_size;
+	while ((trak = mp4_find_box(p, left, "trak", &trak_size))) {
+		ret = mp4_load_track(r, m, trak, trak_size);
+		if (!ret)
+			break;
+
+		mp4_free(m);
+		left -= trak + trak_size - p;
+		p = trak + trak_size;
+	}
+
+out:
+	free(moov);
+
+	if (ret < 0) {
+		if (m)
+			mp4_free(m);
+		free(m);
+		return -1;
+	}
+
+	r->priv = m;
+
+	return 0;
+}
+
+static int
+mp4_read_frame(struct reader *r, void *data, int size,
+	       struct reader_frame *frame)
+{
+	struct mp4 *m = r->priv;
+	struct mp4_sample *s;
+	int prefix = 0;
+	int ret;
+
+	if (m->next == m->count)
+		return 0;
+
+	s = &m->samples[m->next++];
+
+	if (m->rewrite)
+		prefix = annexb_rewrite_prefix(&m->annexb, s->key);
+
+	if (s->size > (uint32_t)(size - prefix)) {
+		err("MP4 sample too large (%u bytes, buffer is %d bytes)",
+		    s->size, size);
+		return -ENOSPC;
+	}
+
+	ret = pread_full(r->fd, (uint8_t *)data + prefix, s->size, s->offset);
+	if (ret < 0)
+		return ret;
+	if (ret < (int)s->size) {
+		dbg("ignoring truncated MP4 sample");
+		return 0;
+	}
+
+	frame->size = s->size;
+	if (m->rewrite) {
+		frame->size = annexb_rewrite(&m->annexb, data, prefix, s->size);
+		if (frame->size < 0) {
+			err("corrupt MP4 sample %u", m->next - 1);
+			return -EINVAL;
+		}
+	}
+
+	frame->dts = s->dts;
+	frame->pts = s->dts + s->cts;
+	frame->duration = s->duration;
+	frame->key = s->key;
+
+	return 1;
+}
+
+static void
+mp4_close(struct reader *r)
+{
+	mp4_free(r->priv);
+	free(r->priv);
+}
+
+static const struct reader_ops mp4_ops = {
+	.name = "mp4",
+	.probe = mp4_probe,
+	.open = mp4_open,
+	.read_frame = mp4_read_frame,
+	.close = mp4_close,
+};
+
+/*
+ * H.264 and HEVC elementary streams, in Annex-B form. Data is read
+ * straight into the destination buffer until the start of the next access
+ * unit shows up; the bytes read past it are read again with the next
+ * frame.
+ */
+#define ES_READ_SIZE	16384
+
+struct es {
+	uint64_t pos;
+	int hevc;
+};
+
+/* Whether the NAL unit header at data starts an H.264 (0) or HEVC (1)
+ * stream, or -1 */
+static int
+es_stream_type(const uint8_t *nal)
+{
+	int type;
+
+	/* VPS, SPS, PPS, access unit delimiter, prefix SEI, on the base
+	 * layer. Checked first: the two-byte HEVC header can pass for an
+	 * H.264 one, an access unit delimiter 0x46 0x01 for an SEI. */
+	type = (nal[0] >> 1) & 0x3f;
+	if (!(nal[0] & 0x80) && nal[1] == 0x01 &&
+	    ((type >= 32 && type <= 35) || type == 39))
+		return 1;
+
+	/* SEI and access unit delimiter have a zero nal_ref_idc, an SPS a
+	 * non-zero one */
+	if (nal[0] == 0x06 || nal[0] == 0x09 ||
+	    nal[0] == 0x27 || nal[0] == 0x47 || nal[0] == 0x67)
+		return 0;
+
+	return -1;
+}
+
+static int
+es_probe(const uint8_t *data, int size)
+{
+	int n = bitstream_find_sc(data, size);
+
+	if (n < 0 || n > 1 || (n == 1 && data[0]) || n + 5 > size)
+		return 0;
+
+	return es_stream_type(data + n + 3) >= 0;
+}
+
+static int
+es_open(struct reader *r, const uint8_t *data, int size)
+{
+	struct es *es;
+
+	es = calloc(1, sizeof (*es));
+	if (!es)
+		return -1;
+
+	es->hevc = es_stream_type(data + bitstream_find_sc(data, size) + 3);
+
+	r->fourcc = es->hevc ? V4L2_PIX_FMT_HEVC : V4L2_PIX_FMT_H264;
+	r->priv = es;
+
+	/* no timing information in the stream, the frame size is known
+	 * once the decoder parsed the parameter sets */
+	r->tb_num = 1;
+	r->tb_den = 30;
+	r->fps_n = 30;
+	r->fps_d = 1;
+
+	return 0;
+}
+
+static int
+es_is_vcl(const uint8_t *nal, int hevc)
+{
+	if (hevc)
+		return ((nal[0] >> 1) & 0x3f) <= 31;
+
+	return (nal[0] & 0x1f) == 1 || (nal[0] & 0x1f) == 5;
+}
+
+static int
+es_is_key(const uint8_t *nal, int hevc)
+{
+	int type = hevc ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+
+	return hevc ? type >= 16 && type <= 23 : type == 5;
+}
+
+/* Whether the NAL unit starts a new access unit, once the current one
+ * has a picture */
+static int
+es_starts_au(const uint8_t *nal, int hevc)
+{
+	int type;
+
+	if (hevc) {
+		type = (nal[0] >> 1) & 0x3f;
+
+		/* first_slice_segment_in_pic_flag */
+		if (type <= 31)
+			return nal[2] & 0x80;
+
+		/* VPS, SPS, PPS, delimiter, prefix SEI, reserved */
+		return (type >= 32 && type <= 35) || type == 39 ||
+		       (type >= 41 && type <= 44) ||
+		       (type >= 48 && type <= 55);
+	}
+
+	type = nal[0] & 0x1f;
+
+	/* first_mb_in_slice is 0 */
+	if (type == 1 || type == 5)
+		return nal[1] & 0x80;
+
+	/* SEI, SPS, PPS, delimiter, reserved */
+	return (type >= 6 && type <= 9) || (type >= 14 && type <= 18);
+}
+
+static int
+es_read_frame(struct reader *r, void *data, int size,
+	      struct reader_frame *frame)
+{
+	struct es *es = r->priv;
+	uint8_t *buf = data;
+	int header = es->hevc ? 3 : 2;
+	int filled = 0, scan = 0, seen_vcl = 0, key = 0, eof = 0;
+	int n, nal, want, ret;
+
+	for (;;) {
+		n = bitstream_find_sc(buf + scan, filled - scan);
+		if (n >= 0 && scan + n + 3 + header <= filled) {
+			nal = scan + n + 3;
+
+			if (seen_vcl && es_starts_au(buf + nal, es->hevc)) {
+				filled = scan + n;
+				/* the zero byte of a 4 bytes start code */
+				if (buf[filled - 1] == 0x00)
+					filled--;
+				break;
+			}
+
+			seen_vcl |= es_is_vcl(buf + nal, es->hevc);
+			key |= es_is_key(buf + nal, es->hevc);
+			scan = nal;
+			continue;
+		}
+
+		if (eof)
+			break;
+
+		/* scan again from a start code whose NAL unit header is not
+		 * read yet, or from bytes which may begin one */
+		scan = n >= 0 ? scan + n : MAX(scan, filled - 2);
+
+		if (filled == size) {
+			err("access unit too large (buffer is %d bytes)",
+			    size);
+			return -ENOSPC;
+		}
+
+		want = MIN(ES_READ_SIZE, size - filled);
+		ret = pread_full(r->fd, buf + filled, want, es->pos + filled);
+		if (ret < 0)
+			return ret;
+
+		eof = ret < want;
+		filled += ret;
+	}
+
+	if (!filled)
+		return 0;
+
+	es->pos += filled;
+
+	frame->size = filled;
+	frame->pts = READER_NOPTS;
+	frame->dts = r->frame_count++;
+	frame->duration = 1;
+	frame->key = key;
+
+	return 1;
+}
+
+static void
+es_close(struct reader *r)
+{
+	free(r->priv);
+}
+
+static const struct reader_ops es_ops = {
+	.name = "annexb",
+	.probe = es_probe,
+	.open = es_open,
+	.read_frame = es_read_frame,
+	.close = es_close,
+};
+
+static const struct reader_ops *readers[] = {
+	&ivf_ops,
+	&fwht_ops,
+	&mp4_ops,
+	&es_ops,
+};
+
+struct reader *
+reader_open(const char *url)
+{
+	uint8_t probe[PROBE_SIZE];
+	struct reader *r;
+	int fd, size;
+
+	if (!strncmp(url, "file:", 5))
+		url += 5;
+	else if (strstr(url, "://"))
+		return NULL;
+
+	fd = open(url, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	size = read_full(fd, probe, sizeof (probe));
+
+	for (size_t n = 0; n < ARRAY_LENGTH(readers); n++) {
+		if (size <= 0 || !readers[n]->probe(probe, size))
+			continue;
+
+		r = calloc(1, sizeof (*r));
+		if (!r)
+			break;
+
+		r->ops = readers[n];
+		r->fd = fd;
+
+		if (r->ops->open(r, probe, size) < 0) {
+			free(r);
+			break;
+		}
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		info("Reading %s natively (%s, %dx%d)", url, r->ops->name,
+		     r->width, r->height);
+
+		return r;
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+int
+reader_read_frame(struct reader *r, void *data, int size,
+		  struct reader_frame *frame)
+{
+	void *header = frame->header;
+
+	memset(frame, 0, sizeof (*frame));
+	frame->header = header;
+
+	return r->ops->read_frame(r, data, size, frame);
+}
+
+void
+reader_close(struct reader *r)
+{
+	if (r->ops->close)
+		r->ops->close(r);
+	close(r->fd);
+	free(r);
+}
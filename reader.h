@@ -0,0 +1,71 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Native container readers header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef INCLUDE_READER_H
+#define INCLUDE_READER_H
+
+#include <stdint.h>
+
+struct reader_ops;
+
+/* Native reader for simple containers, reading frames directly into
+ * the destination buffer instead of going through libavformat */
+struct reader {
+	const struct reader_ops *ops;
+	int fd;
+
+	/* stream parameters, filled when the reader is opened */
+	uint32_t fourcc;
+	int width;
+	int height;
+	int fps_n, fps_d;
+	int tb_num, tb_den;
+
+	int64_t frame_count;
+	void *priv;
+};
+
+/* Presentation timestamp of a frame which has none */
+#define READER_NOPTS	INT64_MIN
+
+/* Timestamps and duration in the time base of the reader */
+struct reader_frame {
+	/* in: where to put the frame header apart from the data, for
+	 * stateless decoders, or NULL; FWHT only */
+	void *header;
+
+	int size;
+	int64_t pts;
+	int64_t dts;
+	int64_t duration;
+	int key;
+};
+
+/* Open url with a native reader, returns NULL if it is not a local file
+ * in a format handled natively */
+struct reader *reader_open(const char *url);
+
+/* Read the next frame into data, which can hold size bytes. H.264 and
+ * HEVC frames are in Annex-B form. Returns 1 when a frame was read, 0 at
+ * end of stream, or a negative errno. */
+int reader_read_frame(struct reader *r, void *data, int size,
+		      struct reader_frame *frame);
+
+void reader_close(struct reader *r);
+
+#endif /* INCLUDE_READER_H */
@@ -0,0 +1,71 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* Number of slots in a ring, must be a power of two */
+#define RING_SIZE 32
+
+#define RING_CACHELINE 64
+
+/*
+ * Lock-free single-producer/single-consumer ring of integers.
+ *
+ * ring_push() must only be called by the producer thread, ring_pop()
+ * only by the consumer thread. Head and tail live on separate cache
+ * lines so that both sides do not keep stealing each other's line.
+ */
+struct ring {
+	_Alignas(RING_CACHELINE) atomic_uint head;
+	_Alignas(RING_CACHELINE) atomic_uint tail;
+	_Alignas(RING_CACHELINE) int data[RING_SIZE];
+};
+
+static inline void
+ring_init(struct ring *r)
+{
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+}
+
+static inline bool
+ring_push(struct ring *r, int value)
+{
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (head - tail == RING_SIZE)
+		return false;
+
+	r->data[head & (RING_SIZE - 1)] = value;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+static inline bool
+ring_pop(struct ring *r, int *value)
+{
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	*value = r->data[tail & (RING_SIZE - 1)];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+	return true;
+}
+
+/* Number of entries in the ring; only exact when called by one side
+ * while the other side is idle */
+static inline unsigned int
+ring_count(struct ring *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) -
+	       atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+#endif /* RING_H_ */
@@ -0,0 +1,296 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Presentation scheduler
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Decoded frames are held until their presentation time instead of being
+ * shown as soon as the decoder returns them. The stream timeline is
+ * anchored to the presentation clock of the compositor when the first
+ * frame is queued, and again after a discontinuity: a pause, a frame
+ * step, a seek or a decoder stall.
+ *
+ * Once the compositor has reported a presentation, each frame is aimed at
+ * the refresh closest to its time and committed one refresh interval
+ * before it, so that the compositor repaints with it. Without presentation
+ * feedback, frames are committed at their time.
+ *
+ * A frame which missed its refresh is given back to the decoder without
+ * being shown, unless that would freeze the picture for too long.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "display.h"
+#include "loop.h"
+#include "sched.h"
+
+#define DBG_TAG " sched"
+
+/* distance from the timeline beyond which it is anchored again */
+#define RESYNC_US	500000
+
+/* a frame is late when committed past its refresh, or this long after
+ * its time if the refresh interval is unknown */
+#define LATE_US		16667
+
+/* late frames dropped in a row at most */
+#define MAX_LATE_DROPS	4
+
+struct sched_frame {
+	struct fb *fb;
+	uint64_t pts;
+};
+
+struct sched {
+	struct window *window;
+	struct loop_source *timer;
+	sched_frame_cb_t present;
+	sched_frame_cb_t drop;
+	void *data;
+
+	/* a capture buffer is queued at most once */
+	struct sched_frame frames[MAX_CAP_BUF];
+	int head;
+	int count;
+
+	/* pts base_pts is presented at base_time, in the presentation
+	 * clock */
+	int synced;
+	uint64_t base_pts;
+	uint64_t base_time;
+
+	/* one bit per frame, set if it was late, latest in bit 0 */
+	uint32_t late_history;
+	int late_drops;
+
+	unsigned long presented;
+	unsigned long dropped;
+};
+
+static uint64_t
+clock_time_us(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Time at which the frame must be committed, in the presentation clock */
+static uint64_t
+commit_time(struct sched *s, uint64_t pts)
+{
+	uint64_t target, presented, vblank;
+	uint32_t refresh;
+	clockid_t clock;
+
+	target = s->base_time + (pts - s->base_pts);
+
+	window_get_presentation(s->window, &clock, &presented, &refresh);
+	if (!presented || !refresh || target < presented + refresh)
+		return target;
+
+	/* refreshes happen every refresh interval since the last one
+	 * reported */
+	vblank = presented +
+		 (target - presented + refresh / 2) / refresh * refresh;
+
+	return vblank - refresh;
+}
+
+static struct sched_frame *
+pop_frame(struct sched *s)
+{
+	struct sched_frame *f = &s->frames[s->head];
+
+	s->head = (s->head + 1) % MAX_CAP_BUF;
+	s->count--;
+
+	return f;
+}
+
+static void
+present_frame(struct sched *s, struct sched_frame *f)
+{
+	s->present(f->fb, s->data);
+	s->presented++;
+	s->late_drops = 0;
+}
+
+static void
+drop_frame(struct sched *s, struct sched_frame *f)
+{
+	f->fb->busy = 0;
+	s->drop(f->fb, s->data);
+	s->dropped++;
+}
+
+/* Present the frames which are due, then wait for the next one */
+static void
+sched_run(struct sched *s)
+{
+	uint64_t presented, now, mono_now, when;
+	uint32_t refresh;
+	clockid_t clock;
+	struct sched_frame *f;
+	int late;
+
+	window_get_presentation(s->window, &clock, &presented, &refresh);
+
+	while (s->count) {
+		f = &s->frames[s->head];
+
+		now = clock_time_us(clock);
+		when = commit_time(s, f->pts);
+
+		if (when > now) {
+			/* timers run on the monotonic clock */
+			mono_now = clock_time_us(CLOCK_MONOTONIC);
+			loop_timer_arm_abs(s->timer, mono_now + when - now);
+			return;
+		}
+
+		f = pop_frame(s);
+
+		late = now > when + (refresh ?: LATE_US);
+		s->late_history = s->late_history << 1 | late;
+
+		/* show the newest frame now and then when all are late */
+		if (late && (s->count || s->late_drops < MAX_LATE_DROPS)) {
+			dbg("dropping late frame, pts %" PRIu64, f->pts);
+			drop_frame(s, f);
+			s->late_drops++;
+		} else {
+			present_frame(s, f);
+		}
+	}
+
+	loop_timer_arm(s->timer, 0, 0);
+}
+
+static void
+handle_timer(struct loop_source *src, uint64_t expirations, void *data)
+{
+	sched_run(data);
+}
+
+struct sched *
+sched_create(struct loop *loop, struct window *window,
+	     sched_frame_cb_t present, sched_frame_cb_t drop, void *data)
+{
+	struct sched *s;
+
+	s = calloc(1, sizeof (*s));
+	if (!s)
+		return NULL;
+
+	s->timer = loop_add_timer(loop, handle_timer, s);
+	if (!s->timer) {
+		free(s);
+		return NULL;
+	}
+
+	s->window = window;
+	s->present = present;
+	s->drop = drop;
+	s->data = data;
+
+	return s;
+}
+
+void
+sched_destroy(struct sched *s)
+{
+	loop_remove(s->timer);
+	free(s);
+}
+
+void
+sched_queue(struct sched *s, struct fb *fb, uint64_t pts)
+{
+	uint64_t presented, now, target;
+	uint32_t refresh;
+	clockid_t clock;
+
+	window_get_presentation(s->window, &clock, &presented, &refresh);
+	now = clock_time_us(clock);
+
+	/* anchor the timeline again on discontinuities */
+	if (s->synced) {
+		target = s->base_time + (pts - s->base_pts);
+		if (pts < s->base_pts ||
+		    target + RESYNC_US < now || target > now + RESYNC_US)
+			s->synced = 0;
+	}
+
+	if (!s->synced) {
+		dbg("timeline anchored at pts %" PRIu64, pts);
+		s->base_pts = pts;
+		s->base_time = now;
+		s->synced = 1;
+	}
+
+	/* cannot happen with a frame per capture buffer, but do not lose
+	 * one if it does */
+	if (s->count == MAX_CAP_BUF)
+		present_frame(s, pop_frame(s));
+
+	fb->busy = 1;
+	s->frames[(s->head + s->count) % MAX_CAP_BUF] =
+		(struct sched_frame){ .fb = fb, .pts = pts };
+	s->count++;
+
+	sched_run(s);
+}
+
+void
+sched_flush(struct sched *s)
+{
+	while (s->count > 1)
+		drop_frame(s, pop_frame(s));
+
+	if (s->count)
+		present_frame(s, pop_frame(s));
+
+	loop_timer_arm(s->timer, 0, 0);
+}
+
+int
+sched_late_frames(struct sched *s, int frames)
+{
+	uint32_t mask = frames >= 32 ? UINT32_MAX : (1u << frames) - 1;
+
+	return __builtin_popcount(s->late_history & mask);
+}
+
+void
+sched_clear_late(struct sched *s)
+{
+	s->late_history = 0;
+}
+
+void
+sched_get_stats(struct sched *s, unsigned long *presented,
+		unsigned long *dropped)
+{
+	*presented = s->presented;
+	*dropped = s->dropped;
+}
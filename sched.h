@@ -0,0 +1,55 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Presentation scheduler header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef INCLUDE_SCHED_H
+#define INCLUDE_SCHED_H
+
+#include <stdint.h>
+
+struct fb;
+struct loop;
+struct sched;
+struct window;
+
+/* Show fb now, or give it back without showing it */
+typedef void (*sched_frame_cb_t)(struct fb *fb, void *data);
+
+struct sched *sched_create(struct loop *loop, struct window *window,
+			   sched_frame_cb_t present, sched_frame_cb_t drop,
+			   void *data);
+
+/* Frames still queued are forgotten, not dropped */
+void sched_destroy(struct sched *s);
+
+/* Queue a decoded frame, to be presented at the refresh of the window
+ * closest to its pts, in microseconds. The frame is marked busy until it
+ * is presented or dropped. */
+void sched_queue(struct sched *s, struct fb *fb, uint64_t pts);
+
+/* Present the last frame queued now and drop the others */
+void sched_flush(struct sched *s);
+
+/* Number of frames which missed their refresh among the last frames
+ * handled, up to 32 */
+int sched_late_frames(struct sched *s, int frames);
+void sched_clear_late(struct sched *s);
+
+void sched_get_stats(struct sched *s, unsigned long *presented,
+		     unsigned long *dropped);
+
+#endif /* INCLUDE_SCHED_H */
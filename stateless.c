@@ -0,0 +1,830 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Stateless decoder backend, using the Media Request API
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Stateless decoders keep no state between frames: every OUTPUT buffer is
+ * queued with a media request carrying the codec controls parsed from the
+ * bitstream, and the application tracks which CAPTURE buffers hold the
+ * reference frames. One request is allocated per OUTPUT buffer so that as
+ * many frames as there are OUTPUT buffers can be in flight.
+ *
+ * Frames are parsed by the parser thread as they are queued, which is when
+ * the codec decides what decoding them does to the reference frames, and
+ * which frames are then output, in presentation order. This is passed in
+ * decoding order to the main thread, which holds the CAPTURE buffers of
+ * reference frames and of frames waiting for output as frames are decoded.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/media.h>
+#include <linux/videodev2.h>
+
+#include "common.h"
+#include "h264.h"
+#include "stateless.h"
+#include "video.h"
+
+#define DBG_TAG "   sls"
+
+#if defined(MEDIA_IOC_REQUEST_ALLOC) && defined(V4L2_CID_STATELESS_FWHT_PARAMS)
+
+/* Maximum number of reference frames of the supported codecs */
+#define MAX_DPB		16
+
+/* Largest frame header taken apart from the frame data, FWHT */
+#define MAX_HEADER_SIZE	44
+
+/* Frames queued and not yet handled as decoded: each holds an OUTPUT or a
+ * CAPTURE buffer. Must be a power of two. */
+#define FRAME_RING_SIZE	64
+
+_Static_assert(FRAME_RING_SIZE >= MAX_OUT_BUF + MAX_CAP_BUF + 1,
+	       "frame ring too small");
+_Static_assert(STATELESS_MAX_FRAMES >= MAX_CAP_BUF,
+	       "stateless output too small");
+
+struct stateless;
+
+/* What decoding a frame does to the reference frames, and the frames then
+ * output; frames are known by their timestamp in nanoseconds */
+struct stateless_frame {
+	uint64_t ts;
+	int flush;		/* end of stream, nothing decoded */
+	int ref;		/* kept as a reference frame */
+	int release_count;	/* frames no longer referenced */
+	uint64_t release[MAX_DPB + 1];
+	int output_count;	/* frames to show, in order */
+	uint64_t output[MAX_DPB + 2];
+};
+
+struct stateless_codec {
+	const char *name;
+	uint32_t stream_fourcc;	/* format of the stream */
+	uint32_t fourcc;	/* stateless OUTPUT format */
+	int dpb_size;		/* number of reference frames */
+	int header_size;	/* frame header read apart from the data */
+
+	/* Set up the decoder and the codec state */
+	int (*init)(struct stateless *s, int video_fd);
+	void (*free)(struct stateless *s);
+
+	/* Parse the frame, set its controls in the request and fill in
+	 * what decoding it does to the reference frames */
+	int (*prepare)(struct stateless *s, int video_fd, int request_fd,
+		       const uint8_t *header, const uint8_t *data, int size,
+		       struct stateless_frame *frame);
+
+	/* Fill in the frames still to output at the end of the stream */
+	void (*flush)(struct stateless *s, struct stateless_frame *frame);
+};
+
+struct stateless {
+	const struct stateless_codec *codec;
+	void *priv;
+	int media_fd;
+	int request_fd[MAX_OUT_BUF];
+	uint8_t header[MAX_OUT_BUF][MAX_HEADER_SIZE];
+
+	/* frames in decoding order, from the parser thread to the main
+	 * thread */
+	struct stateless_frame frames[FRAME_RING_SIZE];
+	_Alignas(RING_CACHELINE) atomic_uint frames_head;
+	_Alignas(RING_CACHELINE) atomic_uint frames_tail;
+
+	/* CAPTURE buffers held as reference frames or until they are
+	 * output, and the timestamps of their frames */
+	int cap_ref[MAX_CAP_BUF];
+	int cap_wait[MAX_CAP_BUF];
+	uint64_t cap_ts[MAX_CAP_BUF];
+
+	/* timestamp of the last reference frame, FWHT */
+	uint64_t last_ref_ts;
+	int has_ref;
+
+	atomic_int queued;
+	atomic_int decoded;
+	atomic_int eos;
+};
+
+static inline uint32_t
+rb32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void
+add_control(struct v4l2_ext_control *controls, int *count, uint32_t id,
+	    void *data, uint32_t size)
+{
+	struct v4l2_ext_control *control = &controls[(*count)++];
+
+	memset(control, 0, sizeof (*control));
+	control->id = id;
+	control->size = size;
+	control->ptr = data;
+}
+
+static int
+set_request_controls(int video_fd, int request_fd,
+		     struct v4l2_ext_control *control, int count)
+{
+	struct v4l2_ext_controls controls;
+
+	memzero(controls);
+	controls.which = V4L2_CTRL_WHICH_REQUEST_VAL;
+	controls.request_fd = request_fd;
+	controls.count = count;
+	controls.controls = control;
+
+	if (ioctl(video_fd, VIDIOC_S_EXT_CTRLS, &controls) < 0) {
+		err("failed to set control %08x: %m",
+		    controls.error_idx < (uint32_t)count ?
+		    control[controls.error_idx].id : 0);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * FWHT: the frame header of the stateful format goes into the
+ * V4L2_CID_STATELESS_FWHT_PARAMS control, it is read apart so that the
+ * buffer only holds the compressed data. Every frame is a reference for
+ * the next one.
+ */
+#define FWHT_HEADER_SIZE	44
+#define FWHT_MAGIC1		0x4f4f4f4f
+#define FWHT_MAGIC2		0xffffffff
+
+_Static_assert(FWHT_HEADER_SIZE <= MAX_HEADER_SIZE, "FWHT header too large");
+
+static int
+fwht_prepare(struct stateless *s, int video_fd, int request_fd,
+	     const uint8_t *header, const uint8_t *data, int size,
+	     struct stateless_frame *frame)
+{
+	struct v4l2_ctrl_fwht_params params;
+	struct v4l2_ext_control control;
+	int count = 0;
+
+	(void)data;
+
+	if (rb32(header) != FWHT_MAGIC1 || rb32(header + 4) != FWHT_MAGIC2) {
+		err("bad FWHT frame header");
+		return -1;
+	}
+
+	memzero(params);
+	params.version = rb32(header + 8);
+	params.width = rb32(header + 12);
+	params.height = rb32(header + 16);
+	params.flags = rb32(header + 20);
+	params.colorspace = rb32(header + 24);
+	params.xfer_func = rb32(header + 28);
+	params.ycbcr_enc = rb32(header + 32);
+	params.quantization = rb32(header + 36);
+
+	if (rb32(header + 40) != (uint32_t)size) {
+		err("truncated FWHT frame");
+		return -1;
+	}
+
+	if (!(params.flags & V4L2_FWHT_FL_I_FRAME))
+		params.backward_ref_ts = s->last_ref_ts;
+
+	add_control(&control, &count, V4L2_CID_STATELESS_FWHT_PARAMS,
+		    &params, sizeof (params));
+	if (set_request_controls(video_fd, request_fd, &control, count) < 0)
+		return -1;
+
+	frame->ref = 1;
+	frame->release_count = 0;
+	if (s->has_ref)
+		frame->release[frame->release_count++] = s->last_ref_ts;
+
+	/* no reordering */
+	frame->output_count = 1;
+	frame->output[0] = frame->ts;
+
+	s->last_ref_ts = frame->ts;
+	s->has_ref = 1;
+
+	return 0;
+}
+
+#ifdef V4L2_CID_STATELESS_H264_DECODE_PARAMS
+
+/*
+ * H.264: whole Annex-B frames are queued, the decoder parses the slices
+ * itself. The parameter sets, the decoding parameters and the reference
+ * frames come from h264.c.
+ */
+static int
+h264_init(struct stateless *s, int video_fd)
+{
+	struct v4l2_ext_control control[2];
+	struct v4l2_ext_controls controls;
+
+	memset(control, 0, sizeof (control));
+	control[0].id = V4L2_CID_STATELESS_H264_DECODE_MODE;
+	control[0].value = V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED;
+	control[1].id = V4L2_CID_STATELESS_H264_START_CODE;
+	control[1].value = V4L2_STATELESS_H264_START_CODE_ANNEX_B;
+
+	memzero(controls);
+	controls.which = V4L2_CTRL_WHICH_CUR_VAL;
+	controls.count = ARRAY_LENGTH(control);
+	controls.controls = control;
+
+	if (ioctl(video_fd, VIDIOC_S_EXT_CTRLS, &controls) < 0) {
+		err("the decoder does not take whole Annex-B frames: %m");
+		return -1;
+	}
+
+	s->priv = h264_create();
+	if (!s->priv)
+		return -1;
+
+	return 0;
+}
+
+static void
+h264_free(struct stateless *s)
+{
+	h264_destroy(s->priv);
+}
+
+static int
+h264_prepare(struct stateless *s, int video_fd, int request_fd,
+	     const uint8_t *header, const uint8_t *data, int size,
+	     struct stateless_frame *frame)
+{
+	struct v4l2_ext_control control[4];
+	struct h264_frame h264;
+	int count = 0;
+
+	(void)header;
+
+	if (h264_parse_frame(s->priv, data, size, frame->ts, &h264) < 0)
+		return -1;
+
+	add_control(control, &count, V4L2_CID_STATELESS_H264_SPS,
+		    &h264.sps, sizeof (h264.sps));
+	add_control(control, &count, V4L2_CID_STATELESS_H264_PPS,
+		    &h264.pps, sizeof (h264.pps));
+	if (h264.pps.flags & V4L2_H264_PPS_FLAG_SCALING_MATRIX_PRESENT)
+		add_control(control, &count,
+			    V4L2_CID_STATELESS_H264_SCALING_MATRIX,
+			    &h264.scaling_matrix,
+			    sizeof (h264.scaling_matrix));
+	add_control(control, &count, V4L2_CID_STATELESS_H264_DECODE_PARAMS,
+		    &h264.decode_params, sizeof (h264.decode_params));
+
+	if (set_request_controls(video_fd, request_fd, control, count) < 0)
+		return -1;
+
+	frame->ref = h264.ref;
+	frame->release_count = h264.release_count;
+	memcpy(frame->release, h264.release,
+	       h264.release_count * sizeof (h264.release[0]));
+	frame->output_count = h264.output_count;
+	memcpy(frame->output, h264.output,
+	       h264.output_count * sizeof (h264.output[0]));
+
+	return 0;
+}
+
+static void
+h264_flush(struct stateless *s, struct stateless_frame *frame)
+{
+	struct h264_frame h264;
+
+	h264_flush_frames(s->priv, &h264);
+
+	frame->output_count = h264.output_count;
+	memcpy(frame->output, h264.output,
+	       h264.output_count * sizeof (h264.output[0]));
+}
+
+_Static_assert(H264_MAX_REFS <= MAX_DPB, "H.264 DPB too large");
+_Static_assert(ARRAY_LENGTH(((struct h264_frame *)0)->output) <=
+	       ARRAY_LENGTH(((struct stateless_frame *)0)->output),
+	       "H.264 output too large");
+
+#endif /* V4L2_CID_STATELESS_H264_DECODE_PARAMS */
+
+static const struct stateless_codec codecs[] = {
+	{
+		.name = "fwht",
+		.stream_fourcc = V4L2_PIX_FMT_FWHT,
+		.fourcc = V4L2_PIX_FMT_FWHT_STATELESS,
+		.dpb_size = 1,
+		.header_size = FWHT_HEADER_SIZE,
+		.prepare = fwht_prepare,
+	},
+#ifdef V4L2_CID_STATELESS_H264_DECODE_PARAMS
+	{
+		.name = "h264",
+		.stream_fourcc = V4L2_PIX_FMT_H264,
+		.fourcc = V4L2_PIX_FMT_H264_SLICE,
+		.dpb_size = H264_MAX_REFS,
+		.init = h264_init,
+		.free = h264_free,
+		.prepare = h264_prepare,
+		.flush = h264_flush,
+	},
+#endif
+};
+
+uint32_t stateless_format(uint32_t fourcc)
+{
+	for (size_t n = 0; n < ARRAY_LENGTH(codecs); n++) {
+		if (codecs[n].stream_fourcc == fourcc)
+			return codecs[n].fourcc;
+	}
+
+	return 0;
+}
+
+static int
+has_output_format(struct instance *i, uint32_t fourcc)
+{
+	struct v4l2_fmtdesc fdesc;
+
+	memzero(fdesc);
+	fdesc.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+	while (!ioctl(i->video.fd, VIDIOC_ENUM_FMT, &fdesc)) {
+		if (fdesc.pixelformat == fourcc)
+			return 1;
+		fdesc.index++;
+	}
+
+	return 0;
+}
+
+/* Find the media device of the video device through sysfs */
+static int
+open_media_device(int video_fd)
+{
+	struct stat st;
+	struct dirent *ent;
+	char path[64];
+	DIR *dir;
+	int fd = -1;
+
+	if (fstat(video_fd, &st) < 0) {
+		err("failed to stat video device: %m");
+		return -1;
+	}
+
+	snprintf(path, sizeof (path), "/sys/dev/char/%u:%u/device",
+		 major(st.st_rdev), minor(st.st_rdev));
+
+	dir = opendir(path);
+	if (!dir) {
+		err("cannot open %s: %m", path);
+		return -1;
+	}
+
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, "media", 5))
+			continue;
+
+		snprintf(path, sizeof (path), "/dev/%s", ent->d_name);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			err("cannot open media device %s: %m", path);
+		else
+			dbg("using media device %s", path);
+		break;
+	}
+
+	closedir(dir);
+
+	if (fd < 0 && !ent)
+		err("no media device found for the video device");
+
+	return fd;
+}
+
+int stateless_open(struct instance *i)
+{
+	const struct stateless_codec *codec = NULL;
+	struct stateless *s;
+
+	if (i->video.msm)
+		return 0;
+
+	for (size_t n = 0; n < ARRAY_LENGTH(codecs); n++) {
+		if (codecs[n].stream_fourcc == i->fourcc &&
+		    !has_output_format(i, i->fourcc) &&
+		    has_output_format(i, codecs[n].fourcc)) {
+			codec = &codecs[n];
+			break;
+		}
+	}
+
+	if (!codec)
+		return 0;
+
+	/* only the native reader leaves the headers apart */
+	if (codec->header_size && !i->reader) {
+		err("stateless %s decoding needs a native reader",
+		    codec->name);
+		return -1;
+	}
+
+	s = calloc(1, sizeof (*s));
+	if (!s)
+		return -1;
+
+	s->codec = codec;
+	for (int n = 0; n < MAX_OUT_BUF; n++)
+		s->request_fd[n] = -1;
+
+	s->media_fd = open_media_device(i->video.fd);
+	if (s->media_fd < 0) {
+		free(s);
+		return -1;
+	}
+
+	info("Using stateless %s decoder", codec->name);
+
+	i->fourcc = codec->fourcc;
+	i->video.stateless = s;
+
+	return 1;
+}
+
+void stateless_close(struct instance *i)
+{
+	struct stateless *s = i->video.stateless;
+
+	if (!s)
+		return;
+
+	for (int n = 0; n < MAX_OUT_BUF; n++) {
+		if (s->request_fd[n] >= 0)
+			close(s->request_fd[n]);
+	}
+
+	if (s->priv && s->codec->free)
+		s->codec->free(s);
+
+	close(s->media_fd);
+	free(s);
+
+	i->video.stateless = NULL;
+}
+
+int stateless_setup(struct instance *i)
+{
+	struct stateless *s = i->video.stateless;
+
+	for (int n = 0; n < i->video.out_buf_cnt; n++) {
+		if (s->request_fd[n] >= 0)
+			continue;
+
+		if (ioctl(s->media_fd, MEDIA_IOC_REQUEST_ALLOC,
+			  &s->request_fd[n]) < 0) {
+			err("failed to allocate request: %m");
+			return -1;
+		}
+	}
+
+	dbg("allocated %d requests", i->video.out_buf_cnt);
+
+	if (!s->priv && s->codec->init)
+		return s->codec->init(s, i->video.fd);
+
+	return 0;
+}
+
+int stateless_dpb_size(struct instance *i)
+{
+	return i->video.stateless->codec->dpb_size;
+}
+
+void *stateless_frame_header(struct instance *i, int n)
+{
+	struct stateless *s = i->video.stateless;
+
+	return s->codec->header_size ? s->header[n] : NULL;
+}
+
+int stateless_queue_buf(struct instance *i, int n, int length,
+			struct timeval ts)
+{
+	struct video *vid = &i->video;
+	struct stateless *s = vid->stateless;
+	struct stateless_frame *frame;
+	unsigned int head, tail;
+	int ret;
+
+	head = atomic_load_explicit(&s->frames_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&s->frames_tail, memory_order_acquire);
+	if (head - tail == FRAME_RING_SIZE) {
+		err("too many frames in flight");
+		return -1;
+	}
+
+	/* CAPTURE buffers are referenced by the timestamp copied from the
+	 * OUTPUT buffer they were decoded from */
+	frame = &s->frames[head & (FRAME_RING_SIZE - 1)];
+	frame->ts = ts.tv_sec * 1000000000ULL + ts.tv_usec * 1000ULL;
+	frame->flush = 0;
+
+	ret = s->codec->prepare(s, vid->fd, s->request_fd[n],
+				stateless_frame_header(i, n),
+				(uint8_t *)vid->out_buf_addr[n], length, frame);
+	if (ret < 0)
+		return -1;
+
+	/* known to the main thread before it can be decoded */
+	atomic_store_explicit(&s->frames_head, head + 1, memory_order_release);
+
+	ret = video_queue_buf_out_request(i, n, length, 0, ts,
+					  s->request_fd[n]);
+	if (ret < 0)
+		return ret;
+
+	if (ioctl(s->request_fd[n], MEDIA_REQUEST_IOC_QUEUE) < 0) {
+		err("failed to queue request: %m");
+		return -1;
+	}
+
+	atomic_fetch_add(&s->queued, 1);
+
+	return 0;
+}
+
+void stateless_output_done(struct instance *i, int n)
+{
+	struct stateless *s = i->video.stateless;
+
+	/* the request completed with its OUTPUT buffer, recycle it */
+	if (ioctl(s->request_fd[n], MEDIA_REQUEST_IOC_REINIT) < 0)
+		err("failed to reinit request: %m");
+}
+
+/* Apply what decoding the frame did to the held CAPTURE buffers; n is
+ * the buffer it was decoded to, or -1 */
+static void
+frame_done(struct stateless *s, struct video *vid,
+	   const struct stateless_frame *frame, int n,
+	   struct stateless_output *out)
+{
+	for (int r = 0; r < frame->release_count; r++) {
+		for (int m = 0; m < vid->cap_buf_cnt; m++) {
+			if (s->cap_ref[m] && s->cap_ts[m] == frame->release[r])
+				s->cap_ref[m] = 0;
+		}
+	}
+
+	if (n >= 0) {
+		s->cap_ref[n] = frame->ref;
+		s->cap_wait[n] = 1;
+		s->cap_ts[n] = frame->ts;
+	}
+
+	for (int k = 0; k < frame->output_count; k++) {
+		for (int m = 0; m < vid->cap_buf_cnt; m++) {
+			if (!s->cap_wait[m] || s->cap_ts[m] != frame->output[k])
+				continue;
+
+			s->cap_wait[m] = 0;
+			out->show[out->show_count] = m;
+			out->show_pts[out->show_count] = s->cap_ts[m] / 1000;
+			out->show_count++;
+		}
+	}
+}
+
+/* Update the held flags of the main thread, listing the buffers it can
+ * queue again */
+static void
+update_held(struct stateless *s, struct video *vid, int n,
+	    struct stateless_output *out)
+{
+	for (int m = 0; m < vid->cap_buf_cnt; m++) {
+		int held = s->cap_ref[m] || s->cap_wait[m];
+
+		if (!held && (vid->cap_buf_held[m] || m == n))
+			out->release[out->release_count++] = m;
+
+		vid->cap_buf_held[m] = held;
+	}
+}
+
+void stateless_capture_done(struct instance *i, int n, struct timeval ts,
+			    struct stateless_output *out)
+{
+	struct video *vid = &i->video;
+	struct stateless *s = vid->stateless;
+	struct stateless_frame *frame;
+	unsigned int head, tail;
+	uint64_t ts_ns;
+	int found = 0;
+
+	out->show_count = 0;
+	out->release_count = 0;
+
+	atomic_fetch_add(&s->decoded, 1);
+
+	ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_usec * 1000ULL;
+
+	/* frames before this one were not returned by the decoder, what
+	 * they do to the other frames still applies */
+	do {
+		tail = atomic_load_explicit(&s->frames_tail,
+					    memory_order_relaxed);
+		head = atomic_load_explicit(&s->frames_head,
+					    memory_order_acquire);
+		if (head == tail)
+			break;
+
+		frame = &s->frames[tail & (FRAME_RING_SIZE - 1)];
+		found = !frame->flush && frame->ts == ts_ns;
+
+		frame_done(s, vid, frame, found ? n : -1, out);
+
+		atomic_store_explicit(&s->frames_tail, tail + 1,
+				      memory_order_release);
+	} while (!found);
+
+	update_held(s, vid, n, out);
+}
+
+void stateless_flush(struct instance *i, struct stateless_output *out)
+{
+	struct video *vid = &i->video;
+	struct stateless *s = vid->stateless;
+	unsigned int head, tail;
+
+	out->show_count = 0;
+	out->release_count = 0;
+
+	tail = atomic_load_explicit(&s->frames_tail, memory_order_relaxed);
+	head = atomic_load_explicit(&s->frames_head, memory_order_acquire);
+
+	for (; tail != head; tail++)
+		frame_done(s, vid, &s->frames[tail & (FRAME_RING_SIZE - 1)],
+			   -1, out);
+
+	atomic_store_explicit(&s->frames_tail, tail, memory_order_release);
+
+	update_held(s, vid, -1, out);
+}
+
+void stateless_reset_dpb(struct instance *i)
+{
+	struct video *vid = &i->video;
+	struct stateless *s = vid->stateless;
+
+	/* the frames are gone with the buffers, later releases and
+	 * outputs of them find nothing */
+	for (int n = 0; n < vid->cap_buf_cnt; n++) {
+		s->cap_ref[n] = 0;
+		s->cap_wait[n] = 0;
+		vid->cap_buf_held[n] = 0;
+	}
+}
+
+void stateless_set_eos(struct instance *i)
+{
+	struct stateless *s = i->video.stateless;
+	struct stateless_frame *frame;
+	unsigned int head, tail;
+
+	/* the frames still waiting are output once all are decoded */
+	head = atomic_load_explicit(&s->frames_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&s->frames_tail, memory_order_acquire);
+	if (s->codec->flush && head - tail < FRAME_RING_SIZE) {
+		frame = &s->frames[head & (FRAME_RING_SIZE - 1)];
+		memset(frame, 0, sizeof (*frame));
+		frame->flush = 1;
+		s->codec->flush(s, frame);
+
+		atomic_store_explicit(&s->frames_head, head + 1,
+				      memory_order_release);
+	}
+
+	atomic_store(&s->eos, 1);
+}
+
+int stateless_drained(struct instance *i)
+{
+	struct stateless *s = i->video.stateless;
+
+	return atomic_load(&s->eos) &&
+	       atomic_load(&s->decoded) >= atomic_load(&s->queued);
+}
+
+#else /* !MEDIA_IOC_REQUEST_ALLOC */
+
+/* kernel headers without the request API, stateful decoders only */
+
+uint32_t stateless_format(uint32_t fourcc)
+{
+	(void)fourcc;
+	return 0;
+}
+
+int stateless_open(struct instance *i)
+{
+	(void)i;
+	return 0;
+}
+
+void stateless_close(struct instance *i)
+{
+	(void)i;
+}
+
+int stateless_setup(struct instance *i)
+{
+	(void)i;
+	return -1;
+}
+
+int stateless_queue_buf(struct instance *i, int n, int length,
+			struct timeval ts)
+{
+	(void)i; (void)n; (void)length; (void)ts;
+	return -1;
+}
+
+void stateless_output_done(struct instance *i, int n)
+{
+	(void)i; (void)n;
+}
+
+void stateless_capture_done(struct instance *i, int n, struct timeval ts,
+			    struct stateless_output *out)
+{
+	(void)i; (void)n; (void)ts;
+	out->show_count = 0;
+	out->release_count = 0;
+}
+
+void stateless_flush(struct instance *i, struct stateless_output *out)
+{
+	(void)i;
+	out->show_count = 0;
+	out->release_count = 0;
+}
+
+int stateless_dpb_size(struct instance *i)
+{
+	(void)i;
+	return 0;
+}
+
+void *stateless_frame_header(struct instance *i, int n)
+{
+	(void)i; (void)n;
+	return NULL;
+}
+
+void stateless_reset_dpb(struct instance *i)
+{
+	(void)i;
+}
+
+void stateless_set_eos(struct instance *i)
+{
+	(void)i;
+}
+
+int stateless_drained(struct instance *i)
+{
+	(void)i;
+	return 1;
+}
+
+#endif
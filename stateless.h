@@ -0,0 +1,89 @@
+/*
+ * V4L2 Codec decoding example application
+ *
+ * Stateless decoder backend header file
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef INCLUDE_STATELESS_H
+#define INCLUDE_STATELESS_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+struct instance;
+
+/* Largest number of CAPTURE buffers */
+#define STATELESS_MAX_FRAMES	32
+
+/* CAPTURE buffers to show, in presentation order, with their timestamps
+ * in microseconds; and buffers no longer held, which can be queued again
+ * once they are not on screen */
+struct stateless_output {
+	int show[STATELESS_MAX_FRAMES];
+	uint64_t show_pts[STATELESS_MAX_FRAMES];
+	int show_count;
+	int release[STATELESS_MAX_FRAMES];
+	int release_count;
+};
+
+/* Check whether the decoder is a stateless decoder handling the stream
+ * format; if so, switch i->fourcc to the stateless format and open the
+ * media device. Returns 1 if stateless, 0 if not, -1 on error. */
+int stateless_open(struct instance *i);
+
+void stateless_close(struct instance *i);
+
+/* Stateless variant of the stream format fourcc, 0 if not supported */
+uint32_t stateless_format(uint32_t fourcc);
+
+/* Allocate one request per OUTPUT buffer, once they are set up, and set
+ * up the codec */
+int stateless_setup(struct instance *i);
+
+/* Number of CAPTURE buffers the codec may hold as reference frames */
+int stateless_dpb_size(struct instance *i);
+
+/* Where the reader puts the frame header of OUTPUT buffer n, NULL if the
+ * codec takes whole frames */
+void *stateless_frame_header(struct instance *i, int n);
+
+/* Parse the frame in OUTPUT buffer n, set its codec controls and queue it
+ * with its request */
+int stateless_queue_buf(struct instance *i, int n, int length,
+			struct timeval ts);
+
+/* The request of OUTPUT buffer n has completed and it was dequeued */
+void stateless_output_done(struct instance *i, int n);
+
+/* CAPTURE buffer n was decoded from the OUTPUT buffer with timestamp ts.
+ * The buffer is held while it is a reference frame or waits for output,
+ * which can be n itself. */
+void stateless_capture_done(struct instance *i, int n, struct timeval ts,
+			    struct stateless_output *out);
+
+/* Output the frames still waiting, once drained */
+void stateless_flush(struct instance *i, struct stateless_output *out);
+
+/* Forget all reference frames, when the CAPTURE queue is restarted */
+void stateless_reset_dpb(struct instance *i);
+
+/* No more frames will be queued */
+void stateless_set_eos(struct instance *i);
+
+/* Returns 1 once the end of stream was signalled and every queued frame
+ * has been decoded */
+int stateless_drained(struct instance *i);
+
+#endif /* INCLUDE_STATELESS_H */
@@ -36,6 +36,10 @@
 #include <linux/msm_ion.h>
 #include <media/msm_vidc.h>
 
+#if __has_include(<linux/dma-heap.h>)
+#include <linux/dma-heap.h>
+#endif
+
 #include "common.h"
 
 #define DBG_TAG "   vid"
@@ -44,6 +48,8 @@
 
 #define EXTRADATA_IDX(__num_planes) ((__num_planes) ? (__num_planes) - 1 : 0)
 
+#define DMA_HEAP_PATH "/dev/dma_heap/system"
+
 static const struct {
 	uint32_t mask;
 	const char *str;
@@ -267,7 +273,20 @@ int video_open(struct instance *i, char *name)
 {
 	struct v4l2_capability cap;
 
-	i->video.fd = open(name, O_RDWR, 0);
+	switch (i->video.alloc) {
+	case VIDEO_ALLOC_ION:
+		i->video.memory = V4L2_MEMORY_USERPTR;
+		break;
+	case VIDEO_ALLOC_MMAP:
+		i->video.memory = V4L2_MEMORY_MMAP;
+		break;
+	case VIDEO_ALLOC_DMABUF:
+		i->video.memory = V4L2_MEMORY_DMABUF;
+		break;
+	}
+
+	/* non-blocking, buffers are dequeued until none is left */
+	i->video.fd = open(name, O_RDWR | O_NONBLOCK, 0);
 	if (i->video.fd < 0) {
 		err("Failed to open video decoder: %s", name);
 		return -1;
@@ -279,6 +298,22 @@ int video_open(struct instance *i, char *name)
 		return -1;
 	}
 
+	i->video.msm = !strcmp((char *)cap.driver, "msm_vidc_driver");
+
+	if (!i->video.msm && i->video.alloc == VIDEO_ALLOC_ION) {
+		err("ion buffers are only supported by the MSM driver, "
+		    "use mmap or dmabuf");
+		return -1;
+	}
+
+	/* adaptive playback relies on MSM driver controls */
+	if (!i->video.msm && i->max_width) {
+		info("adaptive playback is only supported by the MSM driver, "
+		     "ignoring -A");
+		i->max_width = 0;
+		i->max_height = 0;
+	}
+
 	dbg("caps (%s): driver=\"%s\" bus_info=\"%s\" card=\"%s\" "
 	    "version=%u.%u.%u", name, cap.driver, cap.bus_info, cap.card,
 	    (cap.version >> 16) & 0xff,
@@ -368,10 +403,50 @@ int video_set_secure(struct instance *i)
 	return 0;
 }
 
+int video_set_iframe_only(struct instance *i, int enable)
+{
+	struct v4l2_control control = {0};
+
+	control.id = V4L2_CID_MPEG_VIDC_VIDEO_PICTYPE_DEC_MODE;
+	control.value = enable ? V4L2_MPEG_VIDC_VIDEO_PICTYPE_DECODE_ON :
+				 V4L2_MPEG_VIDC_VIDEO_PICTYPE_DECODE_OFF;
+
+	if (ioctl(i->video.fd, VIDIOC_S_CTRL, &control) < 0) {
+		err("failed to set skip mode: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+int video_set_perf_level(struct instance *i, int turbo)
+{
+	struct v4l2_control control = {0};
+
+	control.id = V4L2_CID_MPEG_VIDC_SET_PERF_LEVEL;
+	control.value = turbo ? V4L2_CID_MPEG_VIDC_PERF_LEVEL_TURBO :
+				V4L2_CID_MPEG_VIDC_PERF_LEVEL_NOMINAL;
+
+	if (ioctl(i->video.fd, VIDIOC_S_CTRL, &control) < 0) {
+		err("failed to set perf level: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
 int video_set_control(struct instance *i)
 {
 	struct v4l2_control control = {0};
 
+	if (!i->video.msm) {
+		if (i->decode_order || i->skip_frames ||
+		    i->continue_data_transfer)
+			info("decoder options are only supported by the "
+			     "MSM driver, ignoring");
+		return 0;
+	}
+
 	if (i->decode_order) {
 		control.id = V4L2_CID_MPEG_VIDC_VIDEO_OUTPUT_ORDER;
 		control.value = V4L2_MPEG_VIDC_VIDEO_OUTPUT_ORDER_DECODE;
@@ -382,15 +457,8 @@ int video_set_control(struct instance *i)
 		}
 	}
 
-	if (i->skip_frames) {
-		control.id = V4L2_CID_MPEG_VIDC_VIDEO_PICTYPE_DEC_MODE;
-		control.value = V4L2_MPEG_VIDC_VIDEO_PICTYPE_DECODE_ON;
-
-		if (ioctl(i->video.fd, VIDIOC_S_CTRL, &control) < 0) {
-			err("failed to set skip mode: %m");
-			return -1;
-		}
-	}
+	if (i->skip_frames && video_set_iframe_only(i, 1))
+		return -1;
 
 	control.id = V4L2_CID_MPEG_VIDC_VIDEO_CONTINUE_DATA_TRANSFER;
 	control.value = i->continue_data_transfer;
@@ -400,13 +468,8 @@ int video_set_control(struct instance *i)
 		return -1;
 	}
 
-	control.id = V4L2_CID_MPEG_VIDC_SET_PERF_LEVEL;
-	control.value = V4L2_CID_MPEG_VIDC_PERF_LEVEL_TURBO;
-
-	if (ioctl(i->video.fd, VIDIOC_S_CTRL, &control) < 0) {
-		err("failed to set perf level: %m");
+	if (video_set_perf_level(i, 1))
 		return -1;
-	}
 
 	control.id = V4L2_CID_MPEG_VIDC_VIDEO_CONCEAL_COLOR;
 	control.value = 0x00ff;
@@ -690,8 +753,9 @@ static int video_count_output_queued_bufs(struct video *vid)
 	return out_queued;
 }
 
-int video_queue_buf_out(struct instance *i, int n, int length,
-			uint32_t flags, struct timeval timestamp)
+int video_queue_buf_out_request(struct instance *i, int n, int length,
+				uint32_t flags, struct timeval timestamp,
+				int request_fd)
 {
 	struct video *vid = &i->video;
 	enum v4l2_buf_type type;
@@ -709,14 +773,24 @@ int video_queue_buf_out(struct instance *i, int n, int length,
 	memzero(buf);
 	memset(planes, 0, sizeof(planes));
 	buf.type = type;
-	buf.memory = V4L2_MEMORY_USERPTR;
+	buf.memory = vid->memory;
 	buf.index = n;
 	buf.length = 1;
 	buf.m.planes = planes;
 
-	buf.m.planes[0].m.userptr = (unsigned long)vid->out_ion_addr;
-	buf.m.planes[0].reserved[0] = vid->out_ion_fd;
-	buf.m.planes[0].reserved[1] = vid->out_buf_off[n];
+	switch (vid->alloc) {
+	case VIDEO_ALLOC_ION:
+		buf.m.planes[0].m.userptr = (unsigned long)vid->out_ion_addr;
+		buf.m.planes[0].reserved[0] = vid->out_ion_fd;
+		buf.m.planes[0].reserved[1] = vid->out_buf_off[n];
+		break;
+	case VIDEO_ALLOC_DMABUF:
+		buf.m.planes[0].m.fd = vid->out_buf_fd[n];
+		break;
+	case VIDEO_ALLOC_MMAP:
+		break;
+	}
+
 	buf.m.planes[0].length = vid->out_buf_size;
 	buf.m.planes[0].bytesused = length;
 	buf.m.planes[0].data_offset = 0;
@@ -724,9 +798,25 @@ int video_queue_buf_out(struct instance *i, int n, int length,
 	buf.flags = flags;
 	buf.timestamp = timestamp;
 
+#ifdef V4L2_BUF_FLAG_REQUEST_FD
+	if (request_fd >= 0) {
+		buf.flags |= V4L2_BUF_FLAG_REQUEST_FD;
+		buf.request_fd = request_fd;
+	}
+#else
+	if (request_fd >= 0) {
+		err("requests are not supported by the kernel headers");
+		return -1;
+	}
+#endif
+
+	/* the buffer can be dequeued as soon as it is queued */
+	vid->out_buf_flag[n] = 1;
+
 	if (ioctl(vid->fd, VIDIOC_QBUF, &buf) < 0) {
 		err("failed to queue %s buffer (index=%d): %m",
 		    buf_type_to_string(buf.type), buf.index);
+		vid->out_buf_flag[n] = 0;
 		return -1;
 	}
 
@@ -740,6 +830,12 @@ int video_queue_buf_out(struct instance *i, int n, int length,
 	return 0;
 }
 
+int video_queue_buf_out(struct instance *i, int n, int length,
+			uint32_t flags, struct timeval timestamp)
+{
+	return video_queue_buf_out_request(i, n, length, flags, timestamp, -1);
+}
+
 int video_queue_buf_cap(struct instance *i, int n)
 {
 	struct video *vid = &i->video;
@@ -758,21 +854,31 @@ int video_queue_buf_cap(struct instance *i, int n)
 	memzero(buf);
 	memset(planes, 0, sizeof(planes));
 	buf.type = type;
-	buf.memory = V4L2_MEMORY_USERPTR;
+	buf.memory = vid->memory;
 	buf.index = n;
-	buf.length = 2;
+	buf.length = vid->cap_mem_planes;
 	buf.m.planes = planes;
 
-	buf.m.planes[0].m.userptr = i->secure ?
-		(unsigned long)vid->cap_buf_fd[n] :
-		(unsigned long)vid->cap_buf_addr[n];
-	buf.m.planes[0].reserved[0] = vid->cap_buf_fd[n];
-	buf.m.planes[0].reserved[1] = 0;
+	switch (vid->alloc) {
+	case VIDEO_ALLOC_ION:
+		buf.m.planes[0].m.userptr = i->secure ?
+			(unsigned long)vid->cap_buf_fd[n] :
+			(unsigned long)vid->cap_buf_addr[n];
+		buf.m.planes[0].reserved[0] = vid->cap_buf_fd[n];
+		buf.m.planes[0].reserved[1] = 0;
+		break;
+	case VIDEO_ALLOC_DMABUF:
+		buf.m.planes[0].m.fd = vid->cap_buf_fd[n];
+		break;
+	case VIDEO_ALLOC_MMAP:
+		break;
+	}
+
 	buf.m.planes[0].length = vid->cap_buf_size;
 	buf.m.planes[0].bytesused = vid->cap_buf_size;
 	buf.m.planes[0].data_offset = 0;
 
-	if (vid->extradata_index) { // Should be 1
+	if (vid->extradata_index > 0) { // Should be 1
 		buf.m.planes[vid->extradata_index].m.userptr = (unsigned long)vid->extradata_ion_addr;
 		buf.m.planes[vid->extradata_index].reserved[0] = vid->extradata_ion_fd;
 		buf.m.planes[vid->extradata_index].reserved[1] = vid->extradata_off[n];
@@ -802,6 +908,11 @@ static int video_dequeue_buf(struct instance *i, struct v4l2_buffer *buf)
 
 	ret = ioctl(vid->fd, VIDIOC_DQBUF, buf);
 	if (ret < 0) {
+		/* no buffer ready, or the last buffer has already been
+		 * dequeued */
+		if (errno == EAGAIN || errno == EPIPE)
+			return -errno;
+
 		err("failed to dequeue buffer on %s queue: %m",
 		    buf_type_to_string(buf->type));
 		return -errno;
@@ -809,6 +920,7 @@ static int video_dequeue_buf(struct instance *i, struct v4l2_buffer *buf)
 
 	switch (buf->type) {
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+		vid->out_buf_flag[buf->index] = 0;
 		dbg("%s: dequeued buffer %d, %d/%d queued",
 		    buf_type_to_string(buf->type), buf->index,
 		    video_count_output_queued_bufs(vid), vid->out_buf_cnt);
@@ -836,7 +948,7 @@ int video_dequeue_output(struct instance *i, int *n)
 
 	memzero(buf);
 	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	buf.memory = V4L2_MEMORY_USERPTR;
+	buf.memory = i->video.memory;
 	buf.m.planes = planes;
 	buf.length = OUT_PLANES;
 
@@ -858,15 +970,17 @@ int video_dequeue_capture(struct instance *i, int *n, unsigned int *bytesused,
 	struct v4l2_plane planes[CAP_PLANES];
 	void *extradata_addr;
 	bool extradata_valid;
+	int ret;
 
 	memzero(buf);
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	buf.memory = V4L2_MEMORY_USERPTR;
+	buf.memory = vid->memory;
 	buf.m.planes = planes;
 	buf.length = CAP_PLANES;
 
-	if (video_dequeue_buf(i, &buf))
-		return -1;
+	ret = video_dequeue_buf(i, &buf);
+	if (ret < 0)
+		return ret;
 
 	*bytesused = buf.m.planes[0].bytesused;
 	*n = buf.index;
@@ -932,6 +1046,43 @@ int video_flush(struct instance *i, uint32_t flags)
 	return 0;
 }
 
+int video_stop_decoder(struct instance *i)
+{
+	struct video *vid = &i->video;
+	struct v4l2_decoder_cmd dec;
+
+	dbg("stopping decoder");
+
+	memzero(dec);
+	dec.cmd = V4L2_DEC_CMD_STOP;
+	if (ioctl(vid->fd, VIDIOC_DECODER_CMD, &dec) < 0) {
+		err("failed to stop decoder: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+int video_get_capture_size(struct instance *i, int *w, int *h)
+{
+	struct video *vid = &i->video;
+	struct v4l2_format fmt;
+
+	memzero(fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	if (ioctl(vid->fd, VIDIOC_G_FMT, &fmt) < 0) {
+		err("failed to get %s format: %m",
+		    buf_type_to_string(fmt.type));
+		return -1;
+	}
+
+	*w = fmt.fmt.pix_mp.width;
+	*h = fmt.fmt.pix_mp.height;
+
+	return 0;
+}
+
 static int
 alloc_ion_buffer(struct instance *i, size_t size, uint32_t flags)
 {
@@ -987,6 +1138,207 @@ alloc_ion_buffer(struct instance *i, size_t size, uint32_t flags)
 	return ret;
 }
 
+static int
+alloc_dma_heap_buffer(size_t size)
+{
+#ifdef DMA_HEAP_IOCTL_ALLOC
+	struct dma_heap_allocation_data heap_alloc = { 0 };
+	static int heap_fd = -1;
+
+	if (heap_fd < 0) {
+		heap_fd = open(DMA_HEAP_PATH, O_RDONLY | O_CLOEXEC);
+		if (heap_fd < 0) {
+			err("Cannot open %s: %m", DMA_HEAP_PATH);
+			return -1;
+		}
+	}
+
+	heap_alloc.len = size;
+	heap_alloc.fd_flags = O_RDWR | O_CLOEXEC;
+
+	if (ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &heap_alloc) < 0) {
+		err("Failed to allocate dma-buf: %m");
+		return -1;
+	}
+
+	dbg("Allocated %zu bytes dma-buf %d", size, heap_alloc.fd);
+
+	return heap_alloc.fd;
+#else
+	(void)size;
+	err("dma-buf heaps are not supported by the kernel headers");
+	return -1;
+#endif
+}
+
+/* Export plane 0 of a driver allocated buffer as a dma-buf */
+static int
+video_export_buf(struct instance *i, enum v4l2_buf_type type, int index)
+{
+	struct v4l2_exportbuffer expbuf;
+
+	memzero(expbuf);
+	expbuf.type = type;
+	expbuf.index = index;
+	expbuf.plane = 0;
+	expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+	if (ioctl(i->video.fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+		err("failed to export %s buffer %d: %m",
+		    buf_type_to_string(type), index);
+		return -1;
+	}
+
+	return expbuf.fd;
+}
+
+/* Map plane 0 of a buffer, through its dma-buf fd or, if fd is negative,
+ * through the video device for driver allocated buffers */
+static void *
+video_map_buf(struct instance *i, enum v4l2_buf_type type, int index,
+	      int fd, size_t size, int prot)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	off_t offset = 0;
+	void *addr;
+
+	if (fd < 0) {
+		memzero(buf);
+		memset(planes, 0, sizeof (planes));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = index;
+		buf.length = VIDEO_MAX_PLANES;
+		buf.m.planes = planes;
+
+		if (ioctl(i->video.fd, VIDIOC_QUERYBUF, &buf) < 0) {
+			err("failed to query %s buffer %d: %m",
+			    buf_type_to_string(type), index);
+			return NULL;
+		}
+
+		fd = i->video.fd;
+		offset = planes[0].m.mem_offset;
+	}
+
+	addr = mmap(NULL, size, prot, MAP_SHARED, fd, offset);
+	if (addr == MAP_FAILED) {
+		err("failed to map %s buffer %d: %m",
+		    buf_type_to_string(type), index);
+		return NULL;
+	}
+
+	return addr;
+}
+
+/*
+ * ION and dma-buf heap capture buffers are allocated in size classes, four
+ * per power of two, and go back to a pool when the CAPTURE queue is torn
+ * down. A reconfiguration to the same or a slightly larger resolution then
+ * reuses them instead of allocating new ones, and as their ids are kept,
+ * the display can keep the buffers it imported from them.
+ */
+static size_t
+cap_size_class(size_t size)
+{
+	size_t step = 4096;
+
+	while (step * 8 < size)
+		step *= 2;
+
+	return (size + step - 1) & ~(step - 1);
+}
+
+/* Free the unused pool buffers smaller than size */
+static void
+cap_pool_trim(struct instance *i, size_t size)
+{
+	struct video *vid = &i->video;
+	struct cap_buf *cb;
+	int n = 0;
+
+	while (n < vid->cap_pool_count) {
+		cb = &vid->cap_pool[n];
+
+		if (cb->index >= 0 || cb->size >= size) {
+			n++;
+			continue;
+		}
+
+		dbg("freeing capture buffer %d (%zu bytes)", cb->id, cb->size);
+
+		if (cb->addr && munmap(cb->addr, cb->size))
+			err("failed to unmap capture buffer: %m");
+		if (close(cb->fd) < 0)
+			err("failed to close capture buffer: %m");
+
+		*cb = vid->cap_pool[--vid->cap_pool_count];
+	}
+}
+
+/* Take the smallest unused pool buffer of at least size bytes for V4L2
+ * buffer index, allocating one if there is none */
+static struct cap_buf *
+cap_pool_get(struct instance *i, int index, size_t size, uint32_t ion_flags,
+	     int *reused)
+{
+	struct video *vid = &i->video;
+	struct cap_buf *cb = NULL;
+	size_t alloc_size;
+	int fd;
+
+	for (int n = 0; n < vid->cap_pool_count; n++) {
+		struct cap_buf *c = &vid->cap_pool[n];
+
+		if (c->index < 0 && c->size >= size &&
+		    (!cb || c->size < cb->size))
+			cb = c;
+	}
+
+	if (cb) {
+		(*reused)++;
+		cb->index = index;
+		return cb;
+	}
+
+	if (vid->cap_pool_count == MAX_CAP_BUF) {
+		err("capture buffer pool is full");
+		return NULL;
+	}
+
+	alloc_size = cap_size_class(size);
+
+	if (vid->alloc == VIDEO_ALLOC_ION)
+		fd = alloc_ion_buffer(i, alloc_size, ion_flags);
+	else
+		fd = alloc_dma_heap_buffer(alloc_size);
+
+	if (fd < 0)
+		return NULL;
+
+	cb = &vid->cap_pool[vid->cap_pool_count];
+	cb->fd = fd;
+	cb->size = alloc_size;
+
+	if (!i->secure) {
+		cb->addr = video_map_buf(i, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+					 index, fd, alloc_size, PROT_READ);
+		if (!cb->addr) {
+			close(fd);
+			return NULL;
+		}
+	} else {
+		cb->addr = NULL;
+	}
+
+	cb->id = vid->cap_buf_next_id++;
+	cb->index = index;
+	vid->cap_pool_count++;
+
+	return cb;
+}
+
 static int setup_extradata(struct instance *i, int index, int size)
 {
 	struct video *vid = &i->video;
@@ -1021,16 +1373,18 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 	struct v4l2_format fmt;
 	struct v4l2_pix_format_mplane *pix;
 	struct v4l2_requestbuffers reqbuf;
-	int ion_fd;
+	int buf_fd;
 	uint32_t ion_flags;
 	void *buf_addr;
+	int reused = 0;
 	int n, extra_idx;
 
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 
-	video_set_dpb(i, i->depth == 10 ?
-		      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_TP10_UBWC :
-		      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_NONE);
+	if (vid->alloc == VIDEO_ALLOC_ION)
+		video_set_dpb(i, i->depth == 10 ?
+			      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_TP10_UBWC :
+			      V4L2_MPEG_VIDC_VIDEO_DPB_COLOR_FMT_NONE);
 
 	memzero(fmt);
 	fmt.type = type;
@@ -1038,7 +1392,10 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 	pix->height = h;
 	pix->width = w;
 
-	if (i->depth == 10)
+	/* UBWC formats are only available with ION buffers on MSM */
+	if (vid->alloc != VIDEO_ALLOC_ION)
+		pix->pixelformat = V4L2_PIX_FMT_NV12;
+	else if (i->depth == 10)
 		pix->pixelformat = V4L2_PIX_FMT_NV12_TP10_UBWC;
 	else if (!i->interlaced)
 		pix->pixelformat = V4L2_PIX_FMT_NV12_UBWC;
@@ -1054,7 +1411,7 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 	memzero(reqbuf);
 	reqbuf.count = num_buffers;
 	reqbuf.type = type;
-	reqbuf.memory = V4L2_MEMORY_USERPTR;
+	reqbuf.memory = vid->memory;
 
 	if (ioctl(vid->fd, VIDIOC_REQBUFS, &reqbuf) < 0) {
 		err("failed to request %s buffers: %m",
@@ -1065,6 +1422,12 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 	dbg("%s: requested %d buffers, got %d", buf_type_to_string(type),
 	    num_buffers, reqbuf.count);
 
+	if (reqbuf.count > MAX_CAP_BUF) {
+		err("too many %s buffers (%d)", buf_type_to_string(type),
+		    reqbuf.count);
+		return -1;
+	}
+
 	vid->cap_buf_cnt = reqbuf.count;
 
 	if (ioctl(vid->fd, VIDIOC_G_FMT, &fmt) < 0) {
@@ -1083,6 +1446,14 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 		    pix->plane_fmt[n].bytesperline,
 		    pix->plane_fmt[n].reserved[0]);
 
+	if (pix->num_planes > CAP_PLANES ||
+	    (vid->alloc != VIDEO_ALLOC_ION && pix->num_planes > 1)) {
+		err("unsupported number of %s planes (%d)",
+		    buf_type_to_string(type), pix->num_planes);
+		return -1;
+	}
+
+	vid->cap_mem_planes = pix->num_planes;
 	vid->cap_buf_format = pix->pixelformat;
 	vid->cap_w = pix->width;
 	vid->cap_h = pix->height;
@@ -1097,8 +1468,10 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 		/* Y plane */
 		vid->cap_plane_off[0] = 0;
 		vid->cap_plane_stride[0] = pix->plane_fmt[0].bytesperline;
-		/* UV plane */
-		vid->cap_plane_off[1] = pix->plane_fmt[0].reserved[0] *
+		/* UV plane, MSM reports the number of scanlines in the
+		 * reserved field, other drivers do not pad */
+		vid->cap_plane_off[1] = (pix->plane_fmt[0].reserved[0] ?:
+					 pix->height) *
 			pix->plane_fmt[0].bytesperline;
 		vid->cap_plane_stride[1] = pix->plane_fmt[0].bytesperline;
 		break;
@@ -1117,33 +1490,61 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 	else
 		ion_flags = 0;
 
+	/* unused buffers too small for the new format can go now, the
+	 * others may be reused */
+	if (vid->alloc != VIDEO_ALLOC_MMAP)
+		cap_pool_trim(i, vid->cap_buf_size);
+
 	for (n = 0; n < vid->cap_buf_cnt; n++) {
-		ion_fd = alloc_ion_buffer(i, vid->cap_buf_size, ion_flags);
-		if (ion_fd < 0)
+		if (vid->alloc != VIDEO_ALLOC_MMAP) {
+			struct cap_buf *cb;
+
+			cb = cap_pool_get(i, n, vid->cap_buf_size, ion_flags,
+					  &reused);
+			if (!cb)
+				return -1;
+
+			vid->cap_buf_fd[n] = cb->fd;
+			vid->cap_buf_addr[n] = cb->addr;
+			vid->cap_buf_id[n] = cb->id;
+			continue;
+		}
+
+		/* driver allocated buffers are freed with the queue and
+		 * cannot be pooled */
+		buf_fd = video_export_buf(i, type, n);
+		if (buf_fd < 0)
 			return -1;
 
 		if (!i->secure) {
-			buf_addr = mmap(NULL, vid->cap_buf_size, PROT_READ,
-					MAP_SHARED, ion_fd, 0);
-			if (buf_addr == MAP_FAILED) {
-				err("failed to map %s buffer: %m",
-				    buf_type_to_string(type));
-				close(ion_fd);
+			buf_addr = video_map_buf(i, type, n, -1,
+						 vid->cap_buf_size, PROT_READ);
+			if (!buf_addr) {
+				close(buf_fd);
 				return -1;
 			}
 		} else {
 			buf_addr = NULL;
 		}
 
-		vid->cap_buf_fd[n] = ion_fd;
+		vid->cap_buf_fd[n] = buf_fd;
 		vid->cap_buf_addr[n] = buf_addr;
+		vid->cap_buf_id[n] = vid->cap_buf_next_id++;
+	}
+
+	if (vid->alloc != VIDEO_ALLOC_MMAP) {
+		cap_pool_trim(i, SIZE_MAX);
+		dbg("%s: reused %d pooled buffers, allocated %d",
+		    buf_type_to_string(type), reused,
+		    vid->cap_buf_cnt - reused);
 	}
 
 	dbg("%s: succesfully mmapped %d buffers", buf_type_to_string(type),
 	    vid->cap_buf_cnt);
 
 	extra_idx = EXTRADATA_IDX(pix->num_planes);
-	if (extra_idx && (extra_idx < VIDEO_MAX_PLANES)) {
+	if (vid->alloc == VIDEO_ALLOC_ION &&
+	    extra_idx && (extra_idx < VIDEO_MAX_PLANES)) {
 		dbg("%s: extradata plane is %d (size=%d)",
 		    buf_type_to_string(type), extra_idx,
 		    pix->plane_fmt[extra_idx].sizeimage);
@@ -1154,6 +1555,36 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h)
 	return 0;
 }
 
+static void
+video_release_capture_bufs(struct instance *i)
+{
+	struct video *vid = &i->video;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	for (int n = 0; n < vid->cap_buf_cnt; n++) {
+		/* pooled buffers are only freed by cap_pool_trim() */
+		if (vid->alloc == VIDEO_ALLOC_MMAP) {
+			if (vid->cap_buf_addr[n] &&
+			    munmap(vid->cap_buf_addr[n], vid->cap_buf_size))
+				err("failed to unmap %s buffer: %m",
+				    buf_type_to_string(type));
+
+			if (close(vid->cap_buf_fd[n]) < 0)
+				err("failed to close %s buffer: %m",
+				    buf_type_to_string(type));
+		}
+
+		vid->cap_buf_fd[n] = -1;
+		vid->cap_buf_addr[n] = NULL;
+		vid->cap_buf_flag[n] = 0;
+		vid->cap_buf_held[n] = 0;
+	}
+
+	/* back to the pool */
+	for (int n = 0; n < vid->cap_pool_count; n++)
+		vid->cap_pool[n].index = -1;
+}
+
 int video_stop_capture(struct instance *i)
 {
 	struct video *vid = &i->video;
@@ -1165,8 +1596,12 @@ int video_stop_capture(struct instance *i)
 	if (video_stream(i, type, VIDIOC_STREAMOFF))
 		return -1;
 
+	/* driver allocated buffers cannot be freed while mapped */
+	if (vid->memory == V4L2_MEMORY_MMAP)
+		video_release_capture_bufs(i);
+
 	memzero(reqbuf);
-	reqbuf.memory = V4L2_MEMORY_USERPTR;
+	reqbuf.memory = vid->memory;
 	reqbuf.type = type;
 
 	if (ioctl(vid->fd, VIDIOC_REQBUFS, &reqbuf) < 0) {
@@ -1175,20 +1610,10 @@ int video_stop_capture(struct instance *i)
 		return -1;
 	}
 
-	for (int n = 0; n < vid->cap_buf_cnt; n++) {
-		if (munmap(vid->cap_buf_addr[n], vid->cap_buf_size))
-			err("failed to unmap %s buffer: %m",
-			    buf_type_to_string(type));
-
-		if (close(vid->cap_buf_fd[n]) < 0)
-			err("failed to close %s ion buffer: %m",
-			    buf_type_to_string(type));
-
-		vid->cap_buf_fd[n] = -1;
-		vid->cap_buf_addr[n] = NULL;
-		vid->cap_buf_flag[n] = 0;
-	}
+	if (vid->memory != V4L2_MEMORY_MMAP)
+		video_release_capture_bufs(i);
 
+	vid->cap_mem_planes = 0;
 	vid->cap_planes_count = 0;
 	vid->cap_buf_size = 0;
 	vid->cap_buf_cnt = 0;
@@ -1196,6 +1621,16 @@ int video_stop_capture(struct instance *i)
 	return 0;
 }
 
+void video_free_capture_pool(struct instance *i)
+{
+	struct video *vid = &i->video;
+
+	for (int n = 0; n < vid->cap_pool_count; n++)
+		vid->cap_pool[n].index = -1;
+
+	cap_pool_trim(i, SIZE_MAX);
+}
+
 int video_setup_output(struct instance *i, unsigned long codec,
 		       unsigned int size, int count)
 {
@@ -1233,7 +1668,7 @@ int video_setup_output(struct instance *i, unsigned long codec,
 	memzero(reqbuf);
 	reqbuf.count = count;
 	reqbuf.type = type;
-	reqbuf.memory = V4L2_MEMORY_USERPTR;
+	reqbuf.memory = vid->memory;
 
 	if (ioctl(vid->fd, VIDIOC_REQBUFS, &reqbuf) < 0) {
 		err("failed to request %s buffers: %m",
@@ -1246,26 +1681,57 @@ int video_setup_output(struct instance *i, unsigned long codec,
 	dbg("%s: requested %d buffers, got %d", buf_type_to_string(type),
 	    count, reqbuf.count);
 
-	ion_size = vid->out_buf_cnt * vid->out_buf_size;
-	ion_fd = alloc_ion_buffer(i, ion_size, 0);
-	if (ion_fd < 0)
-		return -1;
+	ring_init(&vid->out_free);
 
-	buf_addr = mmap(NULL, ion_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-			ion_fd, 0);
-	if (buf_addr == MAP_FAILED) {
-		err("failed to map %s buffer: %m", buf_type_to_string(type));
-		return -1;
-	}
+	for (n = 0; n < MAX_OUT_BUF; n++)
+		vid->out_buf_fd[n] = -1;
+
+	if (vid->alloc == VIDEO_ALLOC_ION) {
+		/* a single ION buffer holds all the OUTPUT buffers */
+		ion_size = vid->out_buf_cnt * vid->out_buf_size;
+		ion_fd = alloc_ion_buffer(i, ion_size, 0);
+		if (ion_fd < 0)
+			return -1;
 
-	vid->out_ion_fd = ion_fd;
-	vid->out_ion_size = ion_size;
-	vid->out_ion_addr = buf_addr;
+		buf_addr = mmap(NULL, ion_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, ion_fd, 0);
+		if (buf_addr == MAP_FAILED) {
+			err("failed to map %s buffer: %m",
+			    buf_type_to_string(type));
+			return -1;
+		}
+
+		vid->out_ion_fd = ion_fd;
+		vid->out_ion_size = ion_size;
+		vid->out_ion_addr = buf_addr;
+	}
 
 	for (n = 0; n < vid->out_buf_cnt; n++) {
-		vid->out_buf_off[n] = n * vid->out_buf_size;
-		vid->out_buf_addr[n] = buf_addr + vid->out_buf_off[n];
+		switch (vid->alloc) {
+		case VIDEO_ALLOC_ION:
+			vid->out_buf_off[n] = n * vid->out_buf_size;
+			vid->out_buf_addr[n] = vid->out_ion_addr +
+					       vid->out_buf_off[n];
+			break;
+		case VIDEO_ALLOC_DMABUF:
+			vid->out_buf_fd[n] =
+				alloc_dma_heap_buffer(vid->out_buf_size);
+			if (vid->out_buf_fd[n] < 0)
+				return -1;
+			/* fall through */
+		case VIDEO_ALLOC_MMAP:
+			vid->out_buf_off[n] = 0;
+			vid->out_buf_addr[n] =
+				video_map_buf(i, type, n, vid->out_buf_fd[n],
+					      vid->out_buf_size,
+					      PROT_READ | PROT_WRITE);
+			if (!vid->out_buf_addr[n])
+				return -1;
+			break;
+		}
+
 		vid->out_buf_flag[n] = 0;
+		ring_push(&vid->out_free, n);
 	}
 
 	dbg("%s: succesfully mmapped %d buffers", buf_type_to_string(type),
@@ -1274,6 +1740,29 @@ int video_setup_output(struct instance *i, unsigned long codec,
 	return 0;
 }
 
+static void
+video_release_output_bufs(struct instance *i)
+{
+	struct video *vid = &i->video;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+	for (int n = 0; n < vid->out_buf_cnt; n++) {
+		if (vid->alloc != VIDEO_ALLOC_ION && vid->out_buf_addr[n] &&
+		    munmap(vid->out_buf_addr[n], vid->out_buf_size))
+			err("failed to unmap %s buffer: %m",
+			    buf_type_to_string(type));
+
+		if (vid->out_buf_fd[n] >= 0 && close(vid->out_buf_fd[n]) < 0)
+			err("failed to close %s buffer: %m",
+			    buf_type_to_string(type));
+
+		vid->out_buf_fd[n] = -1;
+		vid->out_buf_flag[n] = 0;
+		vid->out_buf_off[n] = 0;
+		vid->out_buf_addr[n] = NULL;
+	}
+}
+
 int video_stop_output(struct instance *i)
 {
 	struct video *vid = &i->video;
@@ -1285,8 +1774,12 @@ int video_stop_output(struct instance *i)
 	if (video_stream(i, type, VIDIOC_STREAMOFF))
 		return -1;
 
+	/* driver allocated buffers cannot be freed while mapped */
+	if (vid->memory == V4L2_MEMORY_MMAP)
+		video_release_output_bufs(i);
+
 	memzero(reqbuf);
-	reqbuf.memory = V4L2_MEMORY_USERPTR;
+	reqbuf.memory = vid->memory;
 	reqbuf.type = type;
 
 	if (ioctl(vid->fd, VIDIOC_REQBUFS, &reqbuf) < 0) {
@@ -1307,17 +1800,16 @@ int video_stop_output(struct instance *i)
 			    buf_type_to_string(type));
 	}
 
-	for (int n = 0; n < vid->out_buf_cnt; n++) {
-		vid->out_buf_flag[n] = 0;
-		vid->out_buf_off[n] = 0;
-		vid->out_buf_addr[n] = NULL;
-	}
+	if (vid->memory != V4L2_MEMORY_MMAP)
+		video_release_output_bufs(i);
 
 	vid->out_ion_fd = -1;
 	vid->out_ion_size = 0;
 	vid->out_ion_addr = NULL;
 	vid->out_buf_cnt = 0;
 
+	ring_init(&vid->out_free);
+
 	return 0;
 }
 
@@ -1343,8 +1835,9 @@ int video_dequeue_event(struct instance *i, struct v4l2_event *ev)
 	memset(ev, 0, sizeof (*ev));
 
 	if (ioctl(vid->fd, VIDIOC_DQEVENT, ev) < 0) {
-		err("failed to dequeue event: %m");
-		return -1;
+		if (errno != ENOENT)
+			err("failed to dequeue event: %m");
+		return -errno;
 	}
 
 	return 0;
@@ -51,13 +51,22 @@ int video_setup_capture(struct instance *i, int num_buffers, int w, int h);
 /* Stop OUTPUT queue and release buffers */
 int video_stop_output(struct instance *i);
 
-/* Stop CAPTURE queue and release buffers */
+/* Stop CAPTURE queue and release buffers; ION and dma-buf heap buffers
+ * are kept for the next video_setup_capture() */
 int video_stop_capture(struct instance *i);
 
+/* Free the capture buffers kept across video_stop_capture() */
+void video_free_capture_pool(struct instance *i);
+
 /* Queue OUTPUT buffer */
 int video_queue_buf_out(struct instance *i, int n, int length,
 			uint32_t flags, struct timeval ts);
 
+/* Queue OUTPUT buffer as part of a media request */
+int video_queue_buf_out_request(struct instance *i, int n, int length,
+				uint32_t flags, struct timeval ts,
+				int request_fd);
+
 /* Queue CAPTURE buffer */
 int video_queue_buf_cap(struct instance *i, int n);
 
@@ -67,18 +76,31 @@ int video_stream(struct instance *i, enum v4l2_buf_type type, int status);
 /* Flush a queue */
 int video_flush(struct instance *i, uint32_t flags);
 
+/* Drain a standard stateful decoder, the last CAPTURE buffer is flagged
+ * with V4L2_BUF_FLAG_LAST */
+int video_stop_decoder(struct instance *i);
+
+/* Get the coded size of the CAPTURE queue, after a source change */
+int video_get_capture_size(struct instance *i, int *w, int *h);
+
 /* Dequeue a buffer, the structure *buf is used to return the parameters of the
- * dequeued buffer. */
+ * dequeued buffer. Returns -EAGAIN if no buffer is ready. */
 int video_dequeue_output(struct instance *i, int *n);
 int video_dequeue_capture(struct instance *i, int *n, unsigned int *bytesused,
 			  uint32_t *flags, struct timeval *ts,
 			  struct msm_vidc_extradata_header **extradata);
 
-/* Dequeue a pending event */
+/* Dequeue a pending event, returns -ENOENT if there is none */
 int video_dequeue_event(struct instance *i, struct v4l2_event *ev);
 
 int video_set_framerate(struct instance *i, int num, int den);
 int video_set_control(struct instance *i);
+
+/* Decode the I-frames only, MSM only */
+int video_set_iframe_only(struct instance *i, int enable);
+
+/* Run the decoder at its turbo or nominal clock rate, MSM only */
+int video_set_perf_level(struct instance *i, int turbo);
 int video_set_secure(struct instance *i);
 int video_set_dpb(struct instance *i,
 		  enum v4l2_mpeg_vidc_video_dpb_color_format format);